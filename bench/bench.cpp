@@ -0,0 +1,1135 @@
+// Kaleidoscope的性能测试，以及生成测试用的源码
+// 编译: g++ -O2 -std=c++17 -pthread bench/bench.cpp kaleidoscope.cpp -o kbench
+//
+// 用法:
+//   kbench [-runs=N] [-filter=<前缀>]   运行所有(或名字以<前缀>开头的)测试
+//   kbench -emit=<workload>              把生成的源码输出到标准输出，可以直接交给toy
+//   kbench -diff=<N>                     用N个随机程序对各执行后端做差分测试，结果不同时返回1
+//
+// 源码由固定种子的随机数生成，每次运行的输入完全一样，输出的格式也固定，方便长期跟踪
+
+#include "../kaleidoscope.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace kaleidoscope;
+
+//=========
+// Workload generator
+//=========
+
+// 固定种子的随机数，保证每次生成的源码相同
+class Random {
+    uint64_t State;
+
+public:
+    explicit Random(uint64_t Seed) : State(Seed) {}
+
+    uint64_t next() {
+        State ^= State << 13;
+        State ^= State >> 7;
+        State ^= State << 17;
+        return State;
+    }
+
+    unsigned below(unsigned N) { return next() % N; }
+};
+
+static const char BinOps[] = {'+', '-', '*', '<'};
+
+// 很长的运算符链，运算符的优先级交替升降，ParseBinOpRHS会不断地递归和返回
+static std::string GenDeepChain() {
+    Random R(1);
+    std::string S;
+    for (int F = 0; F != 200; ++F) {
+        S += "def chain" + std::to_string(F) + "(x y)\n  x";
+        for (int I = 0; I != 2000; ++I) {
+            S += ' ';
+            S += BinOps[R.below(4)];
+            S += R.below(2) ? " y" : " x";
+        }
+        S += ";\n";
+    }
+    return S;
+}
+
+// 嵌套很深的括号，每一层都是一个右结合的子表达式，测试显式栈的开销
+static std::string GenNested() {
+    Random R(5);
+    std::string S;
+    for (int F = 0; F != 100; ++F) {
+        S += "def nest" + std::to_string(F) + "(x y)\n  ";
+        const int Depth = 5000;
+        for (int I = 0; I != Depth; ++I) {
+            S += R.below(2) ? "x " : "y ";
+            S += BinOps[R.below(4)];
+            S += " (";
+        }
+        S += "x";
+        S += std::string(Depth, ')');
+        S += ";\n";
+    }
+    return S;
+}
+
+// 参数很多的函数和对它的调用，主要测试ParseIdentifierExpr的参数列表
+static std::string GenWideCalls() {
+    const int NumArgs = 64;
+    std::string S = "def wide(";
+    for (int I = 0; I != NumArgs; ++I) {
+        S += (I ? " a" : "a") + std::to_string(I);
+    }
+    S += ") a0 + a63;\n";
+
+    Random R(2);
+    for (int F = 0; F != 2000; ++F) {
+        S += "def call" + std::to_string(F) + "(x) wide(";
+        for (int I = 0; I != NumArgs; ++I) {
+            if (I) {
+                S += ", ";
+            }
+            S += "x " + std::string(1, BinOps[R.below(3)]) + " " +
+                 std::to_string(R.below(100));
+        }
+        S += ");\n";
+    }
+    return S;
+}
+
+// 大量很小的定义
+static std::string GenManyDefs() {
+    std::string S;
+    for (int F = 0; F != 50000; ++F) {
+        std::string N = std::to_string(F);
+        S += "def f" + N + "(x y) x * " + N + " + y;\n";
+    }
+    return S;
+}
+
+// 注释比代码多得多的文件
+static std::string GenComments() {
+    std::string S;
+    for (int F = 0; F != 20000; ++F) {
+        for (int L = 0; L != 5; ++L) {
+            S += "# comment line " + std::to_string(L) +
+                 " describing the next definition in far too much detail\n";
+        }
+        S += "def c" + std::to_string(F) + "(x) x + 1;\n";
+    }
+    return S;
+}
+
+// 很长的数字常量
+static std::string GenLiterals() {
+    Random R(3);
+    std::string S;
+    for (int F = 0; F != 20000; ++F) {
+        std::string Num;
+        for (int I = 0; I != 60; ++I) {
+            Num += (char)('0' + R.below(10));
+            if (I == 30) {
+                Num += '.';
+            }
+        }
+        S += "def l" + std::to_string(F) + "(x) x * " + Num + ";\n";
+    }
+    return S;
+}
+
+// 以上各种定义混合，再加上对它们求值的顶层表达式
+static std::string GenMixed() {
+    std::string S = GenManyDefs() + GenWideCalls();
+    for (int I = 0; I != 5000; ++I) {
+        std::string N = std::to_string(I);
+        S += "f" + N + "(" + N + ", 2) + call" + std::to_string(I % 2000) +
+             "(1);\n";
+    }
+    return S;
+}
+
+// 随机的程序: 一组函数，body由内置运算、自定义运算符、内置函数、var、赋值、
+// 对之前定义的函数的调用以及map随机组成，用于差分测试和对比各执行后端
+// 调用只指向之前定义的、开销(展开之后执行的节点数)不大的函数，每个函数的执行时间都有上限
+class ProgramGenerator {
+public:
+    struct Fn {
+        std::string Name;
+        unsigned NumArgs;
+        double Cost;
+    };
+
+    explicit ProgramGenerator(uint64_t Seed) : R(Seed) {}
+
+    std::string generate(unsigned NumFns) {
+        std::string S = "def binary| 5 (a b) a * a + b;\n"
+                        "def unary~(v) 0 - v;\n"
+                        "def binary@ 15 (a b) fmax(a, b) - fmin(a, b) * 0.5;\n";
+        for (unsigned I = 0; I != NumFns; ++I) {
+            std::vector<std::string> Vars;
+            for (unsigned K = 0, N = R.below(4); K != N; ++K) {
+                Vars.push_back("a" + std::to_string(K));
+            }
+            std::string Name = "f" + std::to_string(I);
+            S += "def " + Name + "(";
+            for (size_t K = 0; K != Vars.size(); ++K) {
+                S += (K ? " " : "") + Vars[K];
+            }
+            Cost = 1;
+            S += ") " + expr(Vars, 4) + ";\n";
+            Fns.push_back({Name, (unsigned)Vars.size(), Cost});
+        }
+        return S;
+    }
+
+    const std::vector<Fn> &functions() const { return Fns; }
+
+private:
+    // 被调用的函数开销的上限
+    static constexpr double MaxCalleeCost = 5000;
+
+    Random R;
+    std::vector<Fn> Fns;
+    // 当前body的开销
+    double Cost = 0;
+
+    std::string constant() {
+        static const char *const Consts[] = {"0", "1", "2", "0.5", "3.25", "1000000", "0.1"};
+        std::string C = Consts[R.below(7)];
+        // 没有负数的字面量
+        return R.below(4) ? C : "(0 - " + C + ")";
+    }
+
+    // 开销不超过上限、参数个数满足要求(NumArgs为负时不限)的一个函数，没有时返回nullptr
+    const Fn *callee(int NumArgs) {
+        std::vector<const Fn *> Candidates;
+        for (const Fn &F : Fns) {
+            if (F.Cost <= MaxCalleeCost && (NumArgs < 0 || F.NumArgs == (unsigned)NumArgs)) {
+                Candidates.push_back(&F);
+            }
+        }
+        return Candidates.empty() ? nullptr : Candidates[R.below(Candidates.size())];
+    }
+
+    std::string expr(std::vector<std::string> &Vars, int Depth) {
+        Cost += 1;
+        if (Depth == 0 || R.below(5) == 0) {
+            if (!Vars.empty() && R.below(5) < 3) {
+                return Vars[R.below(Vars.size())];
+            }
+            return constant();
+        }
+
+        switch (R.below(9)) {
+        case 0:
+        case 1:
+        case 2: {
+            static const char Ops[] = "+-*<|@";
+            std::string L = expr(Vars, Depth - 1);
+            char Op = Ops[R.below(6)];
+            return "(" + L + " " + Op + " " + expr(Vars, Depth - 1) + ")";
+        }
+        case 3:
+            return "~" + expr(Vars, Depth - 1);
+        case 4:
+            if (const Fn *F = callee(-1)) {
+                Cost += F->Cost;
+                std::string S = F->Name + "(";
+                for (unsigned K = 0; K != F->NumArgs; ++K) {
+                    S += (K ? ", " : "") + expr(Vars, Depth - 1);
+                }
+                return S + ")";
+            }
+            break;
+        case 5: {
+            static const char *const Unary[] = {"sin", "cos", "sqrt", "fabs", "floor", "exp", "log"};
+            static const char *const Binary[] = {"pow", "atan2", "fmin", "fmax"};
+            // 拼接时各个操作数的求值顺序不确定，用到随机数的部分先分别算好
+            if (R.below(5) < 3) {
+                std::string Name = Unary[R.below(7)];
+                return Name + "(" + expr(Vars, Depth - 1) + ")";
+            }
+            std::string Name = Binary[R.below(4)];
+            std::string A = expr(Vars, Depth - 1);
+            return Name + "(" + A + ", " + expr(Vars, Depth - 1) + ")";
+        }
+        case 6: {
+            std::string V = "v" + std::to_string(Vars.size());
+            std::string Init = expr(Vars, Depth - 1);
+            Vars.push_back(V);
+            std::string Body = expr(Vars, Depth - 1);
+            Vars.pop_back();
+            return "(var " + V + " = " + Init + " in " + Body + ")";
+        }
+        case 7:
+            if (!Vars.empty()) {
+                std::string V = Vars[R.below(Vars.size())];
+                return "((" + V + " = " + expr(Vars, Depth - 1) + ") + " + V + ")";
+            }
+            break;
+        case 8:
+            // 起点是常量，终点最多在起点之后16，步长0.5，最多32个值
+            if (const Fn *F = R.below(3) ? nullptr : callee(1)) {
+                static const char *const Maps[] = {"mapsum", "mapmin", "mapmax"};
+                std::string Name = Maps[R.below(3)];
+                unsigned Start = R.below(4);
+                Cost += 32 * F->Cost;
+                return Name + "(" + F->Name + ", " + std::to_string(Start) + ", fmin(" +
+                       expr(Vars, Depth - 1) + ", " + std::to_string(Start + 16) + "), 0.5)";
+            }
+            break;
+        }
+        return expr(Vars, Depth - 1);
+    }
+};
+
+static std::string GenRandom() { return ProgramGenerator(1).generate(40); }
+
+struct Workload {
+    const char *Name;
+    std::string (*Generate)();
+};
+
+static const Workload Workloads[] = {
+    {"deep_chain", GenDeepChain}, {"nested", GenNested},
+    {"wide_calls", GenWideCalls}, {"many_defs", GenManyDefs},
+    {"comments", GenComments},    {"literals", GenLiterals},
+    {"mixed", GenMixed},          {"random", GenRandom},
+};
+
+//=========
+// Benchmark driver
+//=========
+
+static int Runs = 5;
+static const char *Filter = "";
+
+// 运行Fn Runs次，返回耗时的中位数(秒)，每次运行前先调用Setup，不计入耗时
+static double Measure(const std::function<void()> &Fn,
+                      const std::function<void()> &Setup = nullptr) {
+    std::vector<double> Times;
+    for (int I = 0; I != Runs; ++I) {
+        if (Setup) {
+            Setup();
+        }
+        auto Start = std::chrono::steady_clock::now();
+        Fn();
+        auto End = std::chrono::steady_clock::now();
+        Times.push_back(std::chrono::duration<double>(End - Start).count());
+    }
+    std::sort(Times.begin(), Times.end());
+    return Times[Times.size() / 2];
+}
+
+static bool Selected(const std::string &Name) {
+    return Name.compare(0, strlen(Filter), Filter) == 0;
+}
+
+// 输出一行结果，Amount/Unit描述处理的数据量
+static void Report(const std::string &Name, double Seconds, double Amount,
+                   const char *Unit) {
+    printf("%-28s %12.3f ms %14.2f %s/s\n", Name.c_str(), Seconds * 1e3,
+           Amount / Seconds, Unit);
+    fflush(stdout);
+}
+
+static void Fail(const std::string &Name, Context &Ctx) {
+    fprintf(stderr, "%s failed:", Name.c_str());
+    for (const Diagnostic &D : Ctx.getDiagnostics()) {
+        fprintf(stderr, " %s;", D.Message.c_str());
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void BenchFrontend() {
+    for (const Workload &W : Workloads) {
+        std::string Source = W.Generate();
+        double MB = Source.size() / 1e6;
+
+        std::string LexName = std::string("lex/") + W.Name;
+        if (Selected(LexName)) {
+            size_t Tokens = 0;
+            double T = Measure([&] { Tokens = countTokens(Source); });
+            Report(LexName, T, Tokens / 1e6, "Mtok");
+        }
+
+        // 只做语法分析，不做名字解析也不记录定义，和bench/fuzz.cpp执行的是同一个入口
+        std::string SyntaxName = std::string("syntax/") + W.Name;
+        if (Selected(SyntaxName)) {
+            double T = Measure([&] {
+                Context Ctx;
+                if (!Ctx.parse(Source)) {
+                    Fail(SyntaxName, Ctx);
+                }
+            });
+            Report(SyntaxName, T, MB, "MB");
+        }
+
+        // 解析并记录所有的定义，mixed中还包括顶层表达式的求值
+        std::string ParseName =
+            std::string(strcmp(W.Name, "mixed") ? "parse/" : "e2e/") + W.Name;
+        if (Selected(ParseName)) {
+            double T = Measure([&] {
+                Context Ctx;
+                if (!Ctx.eval(Source)) {
+                    Fail(ParseName, Ctx);
+                }
+            });
+            Report(ParseName, T, MB, "MB");
+        }
+    }
+}
+
+// 读取二进制AST和解析源码的对比
+static void BenchASTReload(const std::string &TmpDir) {
+    if (!Selected("ast/")) {
+        return;
+    }
+
+    std::string Source = GenManyDefs();
+    std::string Path = TmpDir + "/many_defs.kast";
+    {
+        Context Ctx;
+        if (!Ctx.eval(Source) || !Ctx.saveAST(Path)) {
+            Fail("ast/save", Ctx);
+        }
+    }
+
+    double T = Measure([&] {
+        Context Ctx;
+        if (!Ctx.loadAST(Path)) {
+            Fail("ast/load", Ctx);
+        }
+    });
+    Report("ast/load/many_defs", T, 50000 / 1e3, "Kdef");
+}
+
+// 磁盘缓存冷启动和热启动的对比，每次都用新的Context，只有磁盘缓存是共享的
+static void BenchCache(const std::string &TmpDir) {
+    if (!Selected("cache/")) {
+        return;
+    }
+
+    const int NumFns = 5000;
+    std::string Source;
+    for (int F = 0; F != NumFns; ++F) {
+        std::string N = std::to_string(F);
+        Source += "def g" + N + "(x y) var a = x * " + N +
+                  " in a * a + y - sqrt(fabs(a));\n";
+    }
+
+    double Col[16];
+    for (int I = 0; I != 16; ++I) {
+        Col[I] = I;
+    }
+    const double *Cols[2] = {Col, Col};
+    double Out[16];
+
+    auto Run = [&](const std::string &Dir) {
+        Context Ctx;
+        Ctx.setCacheDirectory(Dir);
+        if (!Ctx.eval(Source)) {
+            Fail("cache", Ctx);
+        }
+        for (int F = 0; F != NumFns; ++F) {
+            Function G = Ctx.getFunction("g" + std::to_string(F));
+            if (!G.evaluateBatch(Cols, 16, Out)) {
+                Fail("cache", Ctx);
+            }
+        }
+    };
+
+    std::string Dir = TmpDir + "/cache";
+    int Counter = 0;
+    double Cold = Measure([&] {
+        // 每次都用一个新的空目录
+        std::string D = Dir + std::to_string(Counter++);
+        std::filesystem::create_directory(D);
+        Run(D);
+    });
+    Report("cache/cold", Cold, NumFns / 1e3, "Kfn");
+
+    std::string Warm = Dir + "warm";
+    std::filesystem::create_directory(Warm);
+    Run(Warm);
+    double T = Measure([&] { Run(Warm); });
+    Report("cache/warm", T, NumFns / 1e3, "Kfn");
+}
+
+// 释放AST的耗时，只计Context析构的时间
+// deep_chain_1e6是10^6层左结合的加法链，递归的析构函数会耗尽调用栈
+static void BenchTeardown() {
+    struct Tree {
+        const char *Name;
+        std::string Source;
+        double Nodes; // 表达式节点的个数
+    };
+
+    std::string Chain = "def chain(x) x";
+    for (int I = 0; I != 1000000; ++I) {
+        Chain += " + x";
+    }
+    Chain += ";";
+
+    Tree Trees[] = {
+        {"teardown/deep_chain_1e6", Chain, 2e6 + 1},
+        {"teardown/many_defs", GenManyDefs(), 50000 * 5},
+    };
+
+    for (const Tree &T : Trees) {
+        if (!Selected(T.Name)) {
+            continue;
+        }
+
+        std::unique_ptr<Context> Ctx;
+        double Time = Measure([&] { Ctx.reset(); },
+                              [&] {
+                                  Ctx = std::make_unique<Context>();
+                                  Ctx->setMaxExpressionDepth(0);
+                                  if (!Ctx->eval(T.Source)) {
+                                      Fail(T.Name, *Ctx);
+                                  }
+                              });
+        Report(T.Name, Time, T.Nodes / 1e6, "Mnode");
+    }
+}
+
+// 批量求值和逐行调用的吞吐量
+static void BenchBatch() {
+    if (!Selected("batch/")) {
+        return;
+    }
+
+    Context Ctx;
+    if (!Ctx.eval("def binary/ 45 (a b) a * b;"
+                  "def k(x y) var t = x * y + 1, u = t - x in sqrt(fabs(t)) + u * u / y;")) {
+        Fail("batch", Ctx);
+    }
+    Function K = Ctx.getFunction("k");
+
+    const size_t Rows = 1 << 20;
+    std::vector<double> X(Rows), Y(Rows), Out(Rows);
+    Random R(4);
+    for (size_t I = 0; I != Rows; ++I) {
+        X[I] = R.below(1000) / 7.0;
+        Y[I] = R.below(1000) / 3.0 + 1;
+    }
+    const double *Cols[2] = {X.data(), Y.data()};
+
+    double T = Measure([&] { K.evaluateBatch(Cols, Rows, Out.data()); });
+    Report("batch/rows", T, Rows / 1e6, "Mrow");
+
+    T = Measure([&] {
+        double V;
+        for (size_t I = 0; I != Rows; ++I) {
+            K.call({X[I], Y[I]}, V);
+        }
+    });
+    Report("batch/call_per_row", T, Rows / 1e6, "Mrow");
+}
+
+// 交互式会话中反复修改一个定义，然后对依赖很深的函数重新批量求值
+// 只有调用了被修改函数的定义需要重新计算哈希，其余的结果可以继续使用
+static void BenchRedefine() {
+    if (!Selected("redefine/")) {
+        return;
+    }
+
+    const int Depth = 2000;
+    std::string Chain = "def f0(x) x * 0.5 + 1;";
+    for (int I = 1; I != Depth; ++I) {
+        Chain += "def f" + std::to_string(I) + "(x) f" + std::to_string(I - 1) +
+                 "(x) * 0.5 + " + std::to_string(I) + ";";
+    }
+    std::string Top = "f" + std::to_string(Depth - 1);
+
+    const size_t Rows = 64;
+    std::vector<double> X(Rows, 1.5), Out(Rows);
+    const double *Cols[1] = {X.data()};
+    const int Iterations = 1000;
+
+    // 修改和调用链无关的函数
+    Context Ctx;
+    if (!Ctx.eval(Chain)) {
+        Fail("redefine", Ctx);
+    }
+    double T = Measure([&] {
+        for (int I = 0; I != Iterations; ++I) {
+            Ctx.eval("def u(x) x + " + std::to_string(I % 2) + ";");
+            Ctx.getFunction(Top).evaluateBatch(Cols, Rows, Out.data());
+        }
+    });
+    Report("redefine/unrelated", T, Iterations / 1e3, "Kredef");
+
+    // 修改调用链最顶上的函数，两个版本交替，编译结果都在内存缓存中
+    T = Measure([&] {
+        for (int I = 0; I != Iterations; ++I) {
+            Ctx.eval("def g(x) " + Top + "(x) + " + std::to_string(I % 2) + ";");
+            Ctx.getFunction("g").evaluateBatch(Cols, Rows, Out.data());
+        }
+    });
+    Report("redefine/top", T, Iterations / 1e3, "Kredef");
+}
+
+// 分层执行: 第一次调用的延迟和反复调用的吞吐量
+// 对照是每个定义都先编译(eager)，以及只用解释器执行(interp)
+static void BenchTier() {
+    if (!Selected("tier/")) {
+        return;
+    }
+
+    const char *Library =
+        "def binary| 5 (a b) a * a + b;"
+        "def g(x y) var t = x * y + 1 in sqrt(fabs(t)) + (t | y);";
+    const int Defs = 2000;
+
+    // 每次运行都用新的名字，保证是第一次调用
+    int Round = 0;
+    auto FirstCalls = [&](bool Eager) {
+        Context Ctx;
+        Ctx.eval(Library);
+        ++Round;
+        double X = 1.5, Y = 2.5, V;
+        const double *Cols[2] = {&X, &Y};
+        for (int I = 0; I != Defs; ++I) {
+            std::string Name = "f" + std::to_string(Round) + "x" + std::to_string(I);
+            Ctx.eval("def " + Name + "(x y) g(x, y) * g(y, x) - g(x + " +
+                     std::to_string(I) + ", y);");
+            Function F = Ctx.getFunction(Name);
+            if (Eager) {
+                F.evaluateBatch(Cols, 1, &V);
+            } else {
+                F.call({X, Y}, V);
+            }
+        }
+    };
+    double T = Measure([&] { FirstCalls(false); });
+    Report("tier/first_call", T, Defs / 1e3, "Kcall");
+    T = Measure([&] { FirstCalls(true); });
+    Report("tier/first_call_eager", T, Defs / 1e3, "Kcall");
+
+    const size_t Calls = 1 << 20;
+    auto Steady = [&](unsigned Threshold) {
+        Context Ctx;
+        Ctx.setTierThreshold(Threshold);
+        Ctx.eval(Library);
+        Ctx.eval("def f(x y) g(x, y) * g(y, x) - g(x + 1, y - 1);");
+        Function F = Ctx.getFunction("f");
+        double V;
+        // 预热，让后台编译完成
+        for (int I = 0; I != 1000; ++I) {
+            F.call({1, 2}, V);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return Measure([&] {
+            for (size_t I = 0; I != Calls; ++I) {
+                F.call({(double)(I % 100), 2.5}, V);
+            }
+        });
+    };
+    T = Steady(0);
+    Report("tier/steady_interp", T, Calls / 1e6, "Mcall");
+    T = Steady(100); // 默认的阈值
+    Report("tier/steady_tiered", T, Calls / 1e6, "Mcall");
+}
+
+// 很大的库只用到其中几个函数: 从源码和从二进制AST启动，然后调用其中的几个函数
+// 延迟解析时没有用到的定义只找到body的结束位置，不创建节点，也不做名字解析
+static void BenchLazy(const std::string &TmpDir) {
+    if (!Selected("lazy/")) {
+        return;
+    }
+
+    std::string Source = GenWideCalls();
+    std::string Path = TmpDir + "/wide_calls.kast";
+    {
+        Context Ctx;
+        if (!Ctx.eval(Source) || !Ctx.saveAST(Path)) {
+            Fail("lazy/save", Ctx);
+        }
+    }
+
+    auto Startup = [&](bool Lazy, bool FromAST) {
+        return Measure([&] {
+            Context Ctx;
+            Ctx.setLazyDefinitions(Lazy);
+            if (FromAST ? !Ctx.loadAST(Path) : !Ctx.eval(Source)) {
+                Fail("lazy/startup", Ctx);
+            }
+            double V;
+            for (int I = 0; I != 10; ++I) {
+                if (!Ctx.getFunction("call" + std::to_string(I * 97)).call({1.5}, V)) {
+                    Fail("lazy/call", Ctx);
+                }
+            }
+        });
+    };
+    Report("lazy/source_eager", Startup(false, false), 2000 / 1e3, "Kdef");
+    Report("lazy/source_lazy", Startup(true, false), 2000 / 1e3, "Kdef");
+    Report("lazy/ast_eager", Startup(false, true), 2000 / 1e3, "Kdef");
+    Report("lazy/ast_lazy", Startup(true, true), 2000 / 1e3, "Kdef");
+
+    // 5万个很小的定义，端到端地从源码启动，只调用其中10个
+    std::string Library = GenManyDefs();
+    auto LibraryStartup = [&](bool Lazy) {
+        return Measure([&] {
+            Context Ctx;
+            Ctx.setLazyDefinitions(Lazy);
+            std::vector<double> Results;
+            if (!Ctx.eval(Library + "f0(1, 2) + f777(3, 4) + f49999(5, 6);", &Results)) {
+                Fail("lazy/library", Ctx);
+            }
+        });
+    };
+    Report("lazy/many_defs_eager", LibraryStartup(false), 50000 / 1e3, "Kdef");
+    Report("lazy/many_defs_lazy", LibraryStartup(true), 50000 / 1e3, "Kdef");
+}
+
+// 短时间运行的程序: 很多函数各被调用几百次，大部分时间花在达到分层执行的阈值之前
+// 训练运行保存profile，之后的运行读入它，热点函数在第一次调用时就编译
+static void BenchPGO(const std::string &TmpDir) {
+    if (!Selected("pgo/")) {
+        return;
+    }
+
+    const int Funcs = 200, Calls = 300;
+    std::string Library =
+        "def binary| 5 (a b) a * a + b;"
+        "def g(x y) var t = x * y + 1 in sqrt(fabs(t)) + (t | y);";
+    for (int I = 0; I != Funcs; ++I) {
+        Library += "def f" + std::to_string(I) + "(x y) g(x, y) * g(y, x) - g(x + " +
+                   std::to_string(I) + ", y);";
+    }
+    std::string Path = TmpDir + "/bench.kpf";
+
+    auto Run = [&](bool UseProfile, bool SaveProfile) {
+        Context Ctx;
+        if (UseProfile && !Ctx.loadProfile(Path)) {
+            Fail("pgo/load", Ctx);
+        }
+        Ctx.eval(Library);
+        double V;
+        for (int I = 0; I != Funcs; ++I) {
+            Function F = Ctx.getFunction("f" + std::to_string(I));
+            for (int J = 0; J != Calls; ++J) {
+                F.call({(double)J, 2.5}, V);
+            }
+        }
+        if (SaveProfile && !Ctx.saveProfile(Path)) {
+            Fail("pgo/save", Ctx);
+        }
+    };
+    Run(false, true);
+
+    double T = Measure([&] { Run(false, false); });
+    Report("pgo/no_profile", T, Funcs * Calls / 1e6, "Mcall");
+    T = Measure([&] { Run(true, false); });
+    Report("pgo/profile", T, Funcs * Calls / 1e6, "Mcall");
+}
+
+// 调用时传入常量配置参数的函数，编译时按常量参数特化，和参数有关的运算都折叠掉
+static void BenchSpecialize() {
+    if (!Selected("specialize/")) {
+        return;
+    }
+
+    const char *Source =
+        "def kernel(x gain bias order)"
+        "  x * (gain * gain - 1) + sqrt(bias * bias + order) * x"
+        "  + fmax(gain, bias) * pow(order, 0.5) * (x < gain * 4);"
+        "def layer(x) kernel(x, 1.5, 2, 3) + kernel(x, 1.5, 2, 3) * kernel(x, 0.5, 1, 4);"
+        "def model(x) layer(layer(x) * 0.5) - layer(x);";
+    Context Ctx;
+    if (!Ctx.eval(Source)) {
+        Fail("specialize", Ctx);
+    }
+    Function F = Ctx.getFunction("model");
+
+    const size_t Rows = 1 << 20;
+    std::vector<double> X(Rows), Out(Rows);
+    for (size_t I = 0; I != Rows; ++I) {
+        X[I] = (double)(I % 1000) / 100.0;
+    }
+    const double *Cols[1] = {X.data()};
+    double T = Measure([&] { F.evaluateBatch(Cols, Rows, Out.data()); });
+    Report("specialize/batch", T, Rows / 1e6, "Mrow");
+
+    // 分层执行，预热到编译完成之后逐次调用
+    double V;
+    for (int I = 0; I != 1000; ++I) {
+        F.call({1.0}, V);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const size_t Calls = 1 << 20;
+    T = Measure([&] {
+        for (size_t I = 0; I != Calls; ++I) {
+            F.call({X[I % Rows]}, V);
+        }
+    });
+    Report("specialize/tiered", T, Calls / 1e6, "Mcall");
+}
+
+static void BenchAD() {
+    if (!Selected("ad/")) {
+        return;
+    }
+
+    // 一个小模型对参数w的导数，手写的版本和differentiate()生成的版本
+    const char *Source =
+        "def act(v) v * exp(0 - v * v);"
+        "def layer(x w b) act(w * x + b) + sqrt(w * w + 1) * x;"
+        "def model(x w b) layer(layer(x, w, b), w * 0.5, b) * layer(x, b, w);"
+        "def dact(v) (1 - 2 * v * v) * exp(0 - v * v);"
+        "def dlayerx(x w b) dact(w * x + b) * w + sqrt(w * w + 1);"
+        "def dlayerw(x w b) dact(w * x + b) * x + w * pow(w * w + 1, 0 - 0.5) * x;"
+        "def dlayerb(x w b) dact(w * x + b);"
+        "def dmodel(x w b)"
+        "  var h = layer(x, w, b), o = layer(h, w * 0.5, b), r = layer(x, b, w) in"
+        "  (dlayerx(h, w * 0.5, b) * dlayerw(x, w, b) + dlayerw(h, w * 0.5, b) * 0.5) * r"
+        "  + o * dlayerb(x, b, w);";
+    Context Ctx;
+    if (!Ctx.eval(Source)) {
+        Fail("ad", Ctx);
+    }
+    double T = Measure([&] {
+        if (!Ctx.differentiate("model", "w", "gmodel")) {
+            Fail("ad", Ctx);
+        }
+    });
+    Report("ad/differentiate", T, 1, "fn");
+
+    const size_t Rows = 1 << 20;
+    std::vector<double> X(Rows), W(Rows), B(Rows), Out(Rows);
+    for (size_t I = 0; I != Rows; ++I) {
+        X[I] = (double)(I % 1000) / 250.0 - 2.0;
+        W[I] = (double)(I % 77) / 40.0;
+        B[I] = (double)(I % 13) / 10.0 - 0.6;
+    }
+    const double *Cols[3] = {X.data(), W.data(), B.data()};
+    for (const char *Name : {"dmodel", "gmodel"}) {
+        Function F = Ctx.getFunction(Name);
+        T = Measure([&] { F.evaluateBatch(Cols, Rows, Out.data()); });
+        Report(std::string("ad/") + (Name[0] == 'd' ? "hand" : "generated"), T, Rows / 1e6,
+               "Mrow");
+    }
+}
+
+static void BenchParallel() {
+    if (!Selected("parallel/")) {
+        return;
+    }
+
+    // 宽而深的调用树，每一层的几个参数都是开销很大的调用
+    std::string Source = "def h0(x) sin(x) * cos(x) + sqrt(x * x + 1) * exp(0 - x * x);\n";
+    for (int I = 1; I <= 7; ++I) {
+        std::string P = "h" + std::to_string(I - 1);
+        Source += "def h" + std::to_string(I) + "(x) " + P + "(x) * " + P + "(x + 1) + " + P +
+                  "(x - 1) - " + P + "(x * 0.5);\n";
+    }
+    Source += "def combine(a b c d) a * b + c * d;\n"
+              "def root(x) combine(h7(x), h7(x + 0.25), h7(x + 0.5), h7(x + 0.75));\n";
+
+    unsigned Threads = std::max(2u, std::thread::hardware_concurrency());
+    for (unsigned N : {1u, Threads}) {
+        Context Ctx;
+        // 只比较解释执行，编译之后整个调用树都内联成一段指令
+        Ctx.setTierThreshold(0);
+        Ctx.setParallelEvaluation(N);
+        if (!Ctx.eval(Source)) {
+            Fail("parallel", Ctx);
+        }
+        Function F = Ctx.getFunction("root");
+        double V;
+        const int Calls = 8;
+        double T = Measure([&] {
+            for (int I = 0; I != Calls; ++I) {
+                F.call({I * 0.1}, V);
+            }
+        });
+        Report("parallel/threads" + std::to_string(N), T, Calls, "call");
+    }
+}
+
+static void BenchMap() {
+    if (!Selected("map/")) {
+        return;
+    }
+
+    const char *Source = "def f(x) sin(x) * x + sqrt(x * x + 1) * exp(0 - x * x * 0.01);\n";
+    const double Start = 0, End = 1 << 20, Step = 1;
+    const double Rows = (End - Start) / Step;
+
+    // 对照: 逐个调用，和之前在宿主程序中循环的写法一样
+    {
+        Context Ctx;
+        if (!Ctx.eval(Source)) {
+            Fail("map", Ctx);
+        }
+        Function F = Ctx.getFunction("f");
+        double Sum = 0, V;
+        double T = Measure([&] {
+            Sum = 0;
+            for (double X = Start; X < End; X += Step) {
+                F.call({X}, V);
+                Sum += V;
+            }
+        });
+        Report("map/calls", T, Rows, "row");
+    }
+
+    unsigned Threads = std::max(2u, std::thread::hardware_concurrency());
+    for (unsigned N : {1u, Threads}) {
+        Context Ctx;
+        Ctx.setParallelEvaluation(N);
+        if (!Ctx.eval(Source)) {
+            Fail("map", Ctx);
+        }
+        Function F = Ctx.getFunction("f");
+        double Sum;
+        double T = Measure([&] {
+            if (!F.reduce(Reduction::Sum, Start, End, Step, Sum)) {
+                Fail("map", Ctx);
+            }
+        });
+        Report("map/threads" + std::to_string(N), T, Rows, "row");
+    }
+}
+
+//=========
+// Backend comparison
+//=========
+
+static const Backend Backends[] = {Backend::Interpreter, Backend::Tiered, Backend::Compiled};
+
+// 每个函数的输入，行数固定，值由Seed决定
+static std::vector<std::vector<double>> GenInputs(uint64_t Seed, unsigned NumArgs, size_t Rows) {
+    static const double Values[] = {0, 1, -1, 0.5, 2.5, -3.75, 1e6, 1e-3};
+    Random R(Seed);
+    std::vector<std::vector<double>> Columns(NumArgs, std::vector<double>(Rows));
+    for (auto &Col : Columns) {
+        for (double &V : Col) {
+            V = R.below(2) ? Values[R.below(8)] : (double)(int)R.below(2001) / 100 - 10;
+        }
+    }
+    return Columns;
+}
+
+// 一个后端执行随机程序中每个函数的结果，先逐行调用，再整体批量求值
+struct BackendRun {
+    std::vector<double> Calls;
+    std::vector<bool> CallOK;
+    std::vector<std::string> Diags;
+    // 批量求值的结果，出错的函数为空
+    std::vector<std::vector<double>> Batches;
+};
+
+static BackendRun RunBackend(Backend B, uint64_t Seed, const std::string &Source,
+                             const std::vector<ProgramGenerator::Fn> &Fns, size_t Rows) {
+    BackendRun Run;
+    Context Ctx;
+    Ctx.setBackend(B);
+    // 分层执行的阈值调低，同一个函数的调用中既有解释执行的也有编译执行的
+    Ctx.setTierThreshold(2);
+    if (!Ctx.eval(Source)) {
+        Fail(std::string("diff/") + getBackendName(B), Ctx);
+    }
+
+    for (size_t K = 0; K != Fns.size(); ++K) {
+        Function F = Ctx.getFunction(Fns[K].Name);
+        auto Columns = GenInputs(Seed + K, Fns[K].NumArgs, Rows);
+        std::vector<double> Args(Fns[K].NumArgs);
+        for (size_t Row = 0; Row != Rows; ++Row) {
+            for (size_t A = 0; A != Args.size(); ++A) {
+                Args[A] = Columns[A][Row];
+            }
+            double V = 0;
+            Run.CallOK.push_back(F.call(Args, V));
+            Run.Calls.push_back(V);
+        }
+    }
+    for (size_t K = 0; K != Fns.size(); ++K) {
+        auto Columns = GenInputs(Seed + K, Fns[K].NumArgs, Rows);
+        std::vector<const double *> Cols;
+        for (auto &Col : Columns) {
+            Cols.push_back(Col.data());
+        }
+        std::vector<double> Out(Rows);
+        if (!Ctx.getFunction(Fns[K].Name).evaluateBatch(Cols.data(), Rows, Out.data())) {
+            Out.clear();
+        }
+        Run.Batches.push_back(std::move(Out));
+    }
+    // 逐行调用和批量求值的错误都参与比较，包括位置
+    for (const Diagnostic &D : Ctx.getDiagnostics()) {
+        Run.Diags.push_back(std::to_string(D.Range.Begin.Line) + ":" +
+                            std::to_string(D.Range.Begin.Col) + ": " + D.Message);
+    }
+    return Run;
+}
+
+// 逐位相同，NaN的符号和payload不要求相同
+static bool SameValue(double A, double B) {
+    return (std::isnan(A) && std::isnan(B)) || memcmp(&A, &B, sizeof(A)) == 0;
+}
+
+// 差分测试: 用Seed生成的随机程序和输入在每个后端上执行，结果和诊断信息都应该和解释器相同
+// 不同时打印第一个不同之处并返回false
+static bool CheckBackends(uint64_t Seed) {
+    ProgramGenerator G(Seed);
+    std::string Source = G.generate(30);
+    const auto &Fns = G.functions();
+    const size_t Rows = 16;
+
+    BackendRun Ref = RunBackend(Backend::Interpreter, Seed, Source, Fns, Rows);
+    for (Backend B : Backends) {
+        if (B == Backend::Interpreter) {
+            continue;
+        }
+        BackendRun Run = RunBackend(B, Seed, Source, Fns, Rows);
+        const char *Name = getBackendName(B);
+        for (size_t I = 0; I != Ref.Calls.size(); ++I) {
+            if (Run.CallOK[I] != Ref.CallOK[I] ||
+                (Ref.CallOK[I] && !SameValue(Run.Calls[I], Ref.Calls[I]))) {
+                printf("seed %llu: %s differs from interp: %s row %zu: %.17g vs %.17g\n",
+                       (unsigned long long)Seed, Name, Fns[I / Rows].Name.c_str(), I % Rows,
+                       Run.Calls[I], Ref.Calls[I]);
+                return false;
+            }
+        }
+        if (Run.Diags != Ref.Diags) {
+            printf("seed %llu: %s reports different diagnostics\n", (unsigned long long)Seed, Name);
+            return false;
+        }
+        for (size_t K = 0; K != Fns.size(); ++K) {
+            const auto &Batch = Run.Batches[K];
+            if (Batch.size() != Ref.Batches[K].size()) {
+                printf("seed %llu: %s batch fails differently: %s\n", (unsigned long long)Seed,
+                       Name, Fns[K].Name.c_str());
+                return false;
+            }
+            for (size_t Row = 0; Row != Batch.size(); ++Row) {
+                size_t I = K * Rows + Row;
+                if (Ref.CallOK[I] && !SameValue(Batch[Row], Ref.Calls[I])) {
+                    printf("seed %llu: %s batch differs: %s row %zu\n", (unsigned long long)Seed,
+                           Name, Fns[K].Name.c_str(), Row);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// 同样的随机程序和输入在各后端上的执行速度
+static void BenchBackends() {
+    ProgramGenerator G(1);
+    std::string Source = G.generate(40);
+    const auto &Fns = G.functions();
+    const size_t Rows = 64;
+
+    for (Backend B : Backends) {
+        std::string Name = std::string("backend/") + getBackendName(B);
+        if (!Selected(Name)) {
+            continue;
+        }
+        Context Ctx;
+        Ctx.setBackend(B);
+        if (!Ctx.eval(Source)) {
+            Fail(Name, Ctx);
+        }
+        std::vector<Function> Handles;
+        std::vector<std::vector<double>> Args;
+        for (size_t K = 0; K != Fns.size(); ++K) {
+            auto Columns = GenInputs(1 + K, Fns[K].NumArgs, Rows);
+            for (size_t Row = 0; Row != Rows; ++Row) {
+                Handles.push_back(Ctx.getFunction(Fns[K].Name));
+                Args.emplace_back();
+                for (auto &Col : Columns) {
+                    Args.back().push_back(Col[Row]);
+                }
+            }
+        }
+
+        auto RunAll = [&] {
+            double V;
+            for (size_t I = 0; I != Handles.size(); ++I) {
+                Handles[I].call(Args[I], V);
+            }
+        };
+        // 先执行一遍，分层执行的后台编译有时间完成，测的是稳定之后的速度
+        RunAll();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        double T = Measure(RunAll);
+        Report(Name, T, Handles.size(), "call");
+    }
+}
+
+int main(int argc, char **argv) {
+    for (int I = 1; I < argc; ++I) {
+        if (strncmp(argv[I], "-runs=", 6) == 0) {
+            Runs = std::max(1, atoi(argv[I] + 6));
+        } else if (strncmp(argv[I], "-filter=", 8) == 0) {
+            Filter = argv[I] + 8;
+        } else if (strncmp(argv[I], "-diff=", 6) == 0) {
+            // 只做差分测试，不测性能
+            unsigned long N = strtoul(argv[I] + 6, nullptr, 10);
+            for (uint64_t Seed = 1; Seed <= N; ++Seed) {
+                if (!CheckBackends(Seed)) {
+                    return 1;
+                }
+            }
+            printf("%lu programs, all backends agree\n", N);
+            return 0;
+        } else if (strncmp(argv[I], "-emit=", 6) == 0) {
+            for (const Workload &W : Workloads) {
+                if (strcmp(W.Name, argv[I] + 6) == 0) {
+                    fputs(W.Generate().c_str(), stdout);
+                    return 0;
+                }
+            }
+            fprintf(stderr, "Unknown workload: %s\n", argv[I] + 6);
+            return 1;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[I]);
+            return 1;
+        }
+    }
+
+    char TmpDir[] = "/tmp/kbench.XXXXXX";
+    if (!mkdtemp(TmpDir)) {
+        fprintf(stderr, "Cannot create temporary directory\n");
+        return 1;
+    }
+
+    printf("# median of %d runs\n", Runs);
+    BenchFrontend();
+    BenchASTReload(TmpDir);
+    BenchCache(TmpDir);
+    BenchTeardown();
+    BenchBatch();
+    BenchRedefine();
+    BenchTier();
+    BenchLazy(TmpDir);
+    BenchPGO(TmpDir);
+    BenchSpecialize();
+    BenchAD();
+    BenchParallel();
+    BenchMap();
+    BenchBackends();
+
+    // 清理临时文件
+    std::filesystem::remove_all(TmpDir);
+    return 0;
+}
@@ -0,0 +1,817 @@
+// Kaleidoscope前端(词法分析和语法分析)的fuzz测试，完全离线运行
+// 编译:
+//   g++ -O2 -std=c++17 -pthread bench/fuzz.cpp kaleidoscope.cpp -o kfuzz
+//   clang++ -g -O1 -std=c++17 -fsanitize=fuzzer,address -DKALEIDOSCOPE_LIBFUZZER
+//       bench/fuzz.cpp kaleidoscope.cpp -o kfuzz-lf
+//
+// 用法:
+//   kfuzz [-runs=N] [-time=<秒>] [-seed=N] [-max-len=N] [-timeout=<毫秒>] [-stack=<KB>]
+//         [-artifacts=<目录>]          按文法生成输入再随机变异，直到次数或时间用完
+//   kfuzz <文件>...                     只执行给定的输入，用于重现保存下来的问题
+//   kfuzz -emit-corpus=<目录> [-runs=N]  把生成的输入写成文件，作为libFuzzer的初始语料
+//   kfuzz-lf [<语料目录>]                libFuzzer，变异时也使用这里的文法生成器
+//
+// 输入的第一个字节是选项，其余是源码，见RunInput()
+// 单个输入执行超过-timeout(默认1000毫秒)时当作挂起；输入在一个栈只有-stack(默认128KB)的线程上执行，
+// 递归深度和输入长度成正比的代码在默认的-max-len(8192)以内就会栈溢出，不用等到主线程的8MB用完
+// 挂起、栈溢出和其他崩溃都把输入写到-artifacts目录中(hang-<哈希>、stack-overflow-<哈希>、crash-<哈希>)，
+// 然后返回1；每秒报告一次吞吐量，同样的-seed生成的输入完全一样
+
+#include "../kaleidoscope.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef KALEIDOSCOPE_LIBFUZZER
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+using namespace kaleidoscope;
+
+//=========
+// Target
+//=========
+
+// 执行一个输入，源码没有语法错误时返回true
+// 第一个字节的bit 0打开延迟解析，bit 1让源码分块交给Lexer，每块1 + (Flags >> 2)个字节，
+// 和交互式输入一样经过缓冲区的边界和atEndOfChunk()
+static bool RunInput(const uint8_t *Data, size_t Size) {
+    if (Size == 0) {
+        return true;
+    }
+    unsigned Flags = Data[0];
+    std::string Source((const char *)Data + 1, Size - 1);
+
+    Context Ctx;
+    Ctx.setLazyDefinitions(Flags & 1);
+    bool OK;
+    if (Flags & 2) {
+        size_t ChunkSize = 1 + (Flags >> 2);
+        size_t Pos = 0;
+        OK = Ctx.parse([&](std::string &Chunk) {
+            if (Pos == Source.size()) {
+                return false;
+            }
+            size_t N = std::min(ChunkSize, Source.size() - Pos);
+            Chunk.append(Source, Pos, N);
+            Pos += N;
+            return true;
+        });
+    } else {
+        OK = Ctx.parse(Source);
+    }
+
+    // 返回值和诊断信息必须一致: 每个语法错误都报告，没有错误时不报告
+    if (OK != Ctx.getDiagnostics().empty()) {
+        fprintf(stderr, "parse() returned %s with %zu diagnostics\n", OK ? "true" : "false",
+                Ctx.getDiagnostics().size());
+        abort();
+    }
+    countTokens(Source);
+    return OK;
+}
+
+//=========
+// Grammar-based generator
+//=========
+
+// 固定种子的随机数，同样的种子生成同样的输入
+class Random {
+    uint64_t State;
+
+public:
+    explicit Random(uint64_t Seed) : State(Seed ? Seed : 0x9E3779B97F4A7C15ull) {}
+
+    uint64_t next() {
+        State ^= State << 13;
+        State ^= State >> 7;
+        State ^= State << 17;
+        return State;
+    }
+
+    unsigned below(unsigned N) { return next() % N; }
+};
+
+// 按Kaleidoscope的文法生成源码，大部分是合法的程序，也故意混入一些边界情况:
+// 多个'.'的数字、很长的数字、优先级越界的运算符、参数个数不对的调用、没有换行就结束的注释等
+class SourceGenerator {
+    Random &R;
+    std::string &Out;
+    size_t Limit;
+
+    // 已经定义的函数和参数个数，自定义的二元和一元运算符
+    std::vector<std::pair<std::string, unsigned>> Funcs;
+    std::string BinOps = "+-*<";
+    std::string UnaryOps = "!-";
+    // 当前可见的变量
+    std::vector<std::string> Scope;
+
+    static constexpr const char *Names[] = {"x",   "y",    "a",     "b",    "foo", "in1",
+                                            "de",  "var1", "inner", "defx", "x0",  "unaryx"};
+    static constexpr const char *OpChars = "|&^%$@~:?>=!.";
+
+public:
+    SourceGenerator(Random &R, std::string &Out, size_t Limit) : R(R), Out(Out), Limit(Limit) {}
+
+    void program() {
+        while (Out.size() < Limit) {
+            item();
+        }
+        // 有时在注释中间或者一个项的中间结束
+        if (R.below(8) == 0) {
+            Out += "# no newline";
+        }
+    }
+
+private:
+    void space() {
+        switch (R.below(24)) {
+        case 0:
+            Out += '\n';
+            break;
+        case 1:
+            Out += '\t';
+            break;
+        case 2:
+            Out += "\r\n";
+            break;
+        case 3:
+            Out += " # comment ( def\n";
+            break;
+        default:
+            Out += ' ';
+            break;
+        }
+    }
+
+    void name() { Out += Names[R.below(sizeof(Names) / sizeof(Names[0]))]; }
+
+    void number() {
+        switch (R.below(16)) {
+        default:
+            Out += std::to_string(R.below(1000));
+            break;
+        case 10:
+            Out += std::to_string(R.below(100)) + "." + std::to_string(R.below(100));
+            break;
+        case 11:
+            Out += "." + std::to_string(R.below(100));
+            break;
+        case 12:
+            Out += std::to_string(R.below(100)) + ".";
+            break;
+        case 13:
+            // 多个'.'，strtod只取前面合法的部分
+            Out += "1.2.3";
+            break;
+        case 14:
+            for (unsigned N = R.below(300) + 1; N != 0; --N) {
+                Out += (char)('0' + R.below(10));
+            }
+            break;
+        case 15:
+            Out += R.below(2) ? "." : "..";
+            break;
+        }
+    }
+
+    void args(unsigned N) {
+        Out += '(';
+        for (unsigned I = 0; I != N; ++I) {
+            if (I) {
+                Out += ' ';
+            }
+            Out += (char)('a' + I);
+            Scope.push_back(std::string(1, (char)('a' + I)));
+        }
+        Out += ')';
+    }
+
+    void item() {
+        Scope.clear();
+        switch (R.below(10)) {
+        case 0:
+        case 1:
+        case 2:
+        case 3: {
+            unsigned N = R.below(4);
+            std::string Name = "f" + std::to_string(Funcs.size());
+            Out += "def ";
+            Out += Name;
+            args(N);
+            space();
+            expr(0);
+            Funcs.push_back({Name, N});
+            break;
+        }
+        case 4:
+            Out += "extern ";
+            name();
+            args(R.below(3));
+            break;
+        case 5: {
+            char Op = OpChars[R.below(strlen(OpChars))];
+            Out += "def binary";
+            Out += Op;
+            Out += ' ';
+            // 优先级偶尔越界或者不是整数
+            switch (R.below(8)) {
+            case 0:
+                Out += "0";
+                break;
+            case 1:
+                Out += "101";
+                break;
+            case 2:
+                Out += "5.5";
+                break;
+            case 3:
+                break;
+            default:
+                Out += std::to_string(R.below(100) + 1);
+                break;
+            }
+            Out += ' ';
+            args(2);
+            space();
+            expr(0);
+            BinOps += Op;
+            break;
+        }
+        case 6: {
+            char Op = OpChars[R.below(strlen(OpChars))];
+            Out += "def unary";
+            Out += Op;
+            args(1);
+            space();
+            expr(0);
+            UnaryOps += Op;
+            break;
+        }
+        case 7:
+        case 8:
+            expr(0);
+            break;
+        case 9:
+            Out += "# ";
+            name();
+            Out += " def ( ,";
+            break;
+        }
+        Out += R.below(4) ? ";\n" : "\n";
+    }
+
+    void leaf() {
+        if (!Scope.empty() && R.below(2)) {
+            Out += Scope[R.below(Scope.size())];
+        } else if (R.below(4) == 0) {
+            name();
+        } else {
+            number();
+        }
+    }
+
+    void expr(unsigned Depth) {
+        if (Depth > 12 || Out.size() >= Limit) {
+            leaf();
+            return;
+        }
+        switch (R.below(12)) {
+        case 0:
+        case 1:
+            leaf();
+            break;
+        case 2:
+            Out += '(';
+            expr(Depth + 1);
+            Out += ')';
+            break;
+        case 3:
+            Out += UnaryOps[R.below(UnaryOps.size())];
+            expr(Depth + 1);
+            break;
+        case 4:
+        case 5:
+        case 6:
+            expr(Depth + 1);
+            space();
+            Out += BinOps[R.below(BinOps.size())];
+            space();
+            expr(Depth + 1);
+            break;
+        case 7:
+            // 给变量赋值，'='的优先级最低，加上括号；没有变量时左边不是变量，是语法错误
+            Out += '(';
+            if (!Scope.empty()) {
+                Out += Scope[R.below(Scope.size())];
+            } else {
+                number();
+            }
+            Out += " = ";
+            expr(Depth + 1);
+            Out += ')';
+            break;
+        case 8: {
+            // 已经定义的函数，偶尔参数个数不对
+            if (Funcs.empty()) {
+                leaf();
+                break;
+            }
+            const auto &F = Funcs[R.below(Funcs.size())];
+            unsigned N = R.below(8) ? F.second : R.below(4);
+            Out += F.first + "(";
+            for (unsigned I = 0; I != N; ++I) {
+                if (I) {
+                    Out += ", ";
+                }
+                expr(Depth + 1);
+            }
+            Out += ')';
+            break;
+        }
+        case 9:
+            if (R.below(2)) {
+                Out += R.below(2) ? "sin(" : "sqrt(";
+                expr(Depth + 1);
+            } else {
+                Out += R.below(2) ? "pow(" : "fmin(";
+                expr(Depth + 1);
+                Out += ", ";
+                expr(Depth + 1);
+            }
+            Out += ')';
+            break;
+        case 10:
+            Out += R.below(2) ? "mapsum(" : "mapmax(";
+            if (Funcs.empty() || R.below(8) == 0) {
+                leaf();
+            } else {
+                Out += Funcs[R.below(Funcs.size())].first;
+            }
+            for (int I = 0; I != 3; ++I) {
+                Out += ", ";
+                expr(Depth + 1);
+            }
+            Out += ')';
+            break;
+        case 11: {
+            size_t SavedScope = Scope.size();
+            Out += "var ";
+            for (unsigned N = R.below(3) + 1; N != 0; --N) {
+                std::string V(1, (char)('p' + R.below(8)));
+                Out += V;
+                if (R.below(2)) {
+                    Out += " = ";
+                    expr(Depth + 1);
+                }
+                Scope.push_back(V);
+                Out += N > 1 ? ", " : " ";
+            }
+            Out += "in";
+            space();
+            expr(Depth + 1);
+            Scope.resize(SavedScope);
+            break;
+        }
+        }
+    }
+};
+
+constexpr const char *SourceGenerator::Names[];
+
+// 生成一个输入，第一个字节是RunInput()的选项
+// 长度大多很小，偶尔接近MaxLen
+static void Generate(Random &R, size_t MaxLen, std::string &Input) {
+    Input.clear();
+    Input += (char)R.below(256);
+    size_t Target = 16;
+    for (unsigned K = R.below(16); K != 0 && Target * 2 <= MaxLen; --K) {
+        Target *= 2;
+    }
+    SourceGenerator(R, Input, std::min(Target, MaxLen)).program();
+}
+
+//=========
+// Mutation
+//=========
+
+// 插入的token，包括容易出问题的不完整的结构
+static const char *const Dictionary[] = {
+    "def",    "extern", "var", "in",  "binary", "unary", "(",     ")",   ",",
+    ";",      "#",      "\n",  ".",   "..",     "1.2.3", "=",     "x",   "mapsum",
+    "sin(",   "f0(",    "def f(", "def binary| 5 (a b", "var x = ", "\r", "\0"};
+
+// 很多次重复时会形成很深的嵌套、很长的运算符链或者很多行注释
+static const char *const Repeats[] = {"(",  "!",   "-",  "#\n", "f0(", "1+", "var a = ",
+                                      "# c\r", ".", "1", "x,",  "(a", "def "};
+
+// 对源码部分(第一个字节之后)做一次随机的修改，结果不超过MaxLen
+static void Mutate(Random &R, size_t MaxLen, std::string &S) {
+    if (S.empty()) {
+        S += (char)R.below(256);
+    }
+    size_t Size = S.size() - 1;
+    size_t Pos = 1 + (Size ? R.below(Size + 1) : 0);
+    switch (R.below(8)) {
+    case 0: {
+        // 删除一段
+        size_t Len = std::min<size_t>(R.below(16) + 1, S.size() - Pos);
+        S.erase(Pos, Len);
+        break;
+    }
+    case 1: {
+        const char *Tok = Dictionary[R.below(sizeof(Dictionary) / sizeof(Dictionary[0]))];
+        S.insert(Pos, Tok, std::max<size_t>(strlen(Tok), 1));
+        break;
+    }
+    case 2: {
+        // 复制一段到别的位置
+        size_t From = 1 + (Size ? R.below(Size) : 0);
+        size_t Len = std::min<size_t>(R.below(64) + 1, S.size() - From);
+        std::string Piece = S.substr(From, Len);
+        S.insert(Pos, Piece);
+        break;
+    }
+    case 3:
+        // 截断，得到没有结束的注释、参数列表、原型等
+        S.resize(Pos);
+        break;
+    case 4:
+        if (Pos < S.size()) {
+            S[Pos] = (char)R.below(256);
+        }
+        break;
+    case 5: {
+        const char *Piece = Repeats[R.below(sizeof(Repeats) / sizeof(Repeats[0]))];
+        size_t Len = strlen(Piece);
+        size_t Count = (size_t)1 << R.below(16);
+        std::string Block;
+        for (size_t I = 0; I != Count && Block.size() + Len <= MaxLen; ++I) {
+            Block += Piece;
+        }
+        S.insert(Pos, Block);
+        break;
+    }
+    case 6:
+        S[0] = (char)R.below(256);
+        break;
+    case 7: {
+        // 在这里插入一段新生成的源码
+        std::string Other;
+        Generate(R, std::min<size_t>(MaxLen, 512), Other);
+        S.insert(Pos, Other, 1, std::string::npos);
+        break;
+    }
+    }
+    if (S.size() > MaxLen) {
+        S.resize(MaxLen);
+    }
+}
+
+#ifdef KALEIDOSCOPE_LIBFUZZER
+
+//=========
+// libFuzzer entry points
+//=========
+
+extern "C" size_t LLVMFuzzerMutate(uint8_t *Data, size_t Size, size_t MaxSize);
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
+    RunInput(Data, Size);
+    return 0;
+}
+
+// 一半用文法生成和上面的变异，一半用libFuzzer自己的按字节变异
+extern "C" size_t LLVMFuzzerCustomMutator(uint8_t *Data, size_t Size, size_t MaxSize,
+                                          unsigned int Seed) {
+    Random R(Seed + 1);
+    if (R.below(2)) {
+        return LLVMFuzzerMutate(Data, Size, MaxSize);
+    }
+    std::string S((const char *)Data, Size);
+    if (S.empty() || R.below(8) == 0) {
+        Generate(R, MaxSize, S);
+    }
+    for (unsigned N = R.below(4) + 1; N != 0; --N) {
+        Mutate(R, MaxSize, S);
+    }
+    memcpy(Data, S.data(), S.size());
+    return S.size();
+}
+
+#else
+
+//=========
+// Standalone driver
+//=========
+
+using Clock = std::chrono::steady_clock;
+
+static uint64_t Runs = 0;
+static double TimeLimit = 10;
+static uint64_t Seed = 1;
+static size_t MaxLen = 8192;
+static unsigned TimeoutMs = 1000;
+static size_t StackKB = 128;
+static const char *ArtifactDir = ".";
+
+// 正在执行的输入，挂起或者崩溃时写到文件中
+static const uint8_t *volatile CurData = nullptr;
+static volatile size_t CurSize = 0;
+// 开始执行当前输入的时间(ns)，没有在执行时为0
+static std::atomic<int64_t> CurStart{0};
+// 执行输入的线程的栈的最低地址，用于区分栈溢出和其他崩溃
+static uintptr_t StackLow = 0;
+
+static std::atomic<uint64_t> Execs{0};
+static std::atomic<uint64_t> ExecBytes{0};
+static std::atomic<uint64_t> Accepted{0};
+static std::atomic<bool> Finished{false};
+// 最慢的一个输入
+static int64_t SlowestNs = 0;
+static size_t SlowestLen = 0;
+
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               Clock::now().time_since_epoch())
+        .count();
+}
+
+static void appendStr(char *&P, char *End, const char *S) {
+    while (*S && P != End) {
+        *P++ = *S++;
+    }
+}
+
+// 把输入写到<ArtifactDir>/<Kind>-<哈希>，只用async-signal-safe的函数，可以在信号处理中调用
+static void saveArtifact(const char *Kind, const uint8_t *Data, size_t Size) {
+    uint64_t Hash = 0xcbf29ce484222325ull;
+    for (size_t I = 0; I != Size; ++I) {
+        Hash = (Hash ^ Data[I]) * 0x100000001b3ull;
+    }
+
+    char Path[4096];
+    char *P = Path, *End = Path + sizeof(Path) - 18;
+    appendStr(P, End, ArtifactDir);
+    appendStr(P, End, "/");
+    appendStr(P, End, Kind);
+    appendStr(P, End, "-");
+    for (int Shift = 60; Shift >= 0; Shift -= 4) {
+        *P++ = "0123456789abcdef"[(Hash >> Shift) & 15];
+    }
+    *P = 0;
+
+    int Fd = open(Path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (Fd >= 0) {
+        for (size_t Done = 0; Done != Size;) {
+            ssize_t N = write(Fd, Data + Done, Size - Done);
+            if (N <= 0) {
+                break;
+            }
+            Done += N;
+        }
+        close(Fd);
+    }
+
+    char Msg[4200];
+    char *M = Msg, *MEnd = Msg + sizeof(Msg) - 1;
+    appendStr(M, MEnd, "== ");
+    appendStr(M, MEnd, Kind);
+    appendStr(M, MEnd, ": input saved to ");
+    appendStr(M, MEnd, Path);
+    appendStr(M, MEnd, "\n");
+    ssize_t Unused = write(2, Msg, M - Msg);
+    (void)Unused;
+}
+
+static void onCrash(int Sig, siginfo_t *Info, void *) {
+    const char *Kind = "crash";
+    // 保护页在栈的最低地址之下，访问它附近的地址说明栈用完了
+    uintptr_t Addr = (uintptr_t)Info->si_addr;
+    if ((Sig == SIGSEGV || Sig == SIGBUS) && StackLow && Addr + (1 << 20) >= StackLow &&
+        Addr < StackLow + (64 << 10)) {
+        Kind = "stack-overflow";
+    }
+    saveArtifact(Kind, CurData, CurSize);
+    _exit(1);
+}
+
+static void installCrashHandlers() {
+    struct sigaction SA;
+    memset(&SA, 0, sizeof(SA));
+    SA.sa_sigaction = onCrash;
+    SA.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&SA.sa_mask);
+    for (int Sig : {SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL}) {
+        sigaction(Sig, &SA, nullptr);
+    }
+}
+
+// 执行一个输入并计时，更新统计
+static bool runTimed(const std::string &Input) {
+    CurData = (const uint8_t *)Input.data();
+    CurSize = Input.size();
+    int64_t Start = nowNs();
+    CurStart.store(Start, std::memory_order_release);
+    bool OK = RunInput((const uint8_t *)Input.data(), Input.size());
+    int64_t Elapsed = nowNs() - Start;
+    CurStart.store(0, std::memory_order_release);
+
+    if (Elapsed > SlowestNs) {
+        SlowestNs = Elapsed;
+        SlowestLen = Input.size();
+    }
+    Execs.fetch_add(1, std::memory_order_relaxed);
+    ExecBytes.fetch_add(Input.size(), std::memory_order_relaxed);
+    if (OK) {
+        Accepted.fetch_add(1, std::memory_order_relaxed);
+    }
+    return OK;
+}
+
+struct WorkerArgs {
+    std::vector<const char *> Files;
+    int Status = 0;
+};
+
+// 执行给定的文件，或者生成输入直到次数或时间用完
+static void runInputs(WorkerArgs &W) {
+    if (!W.Files.empty()) {
+        for (const char *Path : W.Files) {
+            FILE *F = fopen(Path, "rb");
+            if (!F) {
+                fprintf(stderr, "Cannot open %s\n", Path);
+                W.Status = 1;
+                continue;
+            }
+            std::string Input;
+            char Buf[1 << 12];
+            size_t N;
+            while ((N = fread(Buf, 1, sizeof(Buf), F)) != 0) {
+                Input.append(Buf, N);
+            }
+            fclose(F);
+            int64_t Start = nowNs();
+            bool OK = runTimed(Input);
+            printf("%s: %zu bytes, %s, %.3f ms\n", Path, Input.size(),
+                   OK ? "accepted" : "syntax errors", (nowNs() - Start) / 1e6);
+        }
+        return;
+    }
+
+    Random R(Seed);
+    std::string Input;
+    int64_t Deadline = nowNs() + (int64_t)(TimeLimit * 1e9);
+    for (uint64_t I = 0; !Runs || I != Runs; ++I) {
+        if (TimeLimit > 0 && (I & 63) == 0 && nowNs() > Deadline) {
+            break;
+        }
+        Generate(R, MaxLen, Input);
+        for (unsigned N = R.below(5); N != 0; --N) {
+            Mutate(R, MaxLen, Input);
+        }
+        runTimed(Input);
+    }
+}
+
+// 执行输入的线程，栈的大小由-stack指定
+static void *worker(void *Arg) {
+    WorkerArgs &W = *(WorkerArgs *)Arg;
+
+    pthread_attr_t Attr;
+    if (pthread_getattr_np(pthread_self(), &Attr) == 0) {
+        void *Addr;
+        size_t Size;
+        pthread_attr_getstack(&Attr, &Addr, &Size);
+        StackLow = (uintptr_t)Addr;
+        pthread_attr_destroy(&Attr);
+    }
+    // 栈溢出时信号处理函数在另外的栈上执行，线程结束前取消，它不属于这个线程
+    static char AltStack[1 << 16];
+    stack_t SS;
+    SS.ss_sp = AltStack;
+    SS.ss_size = sizeof(AltStack);
+    SS.ss_flags = 0;
+    stack_t OldSS;
+    sigaltstack(&SS, &OldSS);
+
+    runInputs(W);
+
+    sigaltstack(&OldSS, nullptr);
+    Finished = true;
+    return nullptr;
+}
+
+static int emitCorpus(const char *Dir) {
+    Random R(Seed);
+    std::string Input;
+    uint64_t N = Runs ? Runs : 256;
+    for (uint64_t I = 0; I != N; ++I) {
+        Generate(R, MaxLen, Input);
+        std::string Path = std::string(Dir) + "/seed-" + std::to_string(I);
+        FILE *F = fopen(Path.c_str(), "wb");
+        if (!F) {
+            fprintf(stderr, "Cannot write %s\n", Path.c_str());
+            return 1;
+        }
+        fwrite(Input.data(), 1, Input.size(), F);
+        fclose(F);
+    }
+    printf("%" PRIu64 " inputs written to %s\n", N, Dir);
+    return 0;
+}
+
+static void report(double Seconds) {
+    uint64_t E = Execs.load(), B = ExecBytes.load(), A = Accepted.load();
+    printf("#%-10" PRIu64 " %8.0f execs/s %8.2f MB/s  accepted %5.1f%%\n", E,
+           Seconds > 0 ? E / Seconds : 0.0, Seconds > 0 ? B / Seconds / 1e6 : 0.0,
+           E ? 100.0 * A / E : 0.0);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    WorkerArgs W;
+    const char *CorpusDir = nullptr;
+    for (int I = 1; I < argc; ++I) {
+        if (strncmp(argv[I], "-runs=", 6) == 0) {
+            Runs = strtoull(argv[I] + 6, nullptr, 10);
+            TimeLimit = 0;
+        } else if (strncmp(argv[I], "-time=", 6) == 0) {
+            TimeLimit = atof(argv[I] + 6);
+        } else if (strncmp(argv[I], "-seed=", 6) == 0) {
+            Seed = strtoull(argv[I] + 6, nullptr, 10);
+        } else if (strncmp(argv[I], "-max-len=", 9) == 0) {
+            MaxLen = std::max<size_t>(16, strtoull(argv[I] + 9, nullptr, 10));
+        } else if (strncmp(argv[I], "-timeout=", 9) == 0) {
+            TimeoutMs = std::max(1, atoi(argv[I] + 9));
+        } else if (strncmp(argv[I], "-stack=", 7) == 0) {
+            StackKB = std::max<size_t>(64, strtoull(argv[I] + 7, nullptr, 10));
+        } else if (strncmp(argv[I], "-artifacts=", 11) == 0) {
+            ArtifactDir = argv[I] + 11;
+        } else if (strncmp(argv[I], "-emit-corpus=", 13) == 0) {
+            CorpusDir = argv[I] + 13;
+        } else if (argv[I][0] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", argv[I]);
+            return 1;
+        } else {
+            W.Files.push_back(argv[I]);
+        }
+    }
+
+    if (CorpusDir) {
+        return emitCorpus(CorpusDir);
+    }
+
+    installCrashHandlers();
+    pthread_attr_t Attr;
+    pthread_attr_init(&Attr);
+    pthread_attr_setstacksize(&Attr, StackKB << 10);
+    pthread_t Thread;
+    if (pthread_create(&Thread, &Attr, worker, &W) != 0) {
+        fprintf(stderr, "Cannot create worker thread\n");
+        return 1;
+    }
+    pthread_attr_destroy(&Attr);
+
+    // 当前线程是看门狗: 检查当前输入是否超时，每秒报告一次吞吐量
+    int64_t Begin = nowNs();
+    int64_t NextReport = Begin + 1000000000;
+    while (!Finished) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        int64_t Now = nowNs();
+        int64_t Start = CurStart.load(std::memory_order_acquire);
+        if (Start && Now - Start > (int64_t)TimeoutMs * 1000000) {
+            fprintf(stderr, "== input of %zu bytes still running after %u ms\n", CurSize,
+                    TimeoutMs);
+            saveArtifact("hang", CurData, CurSize);
+            _exit(1);
+        }
+        if (W.Files.empty() && Now >= NextReport) {
+            report((Now - Begin) / 1e9);
+            NextReport += 1000000000;
+        }
+    }
+    pthread_join(Thread, nullptr);
+
+    if (W.Files.empty()) {
+        double Seconds = (nowNs() - Begin) / 1e9;
+        report(Seconds);
+        printf("done: %" PRIu64 " execs in %.1f s, slowest input %.3f ms (%zu bytes)\n",
+               Execs.load(), Seconds, SlowestNs / 1e6, SlowestLen);
+    }
+    return W.Status;
+}
+
+#endif
@@ -0,0 +1,260 @@
+// toy服务模式的压力测试客户端，统计吞吐量和延迟
+// 编译: g++ -O2 -std=c++17 -pthread bench/load.cpp -o kload
+//
+// 用法:
+//   toy -server=/tmp/k.sock &
+//   kload -socket=/tmp/k.sock [-clients=N] [-requests=N] [-namespaces=N]
+//   kload -spawn=./toy [-clients=N] [-requests=N]
+//
+// 每个客户端一个连接，先在自己的namespace中定义一组函数，然后连续发送只有调用的小请求
+// -spawn是对照: 每个请求启动一个toy进程，从标准输入传入定义和调用
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+static const char *SocketPath = nullptr;
+static const char *SpawnPath = nullptr;
+static int Clients = 8;
+static int Requests = 2000;
+static int Namespaces = 8;
+
+// 每个namespace中的定义，请求只调用它们
+static const char *Library =
+    "def binary| 5 (a b) a * a + b;\n"
+    "def g(x y) var t = x * y + 1 in sqrt(fabs(t)) + (t | y);\n"
+    "def f(x y) g(x, y) * g(y, x) - g(x + 1, y - 1);\n";
+
+static std::string makeRequest(int Client, int I) {
+    return "f(" + std::to_string(Client) + ", " + std::to_string(I % 100) + ");\n";
+}
+
+//=========
+// Socket client
+//=========
+
+static bool writeAll(int Fd, const std::string &Data) {
+    size_t Done = 0;
+    while (Done != Data.size()) {
+        ssize_t N = write(Fd, Data.data() + Done, Data.size() - Done);
+        if (N < 0 && errno == EINTR) {
+            continue;
+        }
+        if (N <= 0) {
+            return false;
+        }
+        Done += N;
+    }
+    return true;
+}
+
+// 读取一个响应，格式见toy.cpp
+class ResponseReader {
+    int Fd;
+    std::string Buf;
+
+    bool fill() {
+        char Tmp[65536];
+        ssize_t N;
+        do {
+            N = ::read(Fd, Tmp, sizeof(Tmp));
+        } while (N < 0 && errno == EINTR);
+        if (N <= 0) {
+            return false;
+        }
+        Buf.append(Tmp, N);
+        return true;
+    }
+
+public:
+    explicit ResponseReader(int Fd) : Fd(Fd) {}
+
+    bool read(std::string &Body) {
+        size_t HeaderEnd;
+        while ((HeaderEnd = Buf.find('\n')) == std::string::npos) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        size_t Length = strtoull(Buf.c_str(), nullptr, 10);
+        while (Buf.size() - HeaderEnd - 1 < Length) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        Body = Buf.substr(HeaderEnd + 1, Length);
+        Buf.erase(0, HeaderEnd + 1 + Length);
+        return true;
+    }
+};
+
+static int connectTo(const char *Path) {
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    strncpy(Addr.sun_path, Path, sizeof(Addr.sun_path) - 1);
+    int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Fd < 0 || connect(Fd, (sockaddr *)&Addr, sizeof(Addr)) != 0) {
+        if (Fd >= 0) {
+            close(Fd);
+        }
+        return -1;
+    }
+    return Fd;
+}
+
+static bool roundTrip(int Fd, ResponseReader &R, const std::string &NS,
+                      const std::string &Source, std::string &Body) {
+    return writeAll(Fd, NS + " " + std::to_string(Source.size()) + "\n" + Source) &&
+           R.read(Body);
+}
+
+// 返回失败的请求数，每个请求的延迟(微秒)追加到Latencies
+static int runSocketClient(int Client, std::vector<double> &Latencies) {
+    int Fd = connectTo(SocketPath);
+    if (Fd < 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", SocketPath, strerror(errno));
+        return Requests;
+    }
+    ResponseReader R(Fd);
+    std::string NS = "ns" + std::to_string(Client % Namespaces);
+    std::string Body;
+
+    int Failed = 0;
+    if (!roundTrip(Fd, R, NS, Library, Body) || Body.find("error") != std::string::npos) {
+        Failed = Requests;
+    }
+    for (int I = 0; I != Requests && !Failed; ++I) {
+        auto Start = Clock::now();
+        bool OK = roundTrip(Fd, R, NS, makeRequest(Client, I), Body);
+        auto End = Clock::now();
+        if (!OK) {
+            Failed = Requests - I;
+            break;
+        }
+        if (Body.compare(0, 6, "value ") != 0) {
+            ++Failed;
+        }
+        Latencies.push_back(std::chrono::duration<double, std::micro>(End - Start).count());
+    }
+    close(Fd);
+    return Failed;
+}
+
+//=========
+// Process-per-request client
+//=========
+
+// 启动一个toy进程，把源码写到它的标准输入，等待它退出
+static bool spawnOnce(const std::string &Source) {
+    int Pipe[2];
+    if (pipe(Pipe) != 0) {
+        return false;
+    }
+    pid_t Pid = fork();
+    if (Pid == 0) {
+        dup2(Pipe[0], 0);
+        int Null = open("/dev/null", O_WRONLY);
+        dup2(Null, 1);
+        dup2(Null, 2);
+        close(Pipe[0]);
+        close(Pipe[1]);
+        execl(SpawnPath, SpawnPath, (char *)nullptr);
+        _exit(127);
+    }
+    close(Pipe[0]);
+    bool OK = Pid > 0 && writeAll(Pipe[1], Source);
+    close(Pipe[1]);
+    int Status = 0;
+    if (Pid > 0) {
+        waitpid(Pid, &Status, 0);
+    }
+    return OK && WIFEXITED(Status) && WEXITSTATUS(Status) == 0;
+}
+
+static int runSpawnClient(int Client, std::vector<double> &Latencies) {
+    int Failed = 0;
+    for (int I = 0; I != Requests; ++I) {
+        auto Start = Clock::now();
+        bool OK = spawnOnce(Library + makeRequest(Client, I));
+        auto End = Clock::now();
+        Failed += !OK;
+        Latencies.push_back(std::chrono::duration<double, std::micro>(End - Start).count());
+    }
+    return Failed;
+}
+
+int main(int argc, char **argv) {
+    for (int I = 1; I < argc; ++I) {
+        if (strncmp(argv[I], "-socket=", 8) == 0) {
+            SocketPath = argv[I] + 8;
+        } else if (strncmp(argv[I], "-spawn=", 7) == 0) {
+            SpawnPath = argv[I] + 7;
+        } else if (strncmp(argv[I], "-clients=", 9) == 0) {
+            Clients = std::max(1, atoi(argv[I] + 9));
+        } else if (strncmp(argv[I], "-requests=", 10) == 0) {
+            Requests = std::max(1, atoi(argv[I] + 10));
+        } else if (strncmp(argv[I], "-namespaces=", 12) == 0) {
+            Namespaces = std::max(1, atoi(argv[I] + 12));
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[I]);
+            return 1;
+        }
+    }
+    if (!SocketPath == !SpawnPath) {
+        fprintf(stderr, "Exactly one of -socket=<path> and -spawn=<toy> is required\n");
+        return 1;
+    }
+
+    std::vector<std::vector<double>> Latencies(Clients);
+    std::vector<int> Failed(Clients);
+    std::vector<std::thread> Threads;
+    auto Start = Clock::now();
+    for (int C = 0; C != Clients; ++C) {
+        Threads.emplace_back([&, C] {
+            Failed[C] = SocketPath ? runSocketClient(C, Latencies[C])
+                                   : runSpawnClient(C, Latencies[C]);
+        });
+    }
+    for (std::thread &T : Threads) {
+        T.join();
+    }
+    double Seconds = std::chrono::duration<double>(Clock::now() - Start).count();
+
+    std::vector<double> All;
+    int TotalFailed = 0;
+    for (int C = 0; C != Clients; ++C) {
+        All.insert(All.end(), Latencies[C].begin(), Latencies[C].end());
+        TotalFailed += Failed[C];
+    }
+    if (All.empty()) {
+        fprintf(stderr, "No request completed\n");
+        return 1;
+    }
+    std::sort(All.begin(), All.end());
+    auto Percentile = [&](double P) {
+        return All[std::min(All.size() - 1, (size_t)(P * All.size()))];
+    };
+
+    printf("%-12s %s\n", "mode", SocketPath ? "socket" : "spawn");
+    printf("%-12s %d x %d\n", "requests", Clients, Requests);
+    printf("%-12s %d\n", "failed", TotalFailed);
+    printf("%-12s %.1f req/s\n", "throughput", All.size() / Seconds);
+    printf("%-12s %.1f us\n", "p50", Percentile(0.50));
+    printf("%-12s %.1f us\n", "p99", Percentile(0.99));
+    printf("%-12s %.1f us\n", "max", All.back());
+    return TotalFailed ? 1 : 0;
+}
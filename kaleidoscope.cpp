@@ -0,0 +1,5754 @@
+#include "kaleidoscope.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kaleidoscope {
+
+//=========
+// Statistics
+//=========
+
+// 各个阶段的耗时和计数器，用于-time-passes和-stats
+// 默认关闭，关闭时每个计时点只有一次分支的开销
+
+enum Phase {
+    phase_none = -1,
+    phase_lex,
+    phase_parse_definition,
+    phase_parse_extern,
+    phase_parse_toplevel,
+    phase_sema,
+    phase_eval,
+    phase_batch_compile,
+    phase_batch_run,
+    phase_cache_load,
+    phase_cache_save,
+    phase_ast_load,
+    phase_ast_save,
+    phase_ad,
+    NumPhases
+};
+
+static const char *const PhaseNames[NumPhases] = {
+    "lex",           "parse.definition", "parse.extern", "parse.toplevel",
+    "sema",          "eval",             "batch.compile", "batch.run",
+    "cache.load",    "cache.save",       "ast.load",     "ast.save",
+    "ad",
+};
+
+enum Counter {
+    cnt_tokens,
+    cnt_source_bytes,
+    cnt_definitions,
+    cnt_externs,
+    cnt_toplevel_exprs,
+    cnt_parse_errors,
+    cnt_parse_deferred,
+    cnt_skipped_tokens,
+    cnt_sema_errors,
+    cnt_sema_deferred,
+    cnt_eval_errors,
+    cnt_node_number,
+    cnt_node_variable,
+    cnt_node_unary,
+    cnt_node_binary,
+    cnt_node_call,
+    cnt_node_var,
+    cnt_node_map,
+    cnt_node_prototype,
+    cnt_node_function,
+    cnt_node_bytes,
+    cnt_calls,
+    cnt_batch_rows,
+    cnt_cache_memory_hits,
+    cnt_cache_disk_hits,
+    cnt_cache_misses,
+    cnt_cache_invalidated,
+    cnt_tier_compiles,
+    cnt_tier_calls,
+    cnt_tier_profile_compiles,
+    cnt_ad_derivatives,
+    cnt_map_rows,
+    NumCounters
+};
+
+static const char *const CounterNames[NumCounters] = {
+    "lex.tokens",         "lex.source_bytes",   "parse.definitions",
+    "parse.externs",      "parse.toplevel_exprs", "parse.errors",
+    "parse.deferred",
+    "parse.skipped_tokens", "sema.errors",      "sema.deferred",
+    "eval.errors",
+    "ast.nodes.number",   "ast.nodes.variable",
+    "ast.nodes.unary",    "ast.nodes.binary",   "ast.nodes.call",
+    "ast.nodes.var",      "ast.nodes.map",      "ast.nodes.prototype",
+    "ast.nodes.function",
+    "ast.bytes",          "eval.calls",         "batch.rows",
+    "cache.memory_hits",  "cache.disk_hits",    "cache.misses",
+    "cache.invalidated",  "tier.compiles",      "tier.calls",
+    "tier.profile_compiles", "ad.derivatives",  "map.rows",
+};
+
+class Statistics {
+    using Clock = std::chrono::steady_clock;
+
+    // 当前正在计时的阶段，时间总是只算到最内层的阶段上，所以各阶段的时间之和就是总时间
+    Phase Current = phase_none;
+    Clock::time_point Last;
+
+    // 把从上一次切换到现在的时间算到当前阶段上
+    void charge() {
+        Clock::time_point Now = Clock::now();
+        if (Current != phase_none) {
+            Nanos[Current] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                  Now - Last).count();
+        }
+        Last = Now;
+    }
+
+public:
+    bool Enabled = false;
+    uint64_t Nanos[NumPhases] = {};
+    uint64_t Entries[NumPhases] = {};
+    uint64_t Counters[NumCounters] = {};
+
+    void add(Counter C, uint64_t N = 1) {
+        if (Enabled) {
+            Counters[C] += N;
+        }
+    }
+
+    Phase enter(Phase P) {
+        charge();
+        Phase Saved = Current;
+        Current = P;
+        ++Entries[P];
+        return Saved;
+    }
+
+    void leave(Phase Saved) {
+        charge();
+        Current = Saved;
+    }
+
+    void reset() {
+        for (auto &N : Nanos) {
+            N = 0;
+        }
+        for (auto &E : Entries) {
+            E = 0;
+        }
+        for (auto &C : Counters) {
+            C = 0;
+        }
+    }
+
+    std::string report(bool Timers, bool Counts) const;
+    std::string json() const;
+};
+
+// 在作用域内为一个阶段计时
+class PhaseTimer {
+    Statistics &S;
+    Phase Saved = phase_none;
+    bool Active;
+
+public:
+    PhaseTimer(Statistics &S, Phase P) : S(S), Active(S.Enabled) {
+        if (Active) {
+            Saved = S.enter(P);
+        }
+    }
+
+    ~PhaseTimer() {
+        if (Active) {
+            S.leave(Saved);
+        }
+    }
+};
+
+std::string Statistics::report(bool Timers, bool Counts) const {
+    std::string Out;
+    char Line[128];
+
+    if (Timers) {
+        uint64_t Total = 0;
+        for (uint64_t N : Nanos) {
+            Total += N;
+        }
+
+        Out += "===------------------------------------------===\n";
+        Out += "          Phase execution timing report\n";
+        Out += "===------------------------------------------===\n";
+        snprintf(Line, sizeof(Line), "  Total Execution Time: %.4f seconds\n\n",
+                 Total / 1e9);
+        Out += Line;
+        Out += "   ---Time---   --%--      ---Count---  --Phase--\n";
+        for (int P = 0; P != NumPhases; ++P) {
+            if (!Entries[P]) {
+                continue;
+            }
+            snprintf(Line, sizeof(Line), "  %10.4f  %6.1f%%  %13llu  %s\n",
+                     Nanos[P] / 1e9, Total ? 100.0 * Nanos[P] / Total : 0.0,
+                     (unsigned long long)Entries[P], PhaseNames[P]);
+            Out += Line;
+        }
+        Out += "\n";
+    }
+
+    if (Counts) {
+        Out += "===------------------------------------------===\n";
+        Out += "                  Statistics\n";
+        Out += "===------------------------------------------===\n";
+        for (int C = 0; C != NumCounters; ++C) {
+            if (!Counters[C]) {
+                continue;
+            }
+            snprintf(Line, sizeof(Line), "%14llu  %s\n",
+                     (unsigned long long)Counters[C], CounterNames[C]);
+            Out += Line;
+        }
+        Out += "\n";
+    }
+    return Out;
+}
+
+std::string Statistics::json() const {
+    std::string Out = "{\n  \"phases\": {";
+    char Line[128];
+    for (int P = 0; P != NumPhases; ++P) {
+        snprintf(Line, sizeof(Line), "%s\n    \"%s\": {\"seconds\": %.9f, \"count\": %llu}",
+                 P ? "," : "", PhaseNames[P], Nanos[P] / 1e9,
+                 (unsigned long long)Entries[P]);
+        Out += Line;
+    }
+    Out += "\n  },\n  \"counters\": {";
+    for (int C = 0; C != NumCounters; ++C) {
+        snprintf(Line, sizeof(Line), "%s\n    \"%s\": %llu", C ? "," : "",
+                 CounterNames[C], (unsigned long long)Counters[C]);
+        Out += Line;
+    }
+    Out += "\n  }\n}\n";
+    return Out;
+}
+
+//=========
+// Lexer
+//=========
+
+// 如果是未知的字符Lexer返回在[0, 255]内的token，否则是已知的
+enum Token {
+    tok_eof = -1,
+
+    tok_def = -2,
+    tok_extern = -3,
+
+    tok_identifier = -4, // 标识符
+    tok_number = -5,
+
+    // 局部变量
+    tok_var = -6,
+    tok_in = -7,
+
+    // 自定义运算符
+    tok_binary = -8,
+    tok_unary = -9
+};
+
+class Lexer {
+    // 还没有被读取的源码，读完之后通过Reader取得更多
+    std::string Buffer;
+    size_t Pos = 0;
+    SourceReader Reader;
+    Statistics &Stats;
+
+    int LastChar = ' ';
+    // LastChar的位置，以及下一个字符的位置
+    SourceLocation LastCharLoc;
+    SourceLocation NextLoc{1, 1};
+    // 最近一个token的起始位置
+    SourceLocation TokBegin;
+
+    // 记录读过的源码，用于延迟解析的定义保存body的源码
+    // 记录期间Recorded总是以LastChar结尾，TokRecordBegin是最近一个token在其中的起始位置
+    bool Recording = false;
+    std::string Recorded;
+    size_t TokRecordBegin = 0;
+
+    // 返回下一个字符，没有更多输入时返回EOF
+    int getChar() {
+        LastCharLoc = NextLoc;
+        while (Pos == Buffer.size()) {
+            Buffer.clear();
+            Pos = 0;
+            if (!Reader || !Reader(Buffer)) {
+                return EOF;
+            }
+            Stats.add(cnt_source_bytes, Buffer.size());
+        }
+
+        unsigned char C = Buffer[Pos++];
+        if (Recording) {
+            Recorded += C;
+        }
+        if (C == '\n') {
+            ++NextLoc.Line;
+            NextLoc.Col = 1;
+        } else {
+            ++NextLoc.Col;
+        }
+        return C;
+    }
+
+    // 跳过注释剩下的部分，LastChar变为行尾的换行符或者EOF
+    // 直接在缓冲区中查找行尾，不逐个字符地调用getChar()
+    void skipComment() {
+        while (true) {
+            size_t End = Pos;
+            while (End != Buffer.size() && Buffer[End] != '\n' && Buffer[End] != '\r') {
+                ++End;
+            }
+            NextLoc.Col += End - Pos;
+            if (Recording) {
+                Recorded.append(Buffer, Pos, End - Pos);
+            }
+            Pos = End;
+
+            // 行尾的字符，或者缓冲区用完时下一块输入的第一个字符
+            LastChar = getChar();
+            if (LastChar == EOF || LastChar == '\n' || LastChar == '\r') {
+                return;
+            }
+        }
+    }
+
+public:
+    std::string IdentifierStr;
+    double NumVal;
+
+    Lexer(SourceReader Reader, Statistics &Stats)
+        : Reader(std::move(Reader)), Stats(Stats) {}
+
+    int gettok();
+
+    // 最近一个token在源码中的范围，结束位置是它之后的第一个字符
+    SourceRange getTokenRange() const { return {TokBegin, LastCharLoc}; }
+
+    // 已经读入的源码是否都处理完了，再取token就要向Reader请求更多的输入
+    bool atEndOfChunk() const {
+        return Pos == Buffer.size() && (LastChar == EOF || isspace(LastChar));
+    }
+
+    // 源码从Loc开始，在读取第一个字符之前调用
+    void setLocation(SourceLocation Loc) { NextLoc = Loc; }
+
+    // 从下一个token开始记录源码，返回记录的起始位置
+    SourceLocation startRecording() {
+        Recording = true;
+        Recorded.clear();
+        if (LastChar != EOF) {
+            Recorded += (char)LastChar;
+        }
+        return LastCharLoc;
+    }
+
+    // 停止记录，返回从startRecording()到最近一个token之前的源码
+    std::string stopRecording() {
+        Recording = false;
+        Recorded.resize(std::min(TokRecordBegin, Recorded.size()));
+        return std::move(Recorded);
+    }
+};
+
+// 从输入中返回下一个token
+int Lexer::gettok() {
+    // 跳过空格和注释，连续很多行注释时也只在这里循环，不会递归
+    while (true) {
+        while (isspace(LastChar)) {
+            LastChar = getChar();
+        }
+        if (LastChar != '#') {
+            break;
+        }
+        // 注释在编译阶段会被忽视，读完这一行之后继续找下一个token
+        skipComment();
+    }
+    TokBegin = LastCharLoc;
+    if (Recording) {
+        TokRecordBegin = Recorded.size() - (LastChar != EOF);
+    }
+
+    // 不能以数字开头，但是后续的可以出现数字，因此只有最开始判断isalpha
+    // 实际中不允许以数字开头生命变量，可能也是这个原因，和第二部分的判断冲突
+    if (isalpha(LastChar)) {
+        IdentifierStr = LastChar;
+
+        // 拿到一个完整的字母数字组合
+        while (isalnum((LastChar = getChar()))) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+            IdentifierStr += LastChar;
+        }
+
+        if (IdentifierStr == "def") {
+            return tok_def;
+        }
+
+        if (IdentifierStr == "extern") {
+            return tok_extern;
+        }
+
+        if (IdentifierStr == "var") {
+            return tok_var;
+        }
+
+        if (IdentifierStr == "in") {
+            return tok_in;
+        }
+
+        if (IdentifierStr == "binary") {
+            return tok_binary;
+        }
+
+        if (IdentifierStr == "unary") {
+            return tok_unary;
+        }
+
+        return tok_identifier;
+    }
+
+    // 数组
+    if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
+        std::string NumStr;
+        do {
+            NumStr += LastChar;
+            LastChar = getChar();
+        } while (isdigit(LastChar) || LastChar == '.');
+
+        // 从数组开始的指针到空指针，即整个数组
+        NumVal = strtod(NumStr.c_str(), nullptr);
+        return tok_number;
+    }
+
+    if (LastChar == EOF) {
+        return tok_eof;
+    }
+
+    // 否则，返回字符的ascii码
+    int ThisChar = LastChar;
+    LastChar = getChar();
+    return ThisChar;
+}
+
+//=========
+// Intrinsics
+//=========
+
+// 内置的数学函数，不需要定义就可以直接调用
+// 解释器对它们不做函数调用，而是直接执行对应的指令或libm函数
+enum IntrinsicID {
+    intr_sin,
+    intr_cos,
+    intr_tan,
+    intr_sqrt,
+    intr_fabs,
+    intr_exp,
+    intr_log,
+    intr_floor,
+    intr_ceil,
+    intr_pow,
+    intr_atan2,
+    intr_fmin,
+    intr_fmax
+};
+
+struct IntrinsicInfo {
+    const char *Name;
+    IntrinsicID ID;
+    unsigned NumArgs;
+};
+
+static const IntrinsicInfo Intrinsics[] = {
+    {"sin", intr_sin, 1},     {"cos", intr_cos, 1},
+    {"tan", intr_tan, 1},     {"sqrt", intr_sqrt, 1},
+    {"fabs", intr_fabs, 1},   {"exp", intr_exp, 1},
+    {"log", intr_log, 1},     {"floor", intr_floor, 1},
+    {"ceil", intr_ceil, 1},   {"pow", intr_pow, 2},
+    {"atan2", intr_atan2, 2}, {"fmin", intr_fmin, 2},
+    {"fmax", intr_fmax, 2},
+};
+
+// 按名字查找内置函数，不是内置函数时返回nullptr
+static const IntrinsicInfo *LookupIntrinsic(const std::string &Name) {
+    for (const auto &I : Intrinsics) {
+        if (Name == I.Name) {
+            return &I;
+        }
+    }
+    return nullptr;
+}
+
+// 内置的数据并行map: mapsum(f, start, end, step)等，第一个参数是单参数函数的名字
+// 和内置函数一样在解析调用时确定，不能被重新定义
+struct MapBuiltinInfo {
+    const char *Name;
+    Reduction R;
+};
+
+static const MapBuiltinInfo MapBuiltins[] = {
+    {"mapsum", Reduction::Sum},
+    {"mapmin", Reduction::Min},
+    {"mapmax", Reduction::Max},
+};
+
+static const MapBuiltinInfo *LookupMapBuiltin(const std::string &Name) {
+    for (const auto &M : MapBuiltins) {
+        if (Name == M.Name) {
+            return &M;
+        }
+    }
+    return nullptr;
+}
+
+// 计算内置函数的值，常量折叠和解释执行共用，保证两者的结果完全一致
+// 用switch而不是函数指针，sqrt、fabs等可以被编译成单条指令
+static double EvalIntrinsic(IntrinsicID ID, const double *Args) {
+    switch (ID) {
+    case intr_sin:
+        return std::sin(Args[0]);
+    case intr_cos:
+        return std::cos(Args[0]);
+    case intr_tan:
+        return std::tan(Args[0]);
+    case intr_sqrt:
+        return std::sqrt(Args[0]);
+    case intr_fabs:
+        return std::fabs(Args[0]);
+    case intr_exp:
+        return std::exp(Args[0]);
+    case intr_log:
+        return std::log(Args[0]);
+    case intr_floor:
+        return std::floor(Args[0]);
+    case intr_ceil:
+        return std::ceil(Args[0]);
+    case intr_pow:
+        return std::pow(Args[0], Args[1]);
+    case intr_atan2:
+        return std::atan2(Args[0], Args[1]);
+    case intr_fmin:
+        return std::fmin(Args[0], Args[1]);
+    case intr_fmax:
+        return std::fmax(Args[0], Args[1]);
+    }
+    return 0.0;
+}
+
+//=========
+// Abstract Syntax Tree
+//=========
+
+class ASTHasher;
+class ASTWriter;
+class BatchBuilder;
+class BatchProgram;
+class Differentiator;
+class Interpreter;
+class ParallelPlanner;
+class Resolver;
+class TaskPool;
+class TierCompiler;
+struct DiffValue;
+struct FunctionSlot;
+struct ParallelInfo;
+
+// 基类，派生出各种ExprAST，让后续步骤知道在处理什么
+class ExprAST {
+public:
+    virtual ~ExprAST() = default;
+    // 解释执行该表达式，返回其值
+    virtual double eval(Interpreter &I) = 0;
+    // 生成批量求值的指令，返回结果所在的寄存器，出错时返回-1
+    virtual int batchgen(BatchBuilder &B) = 0;
+    // 把表达式的结构加入哈希，空白、注释和多余的括号不影响结果
+    virtual void hash(ASTHasher &H) const = 0;
+    // 写入二进制的AST格式
+    virtual void serialize(ASTWriter &W) const = 0;
+    // 名字解析，子节点交给R，不在这里递归
+    virtual void resolve(Resolver &R) = 0;
+    // 自动微分，生成计算该表达式的原值和导数的代码
+    virtual DiffValue diff(Differentiator &D) const = 0;
+    // 估计求值的开销，同时标出可以并行求值的操作数
+    virtual ParallelInfo plan(ParallelPlanner &P) = 0;
+
+    SourceLocation getLoc() const { return Loc; }
+    void setLoc(SourceLocation L) { Loc = L; }
+
+protected:
+    // 表达式在源码中的位置，用于报告执行时的错误
+    // 二元和一元运算是运算符的位置，其他的是表达式的起始位置
+    SourceLocation Loc;
+
+    // 释放子节点，有子节点的类在析构函数中调用
+    // 子节点不在析构函数中递归地释放，而是放进一个队列里逐个释放
+    // 这样无论树有多深，释放时使用的调用栈都是固定的
+    static void destroy(std::unique_ptr<ExprAST> Child);
+};
+
+class NumberExprAST : public ExprAST {
+    double Val;
+
+public:
+    NumberExprAST(double Val) : Val(Val) {}
+    double getVal() const { return Val; }
+    double eval(Interpreter &I) override;
+    int batchgen(BatchBuilder &B) override;
+    void hash(ASTHasher &H) const override;
+    void serialize(ASTWriter &W) const override;
+    void resolve(Resolver &R) override;
+    DiffValue diff(Differentiator &D) const override;
+    ParallelInfo plan(ParallelPlanner &P) override;
+};
+
+class VariableExprAST : public ExprAST {
+    std::string Name;
+    // 名字解析后得到的栈槽，相对于当前函数栈帧的起始位置
+    unsigned Slot = 0;
+public:
+    VariableExprAST(const std::string &Name) : Name(Name) {}
+    const std::string &getName() const { return Name; }
+    unsigned getSlot() const { return Slot; }
+    double eval(Interpreter &I) override;
+    int batchgen(BatchBuilder &B) override;
+    void hash(ASTHasher &H) const override;
+    void serialize(ASTWriter &W) const override;
+    void resolve(Resolver &R) override;
+    DiffValue diff(Differentiator &D) const override;
+    ParallelInfo plan(ParallelPlanner &P) override;
+};
+
+// 一元运算符，只有自定义的，没有内置的
+class UnaryExprAST : public ExprAST {
+    char Opcode;
+    std::unique_ptr<ExprAST> Operand;
+    // 运算符对应的函数表项，和调用一样在名字解析时绑定
+    FunctionSlot *Target = nullptr;
+
+public:
+    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
+        : Opcode(Opcode), Operand(std::move(Operand)) {}
+    ~UnaryExprAST() override { destroy(std::move(Operand)); }
+    double eval(Interpreter &I) override;
+    int batchgen(BatchBuilder &B) override;
+    void hash(ASTHasher &H) const override;
+    void serialize(ASTWriter &W) const override;
+    void resolve(Resolver &R) override;
+    DiffValue diff(Differentiator &D) const override;
+    ParallelInfo plan(ParallelPlanner &P) override;
+};
+
+class BinaryExprAST : public ExprAST {
+    char Op;
+    std::unique_ptr<ExprAST> LHS, RHS;
+    // 自定义运算符对应的函数表项，内置运算符和赋值为空
+    FunctionSlot *Target = nullptr;
+    // 并行求值时LHS交给线程池，当前线程求值RHS
+    bool SpawnLHS = false;
+public:
+    // std::move()将对象的值直接移动过去，而不是复制，避免额外的内存空间开销
+    BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
+                  std::unique_ptr<ExprAST> RHS)
+        : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    ~BinaryExprAST() override {
+        destroy(std::move(LHS));
+        destroy(std::move(RHS));
+    }
+    double eval(Interpreter &I) override;
+    int batchgen(BatchBuilder &B) override;
+    void hash(ASTHasher &H) const override;
+    void serialize(ASTWriter &W) const override;
+    void resolve(Resolver &R) override;
+    DiffValue diff(Differentiator &D) const override;
+    ParallelInfo plan(ParallelPlanner &P) override;
+};
+
+class CallExprAST : public ExprAST {
+    std::string Callee;
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    // 调用的是内置函数时不为空
+    const IntrinsicInfo *Intrinsic;
+    // 名字解析后绑定的函数表项，调用时直接取其中的定义
+    FunctionSlot *Target = nullptr;
+    // 并行求值时交给线程池的参数，第i位对应第i个参数
+    uint64_t SpawnMask = 0;
+public:
+    CallExprAST(const std::string &Callee,
+                std::vector<std::unique_ptr<ExprAST>> Args,
+                const IntrinsicInfo *Intrinsic = nullptr)
+        : Callee(Callee), Args(std::move(Args)), Intrinsic(Intrinsic) {}
+    ~CallExprAST() override {
+        for (auto &Arg : Args) {
+            destroy(std::move(Arg));
+        }
+    }
+    double eval(Interpreter &I) override;
+    int batchgen(BatchBuilder &B) override;
+    void hash(ASTHasher &H) const override;
+    void serialize(ASTWriter &W) const override;
+    void resolve(Resolver &R) override;
+    DiffValue diff(Differentiator &D) const override;
+    ParallelInfo plan(ParallelPlanner &P) override;
+};
+
+// var/in表达式，声明一组局部变量，只在Body中可见
+class VarExprAST : public ExprAST {
+    // 变量名和初始值，没有初始值时为nullptr，默认是0.0
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    std::unique_ptr<ExprAST> Body;
+
+public:
+    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
+               std::unique_ptr<ExprAST> Body)
+        : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+    ~VarExprAST() override {
+        for (auto &Var : VarNames) {
+            destroy(std::move(Var.second));
+        }
+        destroy(std::move(Body));
+    }
+    double eval(Interpreter &I) override;
+    int batchgen(BatchBuilder &B) override;
+    void hash(ASTHasher &H) const override;
+    void serialize(ASTWriter &W) const override;
+    void resolve(Resolver &R) override;
+    DiffValue diff(Differentiator &D) const override;
+    ParallelInfo plan(ParallelPlanner &P) override;
+};
+
+// mapsum(f, start, end, step)等，对范围中的每个值调用f，再把结果归约成一个值
+// 范围和Function::map()一样，整个map在批量求值程序中按块执行，见ContextImpl::map()
+class MapExprAST : public ExprAST {
+    const MapBuiltinInfo *Builtin;
+    std::string Callee;
+    // 起点、终点和步长
+    std::unique_ptr<ExprAST> Range[3];
+    FunctionSlot *Target = nullptr;
+
+public:
+    MapExprAST(const MapBuiltinInfo *Builtin, const std::string &Callee,
+               std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+               std::unique_ptr<ExprAST> Step)
+        : Builtin(Builtin), Callee(Callee),
+          Range{std::move(Start), std::move(End), std::move(Step)} {}
+    ~MapExprAST() override {
+        for (auto &E : Range) {
+            destroy(std::move(E));
+        }
+    }
+    double eval(Interpreter &I) override;
+    int batchgen(BatchBuilder &B) override;
+    void hash(ASTHasher &H) const override;
+    void serialize(ASTWriter &W) const override;
+    void resolve(Resolver &R) override;
+    DiffValue diff(Differentiator &D) const override;
+    ParallelInfo plan(ParallelPlanner &P) override;
+};
+
+// 函数表中的一项，每个定义过或者被调用过的函数名(包括自定义运算符)各有一项
+// 地址在Context的生命周期内不变，调用在名字解析时绑定到这里，执行时不再按名字查找
+// 重新定义只需要替换Def，已经绑定的调用自然会调用新的定义
+struct FunctionSlot {
+    std::shared_ptr<FunctionAST> Def; // 当前的定义，还没有定义时为空
+
+    // Def的结构哈希，包含它(间接)调用的函数，HashInProgress用来打断递归调用
+    enum { HashInvalid, HashInProgress, HashValid } HashState = HashInvalid;
+    uint64_t Hash = 0;
+    // 计算哈希时用到了这一项的函数表项，这一项重新定义时只有它们的哈希需要重新计算
+    std::unordered_set<FunctionSlot *> Callers;
+
+    // 分层执行: Def先由解释器执行并计数，调用次数达到阈值后在后台编译成BatchProgram
+    // 编译好之后逐次调用直接执行编译结果；Def或者它调用的函数重新定义时和哈希一起失效
+    unsigned Calls = 0;
+    bool TierRequested = false;
+    std::shared_ptr<BatchProgram> Compiled;
+    // 每次失效加一，后台编译完成时据此丢弃已经过时的结果
+    unsigned Generation = 0;
+
+    // 当前定义被解释器调用的总次数，用于saveProfile()，只在这一项重新定义时清零
+    uint64_t ProfileCalls = 0;
+};
+
+// 等待释放的节点，每个线程一个
+static thread_local std::vector<std::unique_ptr<ExprAST>> DestroyQueue;
+static thread_local bool Destroying = false;
+
+void ExprAST::destroy(std::unique_ptr<ExprAST> Child) {
+    if (!Child) {
+        return;
+    }
+
+    // 已经在释放一棵树了，交给最外层的循环处理
+    DestroyQueue.push_back(std::move(Child));
+    if (Destroying) {
+        return;
+    }
+
+    Destroying = true;
+    while (!DestroyQueue.empty()) {
+        // 先移出队列再释放，它的子节点会被追加到队列中
+        std::unique_ptr<ExprAST> E = std::move(DestroyQueue.back());
+        DestroyQueue.pop_back();
+        E.reset();
+    }
+    Destroying = false;
+}
+
+// 表示函数原型的一些信息
+// 自定义运算符也是函数，名字为"binary"或"unary"加上运算符
+class PrototypeAST {
+    std::string Name;
+    std::vector<std::string> Args;
+    bool IsOperator;
+    unsigned Precedence; // 二元运算符的优先级
+
+public:
+    PrototypeAST(const std::string &Name, std::vector<std::string> Args,
+                 bool IsOperator = false, unsigned Prec = 0)
+        : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
+          Precedence(Prec) {}
+    
+    const std::string &getName() const { return Name; }
+    const std::vector<std::string> &getArgs() const { return Args; }
+
+    bool isOperator() const { return IsOperator; }
+    bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
+    bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
+
+    char getOperatorName() const {
+        // 运算符是名字的最后一个字符
+        return Name[Name.size() - 1];
+    }
+
+    unsigned getBinaryPrecedence() const { return Precedence; }
+};
+
+// 二元运算符的优先级表，按ascii码直接索引，0表示不是二元运算符
+using PrecedenceTable = std::array<int, 128>;
+
+// 延迟解析的定义只保存body的源码，第一次使用时才解析
+struct DeferredBody {
+    std::string Source;
+    SourceLocation Loc; // Source在原来的源码中的起始位置，诊断信息的位置和直接解析时一样
+    // 定义时的运算符优先级，body按它解析，之后重新定义运算符不改变这个函数的含义
+    std::shared_ptr<const PrecedenceTable> Precedence;
+};
+
+class FunctionAST {
+    std::unique_ptr<PrototypeAST> Proto;
+    // 延迟解析的定义在解析之前Body为空，Deferred中是它的源码
+    std::unique_ptr<ExprAST> Body;
+    std::unique_ptr<DeferredBody> Deferred;
+    // 加入函数表之后所在的表项，被同名的定义替换之后表项中就不再是它
+    FunctionSlot *Slot = nullptr;
+    // 是否已经完成名字解析，延迟解析的定义在第一次使用时才解析
+    // 后台编译的线程据此跳过还没有解析的定义，所以是原子的
+    std::atomic<bool> Resolved{false};
+    // 调用它时解释器递归的层数，即函数体的深度加上调用本身，名字解析时计算
+    unsigned Depth = 0;
+
+public:
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
+                std::unique_ptr<ExprAST> Body)
+        : Proto(std::move(Proto)), Body(std::move(Body)) {}
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
+                std::unique_ptr<DeferredBody> Deferred)
+        : Proto(std::move(Proto)), Deferred(std::move(Deferred)) {}
+
+    const PrototypeAST &getProto() const { return *Proto; }
+    const std::string &getName() const { return Proto->getName(); }
+    ExprAST &getBody() const { return *Body; }
+    bool isParsed() const { return Body != nullptr; }
+    const DeferredBody &getDeferredBody() const { return *Deferred; }
+    void setBody(std::unique_ptr<ExprAST> B) {
+        Body = std::move(B);
+        Deferred.reset();
+    }
+    void setSlot(FunctionSlot *S) { Slot = S; }
+    bool isResolved() const { return Resolved.load(std::memory_order_acquire); }
+    void setResolved() { Resolved.store(true, std::memory_order_release); }
+    unsigned getDepth() const { return Depth; }
+    void setDepth(unsigned D) { Depth = D; }
+    // 以ArgVals作为实参调用该函数，ArgVals的长度和参数个数一致
+    double call(Interpreter &I, const double *ArgVals);
+
+    // 并行求值的计划，函数表改变之后重新计算，见ParallelPlanner
+    struct ParallelPlan {
+        unsigned Epoch = 0;
+        bool InProgress = false;
+        bool Safe = false;
+        double Cost = 0.0;
+    } Plan;
+};
+
+// =========
+// Parser
+// =========
+
+class Parser {
+    Lexer &Lex;
+    ContextImpl &Ctx;
+
+public:
+    // 提供一个简单的token缓冲区
+    // CurTok表示当前paser正在处理的token，即当前需要paser的token
+    // getNextToken()更新CurTok
+    int CurTok = 0;
+    SourceRange CurRange; // CurTok在源码中的范围
+    int getNextToken();
+
+    // 延迟解析的定义的body在源码中的起始位置
+    SourceLocation BodyLoc;
+    // 不为空时按这个表而不是当前的优先级解析，用于延迟解析的定义
+    const PrecedenceTable *Precedence = nullptr;
+
+    // 出错之后跳过当前项剩下的token，直到下一个顶层项的开始
+    void synchronize();
+
+    Parser(Lexer &Lex, ContextImpl &Ctx) : Lex(Lex), Ctx(Ctx) {}
+
+    std::unique_ptr<FunctionAST> ParseDefination();
+    std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+    std::unique_ptr<PrototypeAST> ParseExtern();
+    // 解析延迟解析的定义保存的body，body之后不能再有其他的token
+    std::unique_ptr<ExprAST> ParseDeferredBody();
+
+private:
+    int GetTokPrecedence();
+
+    // 创建AST节点，同时统计节点的个数和占用的内存
+    template <typename T, typename... ArgTs>
+    std::unique_ptr<T> newNode(Counter Kind, ArgTs &&...Args);
+
+    // 用于处理错误
+    std::unique_ptr<ExprAST> LogError(const char *Str);
+    std::unique_ptr<ExprAST> LogError(const char *Str, SourceRange Range);
+    std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
+    std::unique_ptr<PrototypeAST> LogInvalidOperator(const char *Str);
+
+    // 表达式的解析不使用递归，嵌套的结构都保存在下面的显式栈中
+    // 这样无论输入嵌套得多深都不会耗尽调用栈，超过深度限制时报错
+    struct ExprFrame;
+    struct PendingOp;
+    struct Operand {
+        std::unique_ptr<ExprAST> E;
+        unsigned Depth; // 子树的深度
+    };
+
+    std::vector<ExprFrame> Frames;
+    std::vector<PendingOp> Ops;
+    std::vector<Operand> Operands;
+
+    std::unique_ptr<ExprAST> ParseExpression();
+    bool ParseVarList(ExprFrame &F, bool AtName);
+    // 和ParseExpression()接受同样的token，但是不创建节点，用于延迟解析的定义
+    bool SkipExpression();
+    bool pushOperand(std::unique_ptr<ExprAST> E, unsigned Depth,
+                     SourceLocation Loc);
+    bool reduceBinary();
+    bool completePrimary();
+    std::unique_ptr<ExprAST> BuildCall(const std::string &Callee,
+                                       std::vector<std::unique_ptr<ExprAST>> Args,
+                                       SourceLocation Loc);
+    std::unique_ptr<PrototypeAST> ParsePrototype(bool RecordBody = false);
+};
+
+//=========
+// Context
+//=========
+
+static const unsigned DefaultMaxExprDepth = 10000;
+// 函数被调用多少次之后在后台编译
+static const unsigned DefaultTierThreshold = 100;
+// 分层执行时编译的指令数上限，超过时放弃编译，继续解释执行
+static const size_t MaxTierInsts = 1 << 16;
+
+// 执行后端的公共接口，各个实现见Execution backends
+class ExecutionBackend {
+public:
+    virtual ~ExecutionBackend() = default;
+
+    static std::unique_ptr<ExecutionBackend> create(Backend B, ContextImpl &Ctx);
+
+    // 解释器调用S的当前定义之前调用，由后端执行了这次调用时返回true，结果写入Result
+    // EvalDepth是解释器当前递归的层数
+    virtual bool call(FunctionSlot &S, int EvalDepth, const double *Args, double &Result) = 0;
+    // Function::evaluateBatch()，出错时返回false并记录诊断信息
+    virtual bool evaluateBatch(FunctionAST &F, const double *const *Columns, size_t Rows,
+                               double *Out) = 0;
+    // map使用的程序，返回nullptr时由解释器逐个求值
+    virtual std::shared_ptr<BatchProgram> mapProgram(FunctionAST &F) = 0;
+};
+
+// Context中的所有状态，解析和执行都在这上面进行
+class ContextImpl {
+public:
+    // 函数表，按名字索引，std::map中元素的地址不会改变
+    std::map<std::string, FunctionSlot> Functions;
+    // extern声明的函数原型
+    std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+    // 运算符的优先级，按ascii码直接索引，0表示不是二元运算符
+    // 自定义的二元运算符在解析定义时注册进来，修改都通过setPrecedence()
+    PrecedenceTable BinopPrecedence = {};
+    // BinopPrecedence的只读副本，优先级没有改变时各个延迟解析的定义共享同一个
+    std::shared_ptr<const PrecedenceTable> PrecedenceSnapshot;
+
+    void setPrecedence(unsigned char Op, int Prec) {
+        if (BinopPrecedence[Op] != Prec) {
+            BinopPrecedence[Op] = Prec;
+            PrecedenceSnapshot.reset();
+        }
+    }
+    std::shared_ptr<const PrecedenceTable> snapshotPrecedence() {
+        if (!PrecedenceSnapshot) {
+            PrecedenceSnapshot = std::make_shared<const PrecedenceTable>(BinopPrecedence);
+        }
+        return PrecedenceSnapshot;
+    }
+
+    std::vector<Diagnostic> Diags;
+    Statistics Stats;
+
+    // 表达式树允许的最大深度，0表示不限制
+    // 解释执行、哈希等都是递归地遍历树，限制深度保证它们不会耗尽调用栈
+    unsigned MaxExprDepth = DefaultMaxExprDepth;
+
+    // 调用次数达到TierThreshold的函数在后台编译，0表示只用解释器执行
+    unsigned TierThreshold = DefaultTierThreshold;
+
+    // 为true时定义只解析语法，名字解析推迟到第一次调用或者编译时
+    bool LazyDefinitions = false;
+
+    // 编译结果的磁盘缓存目录，为空时不使用磁盘缓存
+    std::string CacheDir;
+    // 已经编译好的批量求值程序，按哈希索引
+    std::unordered_map<uint64_t, std::shared_ptr<BatchProgram>> BatchPrograms;
+
+    // loadProfile()读入的各函数的调用次数，按函数的结构哈希索引
+    std::unordered_map<uint64_t, uint64_t> Profile;
+
+    // 并行求值的线程池，为空时顺序求值
+    std::unique_ptr<TaskPool> Pool;
+    // 每次加入定义时加一，并行求值的计划据此重新计算
+    unsigned DefinitionEpoch = 1;
+
+    // 当前的执行后端，Kind是它的种类
+    Backend Kind = Backend::Tiered;
+    std::unique_ptr<ExecutionBackend> Exec;
+
+    // 后台编译的线程，第一次有函数需要编译时才启动
+    // 放在最后，析构时最先停下来，之后才释放它可能还在读的函数表
+    std::unique_ptr<TierCompiler> Compiler;
+
+    ContextImpl();
+    ~ContextImpl();
+
+    // 记录一条诊断信息，Range为空表示没有位置信息
+    void error(Diagnostic::Kind K, const char *Str, SourceRange Range = {}) {
+        Stats.add(K == Diagnostic::ParseError      ? cnt_parse_errors
+                  : K == Diagnostic::SemanticError ? cnt_sema_errors
+                                                   : cnt_eval_errors);
+        Diags.push_back({K, Str, Range});
+    }
+
+    // 取得Name对应的函数表项，没有时创建一个空的
+    FunctionSlot &getSlot(const std::string &Name) { return Functions[Name]; }
+
+    // 当前的定义，没有定义时返回nullptr
+    FunctionAST *findDefinition(const std::string &Name) const {
+        auto It = Functions.find(Name);
+        return It == Functions.end() ? nullptr : It->second.Def.get();
+    }
+
+    // 对F做名字解析，出错时返回false，F不能再被执行
+    bool resolve(FunctionAST &F);
+    // 解析延迟解析的定义保存的body，已经解析过时直接返回true
+    bool parseDeferred(FunctionAST &F);
+    // 执行或者编译F之前调用，延迟解析的定义在这里第一次解析语法和名字
+    // 出错时返回false，下次使用时重新解析并再次报告
+    bool resolveDeferred(FunctionAST &F) {
+        if (F.isResolved()) {
+            return true;
+        }
+        if (!parseDeferred(F)) {
+            return false;
+        }
+        Stats.add(cnt_sema_deferred);
+        return resolve(F);
+    }
+
+    // 处理Lex中的所有顶层项
+    bool run(Lexer &Lex, const ItemHandler &OnItem);
+    // 只对Lex中的所有顶层项做语法分析，见Context::parse()
+    bool parse(Lexer &Lex);
+
+    // 以Args为实参调用F，出错时返回false
+    bool call(FunctionAST &F, const double *Args, double &Result);
+
+    // 计算F及其调用的所有函数的哈希
+    // F是某个函数表项的当前定义时，结果保存在表项中，直到相关的定义改变
+    uint64_t hashFunction(FunctionAST &F);
+    uint64_t hashSlot(FunctionSlot &S);
+    // S重新定义之后，让(间接)调用了它的函数的哈希失效
+    void invalidateHash(FunctionSlot &S);
+
+    // 取得F的批量求值程序，依次查找内存、磁盘缓存，都没有时才编译
+    // 编译失败时不报告错误，由调用者交给解释器执行，并且和后台编译一样限制指令数
+    std::shared_ptr<BatchProgram> getBatchProgram(FunctionAST &F);
+    // 批量求值程序在缓存中的键
+    uint64_t batchProgramKey(FunctionAST &F);
+    // 编译F并对Columns批量求值，不能编译时交给interpretBatch()，出错时返回false
+    bool runBatch(FunctionAST &F, const double *const *Columns, size_t Rows, double *Out);
+    // 逐行解释执行，第一个出错的行之后不再继续
+    bool interpretBatch(FunctionAST &F, const double *const *Columns, size_t Rows,
+                        double *Out);
+    void setBackend(Backend B);
+
+    // 在解释器调用S的当前定义之前调用，S已经编译好时直接执行编译结果，返回true
+    // 否则给S计数，达到阈值时交给后台编译，返回false，由解释器执行
+    bool runCompiled(FunctionSlot &S, int EvalDepth, const double *Args, double &Result);
+    void requestCompile(FunctionSlot &S);
+    // S在读入的profile中是热点时在当前线程直接编译，不经过解释执行和后台编译
+    // 是热点时返回true，编译失败时S.Compiled为空，之后也不再尝试
+    bool compileFromProfile(FunctionSlot &S);
+    // 把后台编译完的结果装到对应的函数表项上
+    void installCompiled();
+
+    // 写入和读取各函数的调用次数
+    bool saveProfile(const std::string &Path);
+    bool loadProfile(const std::string &Path);
+
+    // 数据并行的map: 对Start + k*Step (0 <= k < N)求单参数函数F的值
+    // Out不为空时结果依次写入Out，否则按R归约到Result；能编译时按块批量求值，否则用I逐个解释执行
+    // 解释执行出错时返回false，I.Failed和错误信息都和直接调用F时一样
+    bool map(Interpreter &I, FunctionAST &F, double Start, double Step, uint64_t N, Reduction R,
+             double *Out, double &Result);
+    // Function::map()和Function::reduce()的实现，Out不为空时写入Out而不归约
+    bool map(FunctionAST &F, double Start, double End, double Step, Reduction R,
+             std::vector<double> *Out, double &Result);
+
+    // 生成Name对参数Arg的偏导数函数DerivName，以及它用到的被调用函数的偏导数函数
+    bool differentiate(const std::string &Name, const std::string &Arg,
+                       const std::string &DerivName);
+
+    // 把所有的定义和extern写入二进制AST文件，或者从中读取
+    bool saveAST(const std::string &Path);
+    bool loadAST(const std::string &Path);
+
+    void addDefinition(std::shared_ptr<FunctionAST> F);
+
+private:
+    TopLevelItem HandleDefinition(Parser &P);
+    TopLevelItem HandleExtern(Parser &P);
+    TopLevelItem HandleTopLevelExpresison(Parser &P);
+};
+
+// =========
+// Parser
+// =========
+
+int Parser::getNextToken() {
+    PhaseTimer T(Ctx.Stats, phase_lex);
+    Ctx.Stats.add(cnt_tokens);
+    CurTok = Lex.gettok();
+    CurRange = Lex.getTokenRange();
+    return CurTok;
+}
+
+// 出错时只报告一次错误，之后直接跳到def、extern或者';'，不再尝试解析中间的token
+// 交互式输入时，已经读入的源码用完也停下来，当作这一项以';'结束，不为了跳过错误而等待输入
+void Parser::synchronize() {
+    while (CurTok != tok_def && CurTok != tok_extern && CurTok != ';' &&
+           CurTok != tok_eof) {
+        Ctx.Stats.add(cnt_skipped_tokens);
+        if (Lex.atEndOfChunk()) {
+            CurTok = ';';
+            return;
+        }
+        getNextToken();
+    }
+}
+
+template <typename T, typename... ArgTs>
+std::unique_ptr<T> Parser::newNode(Counter Kind, ArgTs &&...Args) {
+    Ctx.Stats.add(Kind);
+    Ctx.Stats.add(cnt_node_bytes, sizeof(T));
+    return std::make_unique<T>(std::forward<ArgTs>(Args)...);
+}
+
+// 获取运算符的优先级
+int Parser::GetTokPrecedence() {
+    if (!isascii(CurTok)) { // 如果当前的token不是ascii码
+        return -1;
+    }
+
+    // 保证token是一个声明了的binop
+    int TokPrec = Precedence ? (*Precedence)[CurTok] : Ctx.BinopPrecedence[CurTok];
+    // 如果不在map中
+    // 对于不是binop的运算符返回-1
+    if (TokPrec <= 0) {
+        return -1;
+    }
+
+    return TokPrec;
+}
+
+// 默认报告在当前的token上
+std::unique_ptr<ExprAST> Parser::LogError(const char *Str) {
+    return LogError(Str, CurRange);
+}
+
+std::unique_ptr<ExprAST> Parser::LogError(const char *Str, SourceRange Range) {
+    Ctx.error(Diagnostic::ParseError, Str, Range);
+    return nullptr;
+}
+
+std::unique_ptr<PrototypeAST> Parser::LogErrorP(const char *Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+// 定义里不能自定义的运算符，报告之后跳过它
+// 否则';'会被synchronize当作这一项的结尾，定义剩下的部分被当成新的一项
+std::unique_ptr<PrototypeAST> Parser::LogInvalidOperator(const char *Str) {
+    LogError(Str);
+    if (CurTok == ';' && !Lex.atEndOfChunk()) {
+        getNextToken();
+    }
+    return nullptr;
+}
+
+// 表达式中一层嵌套的结构，括号、调用的参数列表和var/in各占一层
+struct Parser::ExprFrame {
+    enum FrameKind {
+        Root,    // 最外层的表达式
+        Paren,   // '(' expression ')'
+        Call,    // identifier '(' expression* ')'，正在解析一个参数
+        VarInit, // 'var' identifier '=' expression，正在解析初始值
+        VarBody  // 'in' expression，正在解析body
+    };
+
+    FrameKind Kind;
+    // 这一层在Ops和Operands中的起始位置，之下的属于外层
+    size_t OpBase;
+    size_t OperandBase;
+    SourceLocation Loc; // 被调用的函数名或者var的位置
+
+    std::string Callee;
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    unsigned ChildDepth = 0; // 已经完成的参数或初始值的最大深度
+
+    ExprFrame(FrameKind Kind, size_t OpBase, size_t OperandBase,
+              SourceLocation Loc = {})
+        : Kind(Kind), OpBase(OpBase), OperandBase(OperandBase), Loc(Loc) {}
+};
+
+// 还没有得到全部操作数的运算符
+struct Parser::PendingOp {
+    int Op;
+    int Prec; // 二元运算符的优先级，一元运算符为0
+    SourceLocation Loc;
+};
+
+// 新的节点记录位置后压入操作数栈，深度超过限制时报错
+bool Parser::pushOperand(std::unique_ptr<ExprAST> E, unsigned Depth,
+                         SourceLocation Loc) {
+    if (!E) {
+        return false;
+    }
+    if (Ctx.MaxExprDepth && Depth > Ctx.MaxExprDepth) {
+        LogError("expression is nested too deeply", {Loc, Loc});
+        return false;
+    }
+    E->setLoc(Loc);
+    Operands.push_back({std::move(E), Depth});
+    return true;
+}
+
+// 用栈顶的二元运算符连接最上面的两个操作数
+bool Parser::reduceBinary() {
+    int Op = Ops.back().Op;
+    SourceLocation Loc = Ops.back().Loc;
+    Ops.pop_back();
+    Operand RHS = std::move(Operands.back());
+    Operands.pop_back();
+    Operand LHS = std::move(Operands.back());
+    Operands.pop_back();
+    return pushOperand(newNode<BinaryExprAST>(cnt_node_binary, Op,
+                                              std::move(LHS.E), std::move(RHS.E)),
+                       std::max(LHS.Depth, RHS.Depth) + 1, Loc);
+}
+
+// 一个primary刚刚完成，紧挨着它的一元运算符都作用在它上面
+// unary ::= primary | '!' unary
+bool Parser::completePrimary() {
+    while (Ops.size() > Frames.back().OpBase && Ops.back().Prec == 0) {
+        int Opc = Ops.back().Op;
+        SourceLocation Loc = Ops.back().Loc;
+        Ops.pop_back();
+        Operand O = std::move(Operands.back());
+        Operands.pop_back();
+        if (!pushOperand(newNode<UnaryExprAST>(cnt_node_unary, Opc, std::move(O.E)),
+                         O.Depth + 1, Loc)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 参数已经解析完的调用，内置函数的参数都是常量时直接算出结果
+std::unique_ptr<ExprAST>
+Parser::BuildCall(const std::string &Callee,
+                  std::vector<std::unique_ptr<ExprAST>> Args, SourceLocation Loc) {
+    if (const MapBuiltinInfo *M = LookupMapBuiltin(Callee)) {
+        SourceLocation End{Loc.Line, Loc.Col + (unsigned)Callee.size()};
+        if (Args.size() != 4) {
+            return LogError("Incorrect # arguments passed to map", {Loc, End});
+        }
+        // 函数名在解析时是一个变量，这里只取出名字
+        auto *Fn = dynamic_cast<VariableExprAST *>(Args[0].get());
+        if (!Fn) {
+            SourceLocation ArgLoc = Args[0]->getLoc();
+            return LogError("Expected function name as first argument to map",
+                            {ArgLoc, ArgLoc});
+        }
+        return newNode<MapExprAST>(cnt_node_map, M, Fn->getName(), std::move(Args[1]),
+                                   std::move(Args[2]), std::move(Args[3]));
+    }
+
+    const IntrinsicInfo *Intr = LookupIntrinsic(Callee);
+    if (!Intr) {
+        return newNode<CallExprAST>(cnt_node_call, Callee, std::move(Args));
+    }
+
+    if (Args.size() != Intr->NumArgs) {
+        SourceLocation End{Loc.Line, Loc.Col + (unsigned)Callee.size()};
+        return LogError("Incorrect # arguments passed to intrinsic", {Loc, End});
+    }
+
+    // 参数都是常量时直接在编译期算出结果
+    double ArgVals[2];
+    bool AllConstant = true;
+    for (size_t I = 0; I != Args.size(); ++I) {
+        auto *Num = dynamic_cast<NumberExprAST *>(Args[I].get());
+        if (!Num) {
+            AllConstant = false;
+            break;
+        }
+        ArgVals[I] = Num->getVal();
+    }
+
+    if (AllConstant) {
+        return newNode<NumberExprAST>(cnt_node_number,
+                                      EvalIntrinsic(Intr->ID, ArgVals));
+    }
+
+    return newNode<CallExprAST>(cnt_node_call, Callee, std::move(Args), Intr);
+}
+
+// varexpr ::= 'var' identifier ('=' expression)?
+//              (',' identifier ('=' expression)?)* 'in' expression
+// AtName为true时当前token是变量名，否则刚处理完一个变量
+// 接下来需要解析初始值或者body时返回true，F.Kind表明是哪一种
+bool Parser::ParseVarList(ExprFrame &F, bool AtName) {
+    while (true) {
+        if (AtName) {
+            F.VarNames.push_back(std::make_pair(Lex.IdentifierStr, nullptr));
+            getNextToken(); // 吞掉identifier
+
+            // 初始值是可选的
+            if (CurTok == '=') {
+                getNextToken(); // 吞掉'='
+                F.Kind = ExprFrame::VarInit;
+                return true;
+            }
+        }
+
+        // 变量列表结束
+        if (CurTok != ',') {
+            break;
+        }
+        getNextToken(); // 吞掉','
+
+        if (CurTok != tok_identifier) {
+            LogError("expected identifier list after var");
+            return false;
+        }
+        AtName = true;
+    }
+
+    if (CurTok != tok_in) {
+        LogError("expected 'in' keyword after 'var'");
+        return false;
+    }
+    getNextToken(); // 吞掉in
+    F.Kind = ExprFrame::VarBody;
+    return true;
+}
+
+// expression ::= unary binoprhs
+// binoprhs   ::= (binop unary)*
+// unary      ::= primary | '!' unary
+// primary    ::= identifier | identifier '(' expression* ')'
+//              | number | '(' expression ')' | varexpr
+//
+// 用运算符栈代替递归的优先级爬升，结果和递归的版本完全一样:
+// 所有二元运算符都是左结合的，一元运算符只作用在紧跟着的unary上
+// 括号、参数列表和var/in都压入Frames，处理完之后作为一个primary交给外层
+// 栈都在堆上，输入嵌套多深都可以，只有生成的树超过深度限制时才报错
+std::unique_ptr<ExprAST> Parser::ParseExpression() {
+    Frames.clear();
+    Ops.clear();
+    Operands.clear();
+    Frames.emplace_back(ExprFrame::Root, 0, 0);
+
+    // 出错时丢掉栈中剩下的内容
+    auto Fail = [&]() -> std::unique_ptr<ExprAST> {
+        Frames.clear();
+        Ops.clear();
+        Operands.clear();
+        return nullptr;
+    };
+
+    bool ExpectOperand = true;
+    while (true) {
+        if (ExpectOperand) {
+            // 当前token不是运算符，那么一定是primary
+            if (isascii(CurTok) && CurTok != '(' && CurTok != ',') {
+                // 一元运算符
+                Ops.push_back({CurTok, 0, CurRange.Begin});
+                getNextToken();
+                continue;
+            }
+
+            switch (CurTok) {
+            default:
+                LogError("unknown token when expecting an expression");
+                return Fail();
+            case tok_number:
+                if (!pushOperand(newNode<NumberExprAST>(cnt_node_number, Lex.NumVal),
+                                 1, CurRange.Begin)) {
+                    return Fail();
+                }
+                getNextToken(); // 吞掉当前number
+                break;
+            case tok_identifier: {
+                std::string IdName = Lex.IdentifierStr;
+                SourceLocation IdLoc = CurRange.Begin;
+                getNextToken(); // 吞掉identifier
+
+                // 简单的变量引用
+                if (CurTok != '(') {
+                    if (!pushOperand(newNode<VariableExprAST>(cnt_node_variable,
+                                                              IdName),
+                                     1, IdLoc)) {
+                        return Fail();
+                    }
+                    break;
+                }
+
+                getNextToken(); // 吞掉'('
+                // 排除()中没有表达式的情况
+                if (CurTok == ')') {
+                    getNextToken(); // 吞掉')'
+                    if (!pushOperand(BuildCall(IdName, {}, IdLoc), 1, IdLoc)) {
+                        return Fail();
+                    }
+                    break;
+                }
+                Frames.emplace_back(ExprFrame::Call, Ops.size(), Operands.size(),
+                                    IdLoc);
+                Frames.back().Callee = std::move(IdName);
+                continue;
+            }
+            case '(':
+                getNextToken(); // 吞掉'('
+                Frames.emplace_back(ExprFrame::Paren, Ops.size(), Operands.size());
+                continue;
+            case tok_var: {
+                SourceLocation VarLoc = CurRange.Begin;
+                getNextToken(); // 吞掉var
+
+                // 至少要有一个变量
+                if (CurTok != tok_identifier) {
+                    LogError("expected identifier after var");
+                    return Fail();
+                }
+                Frames.emplace_back(ExprFrame::VarInit, Ops.size(), Operands.size(),
+                                    VarLoc);
+                if (!ParseVarList(Frames.back(), true)) {
+                    return Fail();
+                }
+                continue;
+            }
+            }
+
+            if (!completePrimary()) {
+                return Fail();
+            }
+            ExpectOperand = false;
+            continue;
+        }
+
+        ExprFrame &F = Frames.back();
+        int TokPrec = GetTokPrecedence();
+        if (TokPrec > 0) {
+            // 优先级不低于当前运算符的都可以先连接起来，相同优先级的是左结合
+            while (Ops.size() > F.OpBase && Ops.back().Prec >= TokPrec) {
+                if (!reduceBinary()) {
+                    return Fail();
+                }
+            }
+
+            // 存储运算符
+            int BinOp = CurTok;
+            SourceRange OpRange = CurRange;
+            getNextToken();
+
+            // 赋值的左边必须是一个变量
+            if (BinOp == '=' &&
+                !dynamic_cast<VariableExprAST *>(Operands.back().E.get())) {
+                LogError("destination of '=' must be a variable", OpRange);
+                return Fail();
+            }
+
+            Ops.push_back({BinOp, TokPrec, OpRange.Begin});
+            ExpectOperand = true;
+            continue;
+        }
+
+        // 当前token不是二元运算符，这一层的表达式结束
+        while (Ops.size() > F.OpBase) {
+            if (!reduceBinary()) {
+                return Fail();
+            }
+        }
+
+        Operand Result = std::move(Operands.back());
+        Operands.pop_back();
+
+        switch (F.Kind) {
+        case ExprFrame::Root:
+            Frames.clear();
+            return std::move(Result.E);
+        case ExprFrame::Paren:
+            if (CurTok != ')') {
+                LogError("expected ')'");
+                return Fail();
+            }
+            getNextToken(); // 吞掉')'
+            Frames.pop_back();
+            // 括号不产生节点
+            Operands.push_back(std::move(Result));
+            break;
+        case ExprFrame::Call: {
+            F.ChildDepth = std::max(F.ChildDepth, Result.Depth);
+            F.Args.push_back(std::move(Result.E));
+
+            if (CurTok == ',') {
+                getNextToken();
+                ExpectOperand = true;
+                continue;
+            }
+            if (CurTok != ')') {
+                LogError("Expected ')' or ',' in argument list");
+                return Fail();
+            }
+            getNextToken(); // 吞掉')'
+
+            std::string Callee = std::move(F.Callee);
+            auto Args = std::move(F.Args);
+            unsigned Depth = F.ChildDepth + 1;
+            SourceLocation Loc = F.Loc;
+            Frames.pop_back();
+            if (!pushOperand(BuildCall(Callee, std::move(Args), Loc), Depth, Loc)) {
+                return Fail();
+            }
+            break;
+        }
+        case ExprFrame::VarInit:
+            F.ChildDepth = std::max(F.ChildDepth, Result.Depth);
+            F.VarNames.back().second = std::move(Result.E);
+            if (!ParseVarList(F, false)) {
+                return Fail();
+            }
+            ExpectOperand = true;
+            continue;
+        case ExprFrame::VarBody: {
+            auto VarNames = std::move(F.VarNames);
+            unsigned Depth = std::max(F.ChildDepth, Result.Depth) + 1;
+            SourceLocation Loc = F.Loc;
+            Frames.pop_back();
+            if (!pushOperand(newNode<VarExprAST>(cnt_node_var, std::move(VarNames),
+                                                 std::move(Result.E)),
+                             Depth, Loc)) {
+                return Fail();
+            }
+            break;
+        }
+        }
+
+        // 嵌套的结构作为一个primary交给外层
+        if (!completePrimary()) {
+            return Fail();
+        }
+    }
+}
+
+// 按ParseExpression()的规则跳过一个表达式，只记录嵌套的种类
+// 报告的语法错误和ParseExpression()相同，不过'='的左边和深度限制要到真正解析时才检查
+bool Parser::SkipExpression() {
+    std::vector<ExprFrame::FrameKind> Kinds{ExprFrame::Root};
+
+    // 和ParseVarList()一样，接下来需要跳过初始值或者body时返回true
+    auto SkipVarList = [&](bool AtName) {
+        while (true) {
+            if (AtName) {
+                getNextToken(); // 吞掉identifier
+                if (CurTok == '=') {
+                    getNextToken(); // 吞掉'='
+                    Kinds.back() = ExprFrame::VarInit;
+                    return true;
+                }
+            }
+
+            if (CurTok != ',') {
+                break;
+            }
+            getNextToken(); // 吞掉','
+
+            if (CurTok != tok_identifier) {
+                LogError("expected identifier list after var");
+                return false;
+            }
+            AtName = true;
+        }
+
+        if (CurTok != tok_in) {
+            LogError("expected 'in' keyword after 'var'");
+            return false;
+        }
+        getNextToken(); // 吞掉in
+        Kinds.back() = ExprFrame::VarBody;
+        return true;
+    };
+
+    bool ExpectOperand = true;
+    while (true) {
+        if (ExpectOperand) {
+            if (isascii(CurTok) && CurTok != '(' && CurTok != ',') {
+                getNextToken(); // 吞掉一元运算符
+                continue;
+            }
+
+            switch (CurTok) {
+            default:
+                LogError("unknown token when expecting an expression");
+                return false;
+            case tok_number:
+                getNextToken();
+                break;
+            case tok_identifier:
+                getNextToken();
+                if (CurTok != '(') {
+                    break;
+                }
+                getNextToken(); // 吞掉'('
+                if (CurTok == ')') {
+                    getNextToken();
+                    break;
+                }
+                Kinds.push_back(ExprFrame::Call);
+                continue;
+            case '(':
+                getNextToken();
+                Kinds.push_back(ExprFrame::Paren);
+                continue;
+            case tok_var:
+                getNextToken(); // 吞掉var
+                if (CurTok != tok_identifier) {
+                    LogError("expected identifier after var");
+                    return false;
+                }
+                Kinds.push_back(ExprFrame::VarInit);
+                if (!SkipVarList(true)) {
+                    return false;
+                }
+                continue;
+            }
+
+            ExpectOperand = false;
+            continue;
+        }
+
+        if (GetTokPrecedence() > 0) {
+            getNextToken(); // 吞掉二元运算符
+            ExpectOperand = true;
+            continue;
+        }
+
+        // 当前token不是二元运算符，这一层的表达式结束
+        switch (Kinds.back()) {
+        case ExprFrame::Root:
+            return true;
+        case ExprFrame::Paren:
+            if (CurTok != ')') {
+                LogError("expected ')'");
+                return false;
+            }
+            getNextToken();
+            Kinds.pop_back();
+            break;
+        case ExprFrame::Call:
+            if (CurTok == ',') {
+                getNextToken();
+                ExpectOperand = true;
+                continue;
+            }
+            if (CurTok != ')') {
+                LogError("Expected ')' or ',' in argument list");
+                return false;
+            }
+            getNextToken();
+            Kinds.pop_back();
+            break;
+        case ExprFrame::VarInit:
+            if (!SkipVarList(false)) {
+                return false;
+            }
+            ExpectOperand = true;
+            continue;
+        case ExprFrame::VarBody:
+            Kinds.pop_back();
+            break;
+        }
+    }
+}
+
+// C能否作为Kind(1 = unary, 2 = binary)种运算符自定义
+// 分号、逗号和括号是表达式的结构，内置的二元运算符也不能重新定义，否则会改变已有代码的含义
+static bool IsOperatorChar(unsigned Kind, int C) {
+    if (!isascii(C) || C == ';' || C == ',' || C == '(') {
+        return false;
+    }
+    if (Kind == 2) {
+        return !strchr(")=+-*<", C);
+    }
+    return true;
+}
+
+// prototype
+// ParseDefination调用
+// ::= id '(' id* ')'
+// ::= binary LETTER number? (id, id)
+// ::= unary LETTER (id)
+// RecordBody为true时从')'之后开始记录源码，由调用者结束记录
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype(bool RecordBody) {
+    std::string FnName;
+
+    unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary
+    unsigned BinaryPrecedence = 30;
+
+    switch (CurTok) {
+    default:
+        return LogErrorP("Expected function name in prototype");
+    case tok_identifier:
+        FnName = Lex.IdentifierStr;
+        Kind = 0;
+        getNextToken(); // 吞掉identifier
+        break;
+    case tok_unary:
+        getNextToken(); // 吞掉unary
+        if (!isascii(CurTok)) {
+            return LogErrorP("Expected unary operator");
+        }
+        if (!IsOperatorChar(1, CurTok)) {
+            return LogInvalidOperator("Invalid unary operator");
+        }
+        FnName = "unary";
+        FnName += (char)CurTok;
+        Kind = 1;
+        getNextToken(); // 吞掉运算符
+        break;
+    case tok_binary:
+        getNextToken(); // 吞掉binary
+        if (!isascii(CurTok)) {
+            return LogErrorP("Expected binary operator");
+        }
+        if (!IsOperatorChar(2, CurTok)) {
+            return LogInvalidOperator("Invalid binary operator");
+        }
+        FnName = "binary";
+        FnName += (char)CurTok;
+        Kind = 2;
+        getNextToken(); // 吞掉运算符
+
+        // 可选的优先级
+        if (CurTok == tok_number) {
+            if (Lex.NumVal < 1 || Lex.NumVal > 100) {
+                return LogErrorP("Invalid precedence: must be 1..100");
+            }
+            BinaryPrecedence = (unsigned)Lex.NumVal;
+            getNextToken();
+        }
+        break;
+    }
+
+    if (CurTok != '(') {
+        return LogErrorP("Expected '(' in prototype");
+    }
+
+    std::vector<std::string> ArgNames;
+    while (getNextToken() == tok_identifier) {
+        ArgNames.push_back(Lex.IdentifierStr);
+    }
+
+    if (CurTok != ')') {
+        return LogErrorP("Expected ')' in prototype");
+    }
+
+    if (RecordBody) {
+        BodyLoc = Lex.startRecording();
+    }
+    getNextToken(); // 吞掉')'
+
+    // 运算符的参数个数必须和运算符的种类一致
+    if (Kind && ArgNames.size() != Kind) {
+        if (RecordBody) {
+            Lex.stopRecording();
+        }
+        return LogErrorP("Invalid number of operands for operator");
+    }
+
+    return newNode<PrototypeAST>(cnt_node_prototype, FnName, std::move(ArgNames),
+                                 Kind != 0, BinaryPrecedence);
+}
+
+// defination ::= 'def' prototype expression
+std::unique_ptr<FunctionAST> Parser::ParseDefination() {
+    getNextToken(); // 吞掉def
+    SourceRange NameRange = CurRange;
+    bool Lazy = Ctx.LazyDefinitions;
+    auto Proto = ParsePrototype(Lazy);
+    if (!Proto) {
+        return nullptr;
+    }
+
+    // 内置函数在解析调用时就已经确定了，不能被重新定义
+    if (LookupIntrinsic(Proto->getName()) || LookupMapBuiltin(Proto->getName())) {
+        if (Lazy) {
+            Lex.stopRecording();
+        }
+        LogError("Cannot redefine intrinsic function", NameRange);
+        return nullptr;
+    }
+
+    // 延迟解析时只找到body的结束位置，保存它的源码
+    if (Lazy) {
+        bool OK = SkipExpression();
+        auto Body = std::make_unique<DeferredBody>();
+        Body->Source = Lex.stopRecording();
+        Body->Loc = BodyLoc;
+        if (!OK) {
+            return nullptr;
+        }
+        // 和直接解析时一样，自己的优先级在body之后才注册
+        Body->Precedence = Ctx.snapshotPrecedence();
+        if (Proto->isBinaryOp()) {
+            Ctx.setPrecedence(Proto->getOperatorName(), Proto->getBinaryPrecedence());
+        }
+        return newNode<FunctionAST>(cnt_node_function, std::move(Proto), std::move(Body));
+    }
+
+    if (auto E = ParseExpression()) {
+        // 解析完定义就注册二元运算符的优先级，后续的代码可以直接使用
+        if (Proto->isBinaryOp()) {
+            Ctx.setPrecedence(Proto->getOperatorName(), Proto->getBinaryPrecedence());
+        }
+        return newNode<FunctionAST>(cnt_node_function, std::move(Proto), std::move(E));
+    }
+
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> Parser::ParseDeferredBody() {
+    auto E = ParseExpression();
+    if (E && CurTok != tok_eof) {
+        return LogError("Unexpected token after definition body");
+    }
+    return E;
+}
+
+// toplevelexpr ::= expression
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+    if (auto E = ParseExpression()) {
+        // 匿名的proto
+        auto Proto = newNode<PrototypeAST>(cnt_node_prototype, "__anon_expr",
+                                           std::vector<std::string>());
+        return newNode<FunctionAST>(cnt_node_function, std::move(Proto), std::move(E));
+    }
+    return nullptr;
+}
+
+// external ::= 'extern' prototype
+std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
+    getNextToken(); // 吞掉extern
+    SourceRange NameRange = CurRange;
+    auto Proto = ParsePrototype();
+    if (!Proto) {
+        return nullptr;
+    }
+
+    // 兼容对内置函数的extern声明，但参数个数必须一致
+    const IntrinsicInfo *Intr = LookupIntrinsic(Proto->getName());
+    if (Intr && Proto->getArgs().size() != Intr->NumArgs) {
+        LogError("Incorrect # arguments in extern of intrinsic", NameRange);
+        return nullptr;
+    }
+    // map不是普通的函数，没有对应的原型
+    if (LookupMapBuiltin(Proto->getName())) {
+        LogError("Cannot redefine intrinsic function", NameRange);
+        return nullptr;
+    }
+
+    return Proto;
+}
+
+//=========
+// Semantic analysis
+//=========
+
+// 名字解析，在执行之前把变量绑定到栈槽，把调用绑定到函数表项
+// 名字和参数个数的错误都在这里报告，解释器和批量求值不需要再按名字查找
+// 用显式的工作栈遍历，和解析一样不受树的深度影响
+class Resolver {
+    // 工作栈中的一项: 访问一个节点，声明一个变量，或者退出var的作用域
+    // Depth是要访问的节点在树中的深度
+    struct Item {
+        enum ItemKind { Visit, Declare, Pop } K;
+        ExprAST *E;
+        const std::string *Name;
+        size_t ScopeSize;
+        unsigned Depth;
+    };
+    std::vector<Item> Work;
+    // 正在访问的节点的深度
+    unsigned CurDepth = 0;
+
+public:
+    ContextImpl &Ctx;
+    // 当前可见的变量，下标就是它在栈帧中的槽位
+    // 查找时从后往前，内层的同名变量自然会遮蔽外层的
+    std::vector<const std::string *> Scope;
+    bool Failed = false;
+    // 函数体的深度
+    unsigned MaxDepth = 0;
+
+    explicit Resolver(ContextImpl &Ctx) : Ctx(Ctx) {}
+
+    // 报告在从Loc开始长度为Len的名字上
+    void LogError(const char *Str, SourceLocation Loc, size_t Len) {
+        SourceLocation End{Loc.Line, Loc.Col + (unsigned)Len};
+        Ctx.error(Diagnostic::SemanticError, Str, {Loc, Loc.Line ? End : Loc});
+        Failed = true;
+    }
+
+    // 查找变量的槽位，找不到时返回-1
+    int lookup(const std::string &Name) const {
+        for (size_t I = Scope.size(); I > 0; --I) {
+            if (*Scope[I - 1] == Name) {
+                return I - 1;
+            }
+        }
+        return -1;
+    }
+
+    // 工作栈是后进先出的，节点按相反的顺序压入这些操作
+    void visit(ExprAST *E) { Work.push_back({Item::Visit, E, nullptr, 0, CurDepth + 1}); }
+    void declare(const std::string &Name) {
+        Work.push_back({Item::Declare, nullptr, &Name, 0, 0});
+    }
+    void popScope(size_t Size) { Work.push_back({Item::Pop, nullptr, nullptr, Size, 0}); }
+
+    void run(FunctionAST &F) {
+        for (const std::string &Arg : F.getProto().getArgs()) {
+            Scope.push_back(&Arg);
+        }
+
+        visit(&F.getBody());
+        while (!Work.empty()) {
+            Item I = Work.back();
+            Work.pop_back();
+            switch (I.K) {
+            case Item::Visit:
+                CurDepth = I.Depth;
+                MaxDepth = std::max(MaxDepth, CurDepth);
+                I.E->resolve(*this);
+                break;
+            case Item::Declare:
+                Scope.push_back(I.Name);
+                break;
+            case Item::Pop:
+                Scope.resize(I.ScopeSize);
+                break;
+            }
+        }
+    }
+};
+
+void NumberExprAST::resolve(Resolver &) {}
+
+void VariableExprAST::resolve(Resolver &R) {
+    int S = R.lookup(Name);
+    if (S < 0) {
+        R.LogError("Unknown variable name", Loc, Name.size());
+        return;
+    }
+    Slot = S;
+}
+
+void UnaryExprAST::resolve(Resolver &R) {
+    R.visit(Operand.get());
+
+    // 运算符可以之后再定义，执行时再检查
+    std::string Name = "unary";
+    Name += Opcode;
+    Target = &R.Ctx.getSlot(Name);
+}
+
+void BinaryExprAST::resolve(Resolver &R) {
+    // 赋值的LHS也是VariableExprAST，和普通的变量一样解析
+    R.visit(RHS.get());
+    R.visit(LHS.get());
+
+    if (Op != '=' && Op != '+' && Op != '-' && Op != '*' && Op != '<') {
+        std::string Name = "binary";
+        Name += Op;
+        Target = &R.Ctx.getSlot(Name);
+    }
+}
+
+void CallExprAST::resolve(Resolver &R) {
+    for (size_t I = Args.size(); I > 0; --I) {
+        R.visit(Args[I - 1].get());
+    }
+
+    if (Intrinsic) {
+        return;
+    }
+
+    // 被调用的函数可以之后再定义，这里只绑定函数表项
+    Target = &R.Ctx.getSlot(Callee);
+
+    // 已经知道原型时检查参数个数，之后才定义的函数在调用时检查
+    const PrototypeAST *Proto = Target->Def ? &Target->Def->getProto() : nullptr;
+    if (!Proto) {
+        auto It = R.Ctx.FunctionProtos.find(Callee);
+        if (It != R.Ctx.FunctionProtos.end()) {
+            Proto = It->second.get();
+        }
+    }
+    if (Proto && Proto->getArgs().size() != Args.size()) {
+        R.LogError("Incorrect # arguments passed", Loc, Callee.size());
+    }
+}
+
+void MapExprAST::resolve(Resolver &R) {
+    for (size_t I = 3; I > 0; --I) {
+        R.visit(Range[I - 1].get());
+    }
+
+    // 和调用一样只绑定函数表项，被map的函数可以之后再定义
+    Target = &R.Ctx.getSlot(Callee);
+    const PrototypeAST *Proto = Target->Def ? &Target->Def->getProto() : nullptr;
+    if (!Proto) {
+        auto It = R.Ctx.FunctionProtos.find(Callee);
+        if (It != R.Ctx.FunctionProtos.end()) {
+            Proto = It->second.get();
+        }
+    }
+    if (Proto && Proto->getArgs().size() != 1) {
+        R.LogError("Map function must take one argument", Loc, strlen(Builtin->Name));
+    }
+}
+
+void VarExprAST::resolve(Resolver &R) {
+    // 依次解析初始值、声明变量，最后是Body，然后退出作用域
+    // 先解析初始值再声明，这样'var a = a in'中右边的a指的是外层的a
+    R.popScope(R.Scope.size());
+    R.visit(Body.get());
+    for (size_t I = VarNames.size(); I > 0; --I) {
+        R.declare(VarNames[I - 1].first);
+        if (VarNames[I - 1].second) {
+            R.visit(VarNames[I - 1].second.get());
+        }
+    }
+}
+
+bool ContextImpl::resolve(FunctionAST &F) {
+    PhaseTimer T(Stats, phase_sema);
+    Resolver R(*this);
+    R.run(F);
+    if (R.Failed) {
+        return false;
+    }
+    F.setDepth(R.MaxDepth + 1);
+    F.setResolved();
+    return true;
+}
+
+//=========
+// Interpreter
+//=========
+
+// 没有条件分支，递归调用永远不会结束，需要限制深度，避免爆栈
+// 解释器对每一层表达式递归一次，所以按递归的总层数限制: 每次调用加上被调用函数的getDepth()
+// 只限制调用的次数不够，函数体较深时不到次数的上限栈就已经耗尽了
+// 这个上限下单个函数体可以达到默认的表达式深度限制，-O0构建在默认8MB的栈中也还有余量
+static const int MaxEvalDepth = 20000;
+
+class Interpreter {
+public:
+    ContextImpl &Ctx;
+
+    // 解释器的栈：函数参数和var声明的局部变量各占一个栈槽
+    // 变量在名字解析时已经确定了槽位，访问时直接用FrameBase加上槽位
+    std::vector<double> Stack;
+    // 当前函数栈帧的起始位置
+    size_t FrameBase = 0;
+    // 当前递归的层数，见MaxEvalDepth
+    int EvalDepth = 0;
+
+    // 执行过程中是否出错，出错后的值没有意义
+    bool Failed = false;
+
+    // 并行求值的任务在其他线程中执行，不参与分层执行和profile计数
+    // 调用次数先记在Calls中，由等待它的线程加到统计中
+    bool Worker = false;
+    uint64_t Calls = 0;
+    // 不为空时错误先记录在这里，并行求值之后按顺序求值时的顺序报告
+    std::vector<Diagnostic> *Errors = nullptr;
+
+    explicit Interpreter(ContextImpl &Ctx) : Ctx(Ctx) {}
+
+    void report(const Diagnostic &D) {
+        if (Errors) {
+            Errors->push_back(D);
+        } else {
+            Ctx.error(D.K, D.Message.c_str(), D.Range);
+        }
+    }
+
+    double LogErrorV(const char *Str, SourceLocation Loc = {}) {
+        report({Diagnostic::EvalError, Str, {Loc, Loc}});
+        Failed = true;
+        return 0.0;
+    }
+
+    // 对N个操作数求值，结果写入Vals，SpawnMask中的交给线程池，其余的在当前线程按顺序求值
+    // StopOnError为true时和顺序求值的调用参数一样，第一个出错的操作数之后的错误不报告
+    void evalOperands(ExprAST *const *Ops, size_t N, uint64_t SpawnMask, double *Vals,
+                      bool StopOnError);
+
+    double &slot(unsigned Slot) { return Stack[FrameBase + Slot]; }
+};
+
+double NumberExprAST::eval(Interpreter &) { return Val; }
+
+double VariableExprAST::eval(Interpreter &I) { return I.slot(Slot); }
+
+double UnaryExprAST::eval(Interpreter &I) {
+    double OperandV = Operand->eval(I);
+
+    FunctionAST *F = Target->Def.get();
+    if (!F) {
+        return I.LogErrorV("Unknown unary operator", Loc);
+    }
+    // 定义可能来自别处(比如加载的AST)，参数个数不对时不能越界读OperandV
+    if (F->getProto().getArgs().size() != 1) {
+        return I.LogErrorV("Incorrect # arguments passed", Loc);
+    }
+    return F->call(I, &OperandV);
+}
+
+double BinaryExprAST::eval(Interpreter &I) {
+    // 赋值比较特殊，不需要对LHS求值
+    if (Op == '=') {
+        // 解析时已经保证了LHS是变量
+        auto *LHSE = static_cast<VariableExprAST *>(LHS.get());
+        double Val = RHS->eval(I);
+
+        // 求值RHS可能会让栈扩容，因此要在求值之后再取栈槽
+        I.slot(LHSE->getSlot()) = Val;
+        return Val;
+    }
+
+    double L, R;
+    if (SpawnLHS && I.Ctx.Pool) {
+        ExprAST *Ops[2] = {LHS.get(), RHS.get()};
+        double Vals[2];
+        I.evalOperands(Ops, 2, 1, Vals, false);
+        L = Vals[0];
+        R = Vals[1];
+    } else {
+        L = LHS->eval(I);
+        R = RHS->eval(I);
+    }
+
+    switch (Op) {
+    case '+':
+        return L + R;
+    case '-':
+        return L - R;
+    case '*':
+        return L * R;
+    case '<':
+        // 比较的结果用0.0或1.0表示
+        return L < R ? 1.0 : 0.0;
+    default:
+        break;
+    }
+
+    // 不是内置的运算符，那么一定是自定义的
+    FunctionAST *F = Target->Def.get();
+    if (!F) {
+        return I.LogErrorV("invalid binary operator", Loc);
+    }
+    if (F->getProto().getArgs().size() != 2) {
+        return I.LogErrorV("Incorrect # arguments passed", Loc);
+    }
+    double Ops[2] = {L, R};
+    return F->call(I, Ops);
+}
+
+double CallExprAST::eval(Interpreter &I) {
+    if (Intrinsic) {
+        // 内置函数最多两个参数
+        double ArgVals[2];
+        if (SpawnMask && I.Ctx.Pool) {
+            ExprAST *Ops[2] = {Args[0].get(), Args.size() > 1 ? Args[1].get() : nullptr};
+            I.evalOperands(Ops, Args.size(), SpawnMask, ArgVals, false);
+            return EvalIntrinsic(Intrinsic->ID, ArgVals);
+        }
+        for (size_t Idx = 0; Idx != Args.size(); ++Idx) {
+            ArgVals[Idx] = Args[Idx]->eval(I);
+        }
+        return EvalIntrinsic(Intrinsic->ID, ArgVals);
+    }
+
+    // 函数表项中是当前的定义，解析之后才定义或者重新定义的函数也能调用到
+    FunctionAST *F = Target->Def.get();
+    if (!F) {
+        if (I.Ctx.FunctionProtos.count(Callee)) {
+            return I.LogErrorV("Cannot call extern function in the interpreter", Loc);
+        }
+        return I.LogErrorV("Unknown function referenced", Loc);
+    }
+
+    if (F->getProto().getArgs().size() != Args.size()) {
+        return I.LogErrorV("Incorrect # arguments passed", Loc);
+    }
+
+    std::vector<double> ArgVals;
+    if (SpawnMask && I.Ctx.Pool) {
+        std::vector<ExprAST *> Ops;
+        for (auto &Arg : Args) {
+            Ops.push_back(Arg.get());
+        }
+        ArgVals.resize(Args.size());
+        I.evalOperands(Ops.data(), Ops.size(), SpawnMask, ArgVals.data(), true);
+        if (I.Failed) {
+            return 0.0;
+        }
+        return F->call(I, ArgVals.data());
+    }
+    for (auto &Arg : Args) {
+        ArgVals.push_back(Arg->eval(I));
+        if (I.Failed) {
+            return 0.0;
+        }
+    }
+
+    return F->call(I, ArgVals.data());
+}
+
+double VarExprAST::eval(Interpreter &I) {
+    size_t OldSize = I.Stack.size();
+
+    for (auto &Var : VarNames) {
+        // 先求初始值再入栈，这样'var a = a in'中右边的a指的是外层的a
+        double InitVal = Var.second ? Var.second->eval(I) : 0.0;
+        I.Stack.push_back(InitVal);
+    }
+
+    double Ret = Body->eval(I);
+
+    // 弹出本次声明的变量
+    I.Stack.resize(OldSize);
+    return Ret;
+}
+
+double FunctionAST::call(Interpreter &I, const double *ArgVals) {
+    if (!I.Ctx.resolveDeferred(*this)) {
+        I.Failed = true;
+        return 0.0;
+    }
+
+    // 只有函数表中当前的定义参与计数和分层执行，句柄持有的旧定义一直解释执行
+    if (!I.Worker && Slot && Slot->Def.get() == this) {
+        ++Slot->ProfileCalls;
+        double Result;
+        if (I.Ctx.Exec->call(*Slot, I.EvalDepth, ArgVals, Result)) {
+            return Result;
+        }
+    }
+
+    if (I.EvalDepth + (int)Depth > MaxEvalDepth) {
+        return I.LogErrorV("Maximum call depth exceeded");
+    }
+
+    // 为参数分配新的栈帧
+    size_t SavedBase = I.FrameBase;
+    I.FrameBase = I.Stack.size();
+    I.Stack.insert(I.Stack.end(), ArgVals, ArgVals + Proto->getArgs().size());
+
+    if (I.Worker) {
+        ++I.Calls;
+    } else {
+        I.Ctx.Stats.add(cnt_calls);
+    }
+    I.EvalDepth += Depth;
+    double Ret = Body->eval(I);
+    I.EvalDepth -= Depth;
+
+    I.Stack.resize(I.FrameBase);
+    I.FrameBase = SavedBase;
+    return Ret;
+}
+
+//=========
+// Parallel evaluation
+//=========
+
+// 调用的各个参数、二元运算的两个操作数之间没有依赖，都很慢时可以同时求值
+// 打开并行求值之后，每次执行前先估计各子表达式的开销(解释执行的节点数，调用计入被调用函数的开销)，
+// 标出值得并行的调用和运算；执行到这些地方时把一部分操作数交给线程池，当前线程求值其余的，再等它们完成
+// 只在操作数都不给外层的变量赋值时并行，这时求值顺序不影响结果
+
+// 操作数的开销至少是这么多个节点时才交给其他线程，远大于一次任务调度的开销
+static const double ParallelMinCost = 5000;
+
+// 工作窃取的线程池: 每个线程有自己的任务队列，新的任务放进当前线程的队列
+// 空闲的线程从别的队列偷任务；等待任务的线程也执行队列中的任务，嵌套的并行不会死锁
+class TaskPool {
+public:
+    struct Task {
+        std::function<void()> Fn;
+        std::atomic<bool> Done{false};
+    };
+
+    explicit TaskPool(unsigned NumThreads);
+    ~TaskPool();
+
+    void spawn(Task &T);
+    // 等待T完成，期间执行队列中的其他任务
+    void wait(Task &T);
+
+    // 工作线程的个数，不包括使用线程池的线程
+    unsigned size() const { return Threads.size(); }
+
+private:
+    struct Queue {
+        std::mutex M;
+        std::deque<Task *> Tasks;
+    };
+    // 每个工作线程一个队列，最后一个属于使用线程池的线程
+    std::vector<std::unique_ptr<Queue>> Queues;
+    std::vector<std::thread> Threads;
+    // 所有队列中的任务总数，空闲的线程在SleepCV上等它不为0
+    std::atomic<unsigned> Queued{0};
+    std::mutex SleepM;
+    std::condition_variable SleepCV;
+    bool Stop = false;
+
+    unsigned self() const;
+    Task *take(unsigned Self);
+    void work(unsigned Self);
+
+    static void run(Task *T) {
+        T->Fn();
+        T->Done.store(true, std::memory_order_release);
+    }
+};
+
+// 工作线程所属的线程池和它的队列
+static thread_local TaskPool *CurrentPool = nullptr;
+static thread_local unsigned CurrentQueue = 0;
+
+TaskPool::TaskPool(unsigned NumThreads) {
+    for (unsigned I = 0; I <= NumThreads; ++I) {
+        Queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned I = 0; I != NumThreads; ++I) {
+        Threads.emplace_back([this, I] { work(I); });
+    }
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> L(SleepM);
+        Stop = true;
+    }
+    SleepCV.notify_all();
+    for (auto &T : Threads) {
+        T.join();
+    }
+}
+
+unsigned TaskPool::self() const {
+    return CurrentPool == this ? CurrentQueue : Queues.size() - 1;
+}
+
+void TaskPool::spawn(Task &T) {
+    Queue &Q = *Queues[self()];
+    {
+        std::lock_guard<std::mutex> L(Q.M);
+        Q.Tasks.push_back(&T);
+    }
+    Queued.fetch_add(1);
+    // 空闲的线程检查Queued和开始等待之间持有SleepM，先取得SleepM再通知，不会错过
+    { std::lock_guard<std::mutex> L(SleepM); }
+    SleepCV.notify_one();
+}
+
+TaskPool::Task *TaskPool::take(unsigned Self) {
+    // 自己的队列从尾部取最近放进去的，别的队列从头部偷最早放进去的
+    for (size_t K = 0; K != Queues.size(); ++K) {
+        Queue &Q = *Queues[(Self + K) % Queues.size()];
+        std::lock_guard<std::mutex> L(Q.M);
+        if (Q.Tasks.empty()) {
+            continue;
+        }
+        Task *T;
+        if (K == 0) {
+            T = Q.Tasks.back();
+            Q.Tasks.pop_back();
+        } else {
+            T = Q.Tasks.front();
+            Q.Tasks.pop_front();
+        }
+        Queued.fetch_sub(1);
+        return T;
+    }
+    return nullptr;
+}
+
+void TaskPool::work(unsigned Self) {
+    CurrentPool = this;
+    CurrentQueue = Self;
+    for (;;) {
+        if (Task *T = take(Self)) {
+            run(T);
+            continue;
+        }
+        std::unique_lock<std::mutex> L(SleepM);
+        SleepCV.wait(L, [&] { return Stop || Queued.load() != 0; });
+        if (Stop) {
+            return;
+        }
+    }
+}
+
+void TaskPool::wait(Task &T) {
+    unsigned Self = self();
+    while (!T.Done.load(std::memory_order_acquire)) {
+        if (Task *Other = take(Self)) {
+            run(Other);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void Interpreter::evalOperands(ExprAST *const *Ops, size_t N, uint64_t SpawnMask, double *Vals,
+                               bool StopOnError) {
+    struct Operand {
+        std::vector<Diagnostic> Errors;
+        bool Failed = false;
+        std::unique_ptr<Interpreter> Sub;
+        TaskPool::Task Task;
+    };
+    // 已经出错时调用不再执行(见CallExprAST::eval)，结果只剩下错误信息，直接顺序求值
+    if (Failed) {
+        for (size_t Idx = 0; Idx != N; ++Idx) {
+            Vals[Idx] = Ops[Idx]->eval(*this);
+        }
+        return;
+    }
+    std::vector<Operand> Results(N);
+
+    // 任务在自己的栈上执行，栈帧是当前栈帧的副本，操作数不会给其中的变量赋值
+    for (size_t Idx = 0; Idx != N; ++Idx) {
+        if (!(SpawnMask >> Idx & 1)) {
+            continue;
+        }
+        Operand &R = Results[Idx];
+        R.Sub = std::make_unique<Interpreter>(Ctx);
+        R.Sub->Stack.assign(Stack.begin() + FrameBase, Stack.end());
+        R.Sub->EvalDepth = EvalDepth;
+        R.Sub->Worker = true;
+        R.Sub->Errors = &R.Errors;
+        ExprAST *Op = Ops[Idx];
+        double *Val = &Vals[Idx];
+        R.Task.Fn = [&R, Op, Val] {
+            *Val = Op->eval(*R.Sub);
+            R.Failed = R.Sub->Failed;
+        };
+        Ctx.Pool->spawn(R.Task);
+    }
+
+    std::vector<Diagnostic> *SavedErrors = Errors;
+    for (size_t Idx = 0; Idx != N; ++Idx) {
+        if (SpawnMask >> Idx & 1) {
+            continue;
+        }
+        Operand &R = Results[Idx];
+        Errors = &R.Errors;
+        Vals[Idx] = Ops[Idx]->eval(*this);
+        R.Failed = Failed;
+        Failed = false;
+    }
+    Errors = SavedErrors;
+
+    for (size_t Idx = 0; Idx != N; ++Idx) {
+        if (!(SpawnMask >> Idx & 1)) {
+            continue;
+        }
+        Ctx.Pool->wait(Results[Idx].Task);
+        if (Worker) {
+            Calls += Results[Idx].Sub->Calls;
+        } else {
+            Ctx.Stats.add(cnt_calls, Results[Idx].Sub->Calls);
+        }
+    }
+
+    // 按操作数的顺序报告错误，和顺序求值时一样
+    // 顺序求值时前面的操作数出错之后，后面的操作数中的调用不再执行，报告的错误也不同，
+    // 这时在当前线程重新求值一次；操作数不给外层的变量赋值，重新求值没有副作用
+    for (size_t Idx = 0; Idx != N; ++Idx) {
+        Operand &R = Results[Idx];
+        if (Failed) {
+            if (StopOnError) {
+                break;
+            }
+            Vals[Idx] = Ops[Idx]->eval(*this);
+            continue;
+        }
+        for (const Diagnostic &D : R.Errors) {
+            report(D);
+        }
+        Failed = R.Failed;
+    }
+}
+
+struct ParallelInfo {
+    // 估计的开销，即求值时执行的节点数
+    double Cost = 1.0;
+    // 子表达式中被赋值的变量的最小槽位，没有赋值时是INT_MAX
+    int MinAssigned = INT_MAX;
+    // 用到的函数是否都已经完成名字解析，任务中不能再做名字解析
+    bool Safe = true;
+    // 计划不完整，不能缓存: 用到了还没有解析的延迟定义，它解析之后结果会不同，
+    // 或者超过了深度限制，没有继续往下计划
+    bool Partial = false;
+
+    void merge(const ParallelInfo &Other) {
+        Cost += Other.Cost;
+        MinAssigned = std::min(MinAssigned, Other.MinAssigned);
+        Safe &= Other.Safe;
+        Partial |= Other.Partial;
+    }
+};
+
+// 估计开销并设置各节点的SpawnLHS和SpawnMask
+// 函数的开销按DefinitionEpoch缓存在FunctionAST::Plan中，函数表不变时每个函数只计算一次
+class ParallelPlanner {
+public:
+    ContextImpl &Ctx;
+    // 当前可见的变量个数，操作数只给槽位不小于它的变量(即自己声明的)赋值时，和其他操作数互不影响
+    unsigned ScopeSize = 0;
+    // 和解释器的EvalDepth一样按递归的层数计算
+    int Depth = 0;
+
+    explicit ParallelPlanner(ContextImpl &Ctx) : Ctx(Ctx) {}
+
+    ParallelInfo planFunction(FunctionAST &F);
+
+    // 调用S的当前定义的开销
+    ParallelInfo callee(FunctionSlot *S) {
+        FunctionAST *F = S->Def.get();
+        return F ? planFunction(*F) : ParallelInfo();
+    }
+
+    // 一组操作数中交给线程池的那些: 开销足够大的操作数除了最后一个以外都交出去，
+    // 最后一个留在当前线程；有操作数给外层的变量赋值时都不并行
+    uint64_t spawnMask(const std::vector<ParallelInfo> &Ops) const {
+        std::vector<size_t> Heavy;
+        for (size_t Idx = 0; Idx != Ops.size(); ++Idx) {
+            if (Ops[Idx].MinAssigned < (int)ScopeSize || !Ops[Idx].Safe) {
+                return 0;
+            }
+            if (Ops[Idx].Cost >= ParallelMinCost && Idx < 64) {
+                Heavy.push_back(Idx);
+            }
+        }
+        uint64_t Mask = 0;
+        for (size_t K = 0; K + 1 < Heavy.size(); ++K) {
+            Mask |= (uint64_t)1 << Heavy[K];
+        }
+        return Mask;
+    }
+};
+
+ParallelInfo ParallelPlanner::planFunction(FunctionAST &F) {
+    auto &Plan = F.Plan;
+    if (Plan.Epoch == Ctx.DefinitionEpoch) {
+        // 还在计算中说明是递归调用，它不会终止，执行时总会出错，不并行
+        return {Plan.InProgress ? 1.0 : Plan.Cost, INT_MAX, !Plan.InProgress && Plan.Safe};
+    }
+
+    // 还没有解析的延迟定义不在这里解析，否则打开并行求值就会提前解析整个调用图；
+    // 当作不能并行，它第一次执行时解析，之后的执行重新计算
+    if (!F.isResolved()) {
+        ParallelInfo Info{1.0, INT_MAX, false};
+        Info.Partial = true;
+        return Info;
+    }
+    // 执行到这里时会超过深度限制而出错，不再往下计划，计划本身也不会耗尽调用栈
+    if (Depth + (int)F.getDepth() > MaxEvalDepth) {
+        ParallelInfo Info{1.0, INT_MAX, false};
+        Info.Partial = true;
+        return Info;
+    }
+
+    Plan.Epoch = Ctx.DefinitionEpoch;
+    Plan.Cost = 1.0;
+    Plan.Safe = false;
+    Plan.InProgress = true;
+    unsigned SavedScope = ScopeSize;
+    ScopeSize = F.getProto().getArgs().size();
+    Depth += F.getDepth();
+    ParallelInfo Body = F.getBody().plan(*this);
+    Depth -= F.getDepth();
+    ScopeSize = SavedScope;
+    Plan.InProgress = false;
+
+    Plan.Cost = Body.Cost + 1.0;
+    Plan.Safe = Body.Safe;
+    // 计划不完整时不缓存，下次重新计算
+    if (Body.Partial) {
+        Plan.Epoch = 0;
+    }
+    ParallelInfo Info{Plan.Cost, INT_MAX, Plan.Safe};
+    Info.Partial = Body.Partial;
+    return Info;
+}
+
+ParallelInfo NumberExprAST::plan(ParallelPlanner &) { return {}; }
+
+ParallelInfo VariableExprAST::plan(ParallelPlanner &) { return {}; }
+
+ParallelInfo UnaryExprAST::plan(ParallelPlanner &P) {
+    ParallelInfo Info;
+    Info.merge(Operand->plan(P));
+    Info.merge(P.callee(Target));
+    return Info;
+}
+
+ParallelInfo BinaryExprAST::plan(ParallelPlanner &P) {
+    if (Op == '=') {
+        auto *LHSE = static_cast<VariableExprAST *>(LHS.get());
+        ParallelInfo Info;
+        Info.merge(RHS->plan(P));
+        Info.MinAssigned = std::min(Info.MinAssigned, (int)LHSE->getSlot());
+        return Info;
+    }
+
+    std::vector<ParallelInfo> Ops{LHS->plan(P), RHS->plan(P)};
+    SpawnLHS = P.spawnMask(Ops) != 0;
+    ParallelInfo Info;
+    Info.merge(Ops[0]);
+    Info.merge(Ops[1]);
+    if (Target) {
+        Info.merge(P.callee(Target));
+    }
+    return Info;
+}
+
+ParallelInfo CallExprAST::plan(ParallelPlanner &P) {
+    std::vector<ParallelInfo> Ops;
+    for (auto &Arg : Args) {
+        Ops.push_back(Arg->plan(P));
+    }
+    SpawnMask = P.spawnMask(Ops);
+    ParallelInfo Info;
+    for (const ParallelInfo &Op : Ops) {
+        Info.merge(Op);
+    }
+    if (!Intrinsic) {
+        Info.merge(P.callee(Target));
+    }
+    return Info;
+}
+
+ParallelInfo MapExprAST::plan(ParallelPlanner &P) {
+    ParallelInfo Info;
+    for (auto &E : Range) {
+        Info.merge(E->plan(P));
+    }
+    // map在当前线程编译被调用的函数并使用线程池，不能在任务中执行
+    Info.Safe = false;
+    return Info;
+}
+
+ParallelInfo VarExprAST::plan(ParallelPlanner &P) {
+    ParallelInfo Info;
+    unsigned SavedScope = P.ScopeSize;
+    for (auto &Var : VarNames) {
+        if (Var.second) {
+            Info.merge(Var.second->plan(P));
+        }
+        ++P.ScopeSize;
+    }
+    Info.merge(Body->plan(P));
+    P.ScopeSize = SavedScope;
+    return Info;
+}
+
+//=========
+// Batch evaluation
+//=========
+
+// 对同一个函数的大量输入求值时，逐行调用解释器的开销太大
+// 这里把函数编译成一段没有分支的寄存器指令，每条指令一次处理一整块数据(BatchBlockSize行)
+// 每条指令都是对连续double数组的简单循环，编译器可以把它们向量化成SIMD指令
+
+// 每块的行数，一个寄存器正好占几个页，所有寄存器都能留在缓存里
+static const size_t BatchBlockSize = 256;
+
+struct BatchInst {
+    enum Opcode { Const, Add, Sub, Mul, Lt, Intrinsic };
+    Opcode Op;
+    IntrinsicID Intr;
+    int Dst, A, B;
+    double Imm;
+};
+
+// 对常量操作数计算指令的结果，和解释器执行同样的运算，结果逐位相同
+static double FoldBatchInst(BatchInst::Opcode Op, IntrinsicID Intr, double A, double B) {
+    switch (Op) {
+    case BatchInst::Add:
+        return A + B;
+    case BatchInst::Sub:
+        return A - B;
+    case BatchInst::Mul:
+        return A * B;
+    case BatchInst::Lt:
+        return A < B ? 1.0 : 0.0;
+    case BatchInst::Intrinsic: {
+        double Ops[2] = {A, B};
+        return EvalIntrinsic(Intr, Ops);
+    }
+    case BatchInst::Const:
+        break;
+    }
+    return 0.0;
+}
+
+// 把FunctionAST编译成BatchInst序列
+// 语言中没有分支，对用户函数的调用全部内联展开
+// 对变量的赋值不修改寄存器，而是让变量指向新的寄存器(即SSA)，所以指令之间只有数据依赖
+//
+// 函数都没有副作用，操作数都是常量的指令直接算出结果，相同的常量共用一个寄存器
+// 同样的运算作用在同样的寄存器上只生成一条指令，自动微分生成的导数函数中
+// 原值和导数共用的子表达式因此只算一次
+// 同一个函数以同样的实参寄存器再次内联时直接复用上次的结果，实参是常量时就相当于
+// 按(函数, 常量参数)缓存的特化版本，配置参数经过的运算在编译时就全部折叠掉了
+class BatchBuilder {
+public:
+    // 出错时报告到这里，为空时不报告(后台编译，失败了继续解释执行即可)
+    ContextImpl *Ctx;
+    std::vector<BatchInst> Insts;
+    int NumRegs = 0;
+    // 变量所在的寄存器，和解释器的栈一样按槽位索引，EnvBase是当前内联的函数的起始位置
+    std::vector<int> Env;
+    size_t EnvBase = 0;
+    // 内联的深度，和解释器的EvalDepth一样按递归的层数计算
+    int InlineDepth = 0;
+    // 内联的最大深度，对应解释器执行时最深的递归
+    int MaxInlineDepth = 0;
+    // 指令数的上限，内联展开可能随调用层数指数增长
+    size_t MaxInsts;
+
+    // 值在编译时已知的寄存器，以及常量值(按位)到寄存器的映射
+    std::vector<bool> IsConst;
+    std::vector<double> ConstVal;
+    std::unordered_map<uint64_t, int> ConstRegs;
+    // 已经生成过的指令(运算, 操作数寄存器)到结果寄存器的映射
+    std::map<std::tuple<BatchInst::Opcode, IntrinsicID, int, int>, int> Exprs;
+
+    // 已经内联过的调用: 结果所在的寄存器，以及展开时相对调用处最深的层数
+    struct InlinedCall {
+        int Result;
+        int Depth;
+    };
+    std::map<std::pair<FunctionAST *, std::vector<int>>, InlinedCall> Inlined;
+    // 编译期间主线程可能替换定义，持有内联过的定义，保证Inlined中的地址不会被复用
+    std::vector<std::shared_ptr<FunctionAST>> Pinned;
+
+    BatchBuilder(ContextImpl *Ctx, size_t MaxInsts) : Ctx(Ctx), MaxInsts(MaxInsts) {}
+
+    int newReg() {
+        IsConst.push_back(false);
+        ConstVal.push_back(0.0);
+        return NumRegs++;
+    }
+
+    int constant(double Val) {
+        uint64_t Bits;
+        memcpy(&Bits, &Val, sizeof(Bits));
+        auto It = ConstRegs.find(Bits);
+        if (It != ConstRegs.end()) {
+            return It->second;
+        }
+        int Dst = newReg();
+        Insts.push_back({BatchInst::Const, intr_sin, Dst, -1, -1, Val});
+        IsConst[Dst] = true;
+        ConstVal[Dst] = Val;
+        ConstRegs[Bits] = Dst;
+        return Dst;
+    }
+
+    int emit(BatchInst::Opcode Op, int A, int B, IntrinsicID Intr = intr_sin) {
+        if (IsConst[A] && (B < 0 || IsConst[B])) {
+            return constant(FoldBatchInst(Op, Intr, ConstVal[A], B < 0 ? 0.0 : ConstVal[B]));
+        }
+        // 同样的运算作用在同样的寄存器上，结果也一样，复用之前的寄存器
+        auto Key = std::make_tuple(Op, Intr, A, B);
+        auto It = Exprs.find(Key);
+        if (It != Exprs.end()) {
+            return It->second;
+        }
+        int Dst = newReg();
+        Insts.push_back({Op, Intr, Dst, A, B, 0.0});
+        Exprs.emplace(Key, Dst);
+        return Dst;
+    }
+
+    int &slot(unsigned Slot) { return Env[EnvBase + Slot]; }
+
+    int LogError(const char *Str, SourceLocation Loc = {}) {
+        if (Ctx) {
+            Ctx->error(Diagnostic::EvalError, Str, {Loc, Loc});
+        }
+        return -1;
+    }
+
+    // 内联一次对F的调用，ArgRegs是实参所在的寄存器
+    int inlineCall(FunctionAST &F, const std::vector<int> &ArgRegs);
+    int inlineCall(std::shared_ptr<FunctionAST> F, const std::vector<int> &ArgRegs) {
+        Pinned.push_back(F);
+        return inlineCall(*F, ArgRegs);
+    }
+};
+
+// 编译好的批量求值程序
+class BatchProgram {
+    std::vector<BatchInst> Insts;
+    unsigned NumArgs;
+    int Result;
+    // 每个虚拟寄存器在Scratch中的槽位，参数寄存器直接指向输入列，值为-1
+    std::vector<int> RegSlot;
+    int NumSlots;
+    std::vector<double> Scratch;
+    // 常量寄存器，只需要在开始时填充一次
+    std::vector<std::pair<int, double>> Constants;
+    // 解释执行同样的调用时最深的递归层数，见MaxEvalDepth
+    int EvalDepth;
+
+    // 单行执行的形式，参数和所有槽位放在Frame中，操作数直接是Frame的下标
+    std::vector<BatchInst> ScalarInsts;
+    std::vector<double> Frame;
+    int ScalarResult;
+
+    // 分配Scratch和Frame并填充常量
+    void allocateScratch();
+
+public:
+    // 出错时报告到Ctx，Ctx为空时不报告；指令数超过MaxInsts时放弃
+    static std::unique_ptr<BatchProgram> compile(ContextImpl *Ctx, FunctionAST &F,
+                                                 size_t MaxInsts = SIZE_MAX);
+
+    // 写入磁盘缓存和从磁盘缓存读取，读取失败(文件不存在或者格式不对)时返回nullptr
+    bool save(const std::string &Path) const;
+    static std::unique_ptr<BatchProgram> load(const std::string &Path);
+
+    // Columns[i]是第i个参数的输入列，结果写入Out，每个数组都有Rows个元素
+    void run(const double *const *Columns, size_t Rows, double *Out);
+    // 对一组参数求值，用于分层执行中逐次的调用
+    double runOne(const double *Args);
+
+    int getEvalDepth() const { return EvalDepth; }
+    unsigned getNumArgs() const { return NumArgs; }
+};
+
+int BatchBuilder::inlineCall(FunctionAST &F, const std::vector<int> &ArgRegs) {
+    // 计算哈希时已经解析了所有用到的定义，后台编译期间才加入的定义可能还没有解析
+    // 解析之后才能读取getDepth()
+    if (!F.isResolved()) {
+        return LogError("Function has unresolved names");
+    }
+    // 没有分支的递归不会终止，和解释器用同样的深度限制，batchgen和eval一样对每层表达式递归一次
+    if (InlineDepth + (int)F.getDepth() > MaxEvalDepth) {
+        return LogError("Maximum call depth exceeded");
+    }
+    if (Insts.size() > MaxInsts) {
+        return LogError("Function too large to compile");
+    }
+
+    // 同样的调用已经展开过，只需要检查在这里展开是否会超过深度限制
+    auto Key = std::make_pair(&F, ArgRegs);
+    auto It = Inlined.find(Key);
+    if (It != Inlined.end()) {
+        if (InlineDepth + It->second.Depth > MaxEvalDepth) {
+            return LogError("Maximum call depth exceeded");
+        }
+        MaxInlineDepth = std::max(MaxInlineDepth, InlineDepth + It->second.Depth);
+        return It->second.Result;
+    }
+
+    size_t SavedBase = EnvBase;
+    EnvBase = Env.size();
+    Env.insert(Env.end(), ArgRegs.begin(), ArgRegs.end());
+
+    int SavedMaxDepth = MaxInlineDepth;
+    InlineDepth += F.getDepth();
+    MaxInlineDepth = InlineDepth;
+    int Ret = F.getBody().batchgen(*this);
+    InlineDepth -= F.getDepth();
+    int Depth = MaxInlineDepth - InlineDepth;
+    MaxInlineDepth = std::max(SavedMaxDepth, MaxInlineDepth);
+
+    Env.resize(EnvBase);
+    EnvBase = SavedBase;
+    if (Ret >= 0) {
+        Inlined.emplace(std::move(Key), InlinedCall{Ret, Depth});
+    }
+    return Ret;
+}
+
+int NumberExprAST::batchgen(BatchBuilder &B) {
+    return B.constant(Val);
+}
+
+int VariableExprAST::batchgen(BatchBuilder &B) { return B.slot(Slot); }
+
+int UnaryExprAST::batchgen(BatchBuilder &B) {
+    int OperandR = Operand->batchgen(B);
+    if (OperandR < 0) {
+        return -1;
+    }
+
+    // 后台编译时主线程可能同时在替换定义
+    std::shared_ptr<FunctionAST> F = std::atomic_load(&Target->Def);
+    if (!F) {
+        return B.LogError("Unknown unary operator", Loc);
+    }
+    // 和eval一样检查参数个数，inlineCall按原型的参数个数读ArgRegs
+    if (F->getProto().getArgs().size() != 1) {
+        return B.LogError("Incorrect # arguments passed", Loc);
+    }
+    return B.inlineCall(F, {OperandR});
+}
+
+int BinaryExprAST::batchgen(BatchBuilder &B) {
+    if (Op == '=') {
+        auto *LHSE = static_cast<VariableExprAST *>(LHS.get());
+        int Val = RHS->batchgen(B);
+        if (Val < 0) {
+            return -1;
+        }
+
+        // 变量改为指向新值所在的寄存器，之前读到旧值的指令不受影响
+        B.slot(LHSE->getSlot()) = Val;
+        return Val;
+    }
+
+    int L = LHS->batchgen(B);
+    if (L < 0) {
+        return -1;
+    }
+    int R = RHS->batchgen(B);
+    if (R < 0) {
+        return -1;
+    }
+
+    switch (Op) {
+    case '+':
+        return B.emit(BatchInst::Add, L, R);
+    case '-':
+        return B.emit(BatchInst::Sub, L, R);
+    case '*':
+        return B.emit(BatchInst::Mul, L, R);
+    case '<':
+        return B.emit(BatchInst::Lt, L, R);
+    default:
+        break;
+    }
+
+    std::shared_ptr<FunctionAST> F = std::atomic_load(&Target->Def);
+    if (!F) {
+        return B.LogError("invalid binary operator", Loc);
+    }
+    if (F->getProto().getArgs().size() != 2) {
+        return B.LogError("Incorrect # arguments passed", Loc);
+    }
+    return B.inlineCall(F, {L, R});
+}
+
+int CallExprAST::batchgen(BatchBuilder &B) {
+    std::vector<int> ArgRegs;
+    for (auto &Arg : Args) {
+        int R = Arg->batchgen(B);
+        if (R < 0) {
+            return -1;
+        }
+        ArgRegs.push_back(R);
+    }
+
+    if (Intrinsic) {
+        return B.emit(BatchInst::Intrinsic, ArgRegs[0],
+                      ArgRegs.size() > 1 ? ArgRegs[1] : -1, Intrinsic->ID);
+    }
+
+    std::shared_ptr<FunctionAST> F = std::atomic_load(&Target->Def);
+    if (!F) {
+        return B.LogError("Unknown function referenced", Loc);
+    }
+    if (F->getProto().getArgs().size() != Args.size()) {
+        return B.LogError("Incorrect # arguments passed", Loc);
+    }
+    return B.inlineCall(F, ArgRegs);
+}
+
+int MapExprAST::batchgen(BatchBuilder &B) {
+    // 批量求值程序中没有循环，map只能解释执行
+    return B.LogError("Cannot compile map", Loc);
+}
+
+int VarExprAST::batchgen(BatchBuilder &B) {
+    size_t OldSize = B.Env.size();
+
+    for (auto &Var : VarNames) {
+        int InitR = Var.second ? Var.second->batchgen(B)
+                               : B.constant(0.0);
+        if (InitR < 0) {
+            return -1;
+        }
+        B.Env.push_back(InitR);
+    }
+
+    int Ret = Body->batchgen(B);
+    B.Env.resize(OldSize);
+    return Ret;
+}
+
+std::unique_ptr<BatchProgram> BatchProgram::compile(ContextImpl *Ctx, FunctionAST &F,
+                                                    size_t MaxInsts) {
+    BatchBuilder B(Ctx, MaxInsts);
+    unsigned NumArgs = F.getProto().getArgs().size();
+
+    // 寄存器0..NumArgs-1是参数
+    std::vector<int> ArgRegs;
+    for (unsigned I = 0; I != NumArgs; ++I) {
+        ArgRegs.push_back(B.newReg());
+    }
+
+    int Result = B.inlineCall(F, ArgRegs);
+    if (Result < 0) {
+        return nullptr;
+    }
+
+    // 折叠和复用之后很多指令的结果不再被用到，从后往前删掉它们
+    std::vector<bool> Live(B.NumRegs, false);
+    Live[Result] = true;
+    for (size_t I = B.Insts.size(); I > 0; --I) {
+        const BatchInst &Inst = B.Insts[I - 1];
+        if (Live[Inst.Dst]) {
+            if (Inst.A >= 0) {
+                Live[Inst.A] = true;
+            }
+            if (Inst.B >= 0) {
+                Live[Inst.B] = true;
+            }
+        }
+    }
+    B.Insts.erase(std::remove_if(B.Insts.begin(), B.Insts.end(),
+                                 [&](const BatchInst &Inst) { return !Live[Inst.Dst]; }),
+                  B.Insts.end());
+
+    auto P = std::make_unique<BatchProgram>();
+    P->NumArgs = NumArgs;
+    P->Result = Result;
+    P->EvalDepth = B.MaxInlineDepth;
+    P->RegSlot.assign(B.NumRegs, -1);
+
+    // 计算每个寄存器最后一次被使用的位置，之后它的槽位就可以被复用
+    std::vector<int> LastUse(B.NumRegs, -1);
+    for (size_t I = 0; I != B.Insts.size(); ++I) {
+        const BatchInst &Inst = B.Insts[I];
+        LastUse[Inst.Dst] = I;
+        if (Inst.A >= 0) {
+            LastUse[Inst.A] = I;
+        }
+        if (Inst.B >= 0) {
+            LastUse[Inst.B] = I;
+        }
+    }
+
+    // 常量在所有块之间共享，单独占用槽位；其余寄存器按生命周期复用槽位
+    int NumSlots = 0;
+    std::vector<int> FreeSlots;
+    std::vector<bool> Reusable(B.NumRegs, false);
+    auto Release = [&](int Reg, size_t I) {
+        if (Reg >= 0 && Reusable[Reg] && Reg != Result && LastUse[Reg] == (int)I) {
+            FreeSlots.push_back(P->RegSlot[Reg]);
+            // 同一个寄存器可能同时是两个操作数，只释放一次
+            Reusable[Reg] = false;
+        }
+    };
+
+    for (size_t I = 0; I != B.Insts.size(); ++I) {
+        const BatchInst &Inst = B.Insts[I];
+        if (Inst.Op == BatchInst::Const) {
+            P->RegSlot[Inst.Dst] = NumSlots++;
+            P->Constants.emplace_back(Inst.Dst, Inst.Imm);
+            continue;
+        }
+
+        if (!FreeSlots.empty()) {
+            P->RegSlot[Inst.Dst] = FreeSlots.back();
+            FreeSlots.pop_back();
+        } else {
+            P->RegSlot[Inst.Dst] = NumSlots++;
+        }
+        Reusable[Inst.Dst] = true;
+
+        // 先分配目标再释放操作数，避免目标和操作数共用同一块内存
+        Release(Inst.A, I);
+        Release(Inst.B, I);
+        // 结果没有被用到的寄存器立即释放
+        Release(Inst.Dst, I);
+    }
+
+    P->Insts = std::move(B.Insts);
+    P->NumSlots = NumSlots;
+    P->allocateScratch();
+    return P;
+}
+
+void BatchProgram::allocateScratch() {
+    Scratch.assign((size_t)NumSlots * BatchBlockSize, 0.0);
+    for (auto &C : Constants) {
+        double *D = &Scratch[(size_t)RegSlot[C.first] * BatchBlockSize];
+        for (size_t K = 0; K != BatchBlockSize; ++K) {
+            D[K] = C.second;
+        }
+    }
+
+    // Frame的前NumArgs个元素是参数，之后是Scratch中的各个槽位
+    auto Index = [&](int Reg) {
+        return Reg < 0 ? -1 : Reg < (int)NumArgs ? Reg : (int)NumArgs + RegSlot[Reg];
+    };
+    Frame.assign(NumArgs + NumSlots, 0.0);
+    for (auto &C : Constants) {
+        Frame[Index(C.first)] = C.second;
+    }
+    ScalarInsts.clear();
+    for (const BatchInst &I : Insts) {
+        if (I.Op != BatchInst::Const) {
+            ScalarInsts.push_back({I.Op, I.Intr, Index(I.Dst), Index(I.A), Index(I.B), 0.0});
+        }
+    }
+    ScalarResult = Index(Result);
+}
+
+// 对一块数据逐元素执行Fn，写成模板让编译器内联Fn并向量化整个循环
+template <typename Fn>
+static void BatchMap(double *D, const double *A, size_t N, Fn F) {
+    for (size_t K = 0; K != N; ++K) {
+        D[K] = F(A[K]);
+    }
+}
+
+template <typename Fn>
+static void BatchMap(double *D, const double *A, const double *B, size_t N, Fn F) {
+    for (size_t K = 0; K != N; ++K) {
+        D[K] = F(A[K], B[K]);
+    }
+}
+
+void BatchProgram::run(const double *const *Columns, size_t Rows, double *Out) {
+    std::vector<double *> Regs(RegSlot.size());
+    for (size_t R = 0; R != RegSlot.size(); ++R) {
+        if (RegSlot[R] >= 0) {
+            Regs[R] = &Scratch[(size_t)RegSlot[R] * BatchBlockSize];
+        }
+    }
+
+    for (size_t Row = 0; Row < Rows; Row += BatchBlockSize) {
+        size_t N = std::min(BatchBlockSize, Rows - Row);
+
+        // 参数寄存器直接指向输入列，不需要拷贝
+        for (unsigned I = 0; I != NumArgs; ++I) {
+            Regs[I] = const_cast<double *>(Columns[I] + Row);
+        }
+
+        for (const BatchInst &I : Insts) {
+            double *D = Regs[I.Dst];
+            const double *A = I.A >= 0 ? Regs[I.A] : nullptr;
+            const double *B = I.B >= 0 ? Regs[I.B] : nullptr;
+
+            switch (I.Op) {
+            case BatchInst::Const:
+                break;
+            case BatchInst::Add:
+                BatchMap(D, A, B, N, [](double L, double R) { return L + R; });
+                break;
+            case BatchInst::Sub:
+                BatchMap(D, A, B, N, [](double L, double R) { return L - R; });
+                break;
+            case BatchInst::Mul:
+                BatchMap(D, A, B, N, [](double L, double R) { return L * R; });
+                break;
+            case BatchInst::Lt:
+                BatchMap(D, A, B, N,
+                         [](double L, double R) { return L < R ? 1.0 : 0.0; });
+                break;
+            case BatchInst::Intrinsic:
+                switch (I.Intr) {
+                case intr_sqrt:
+                    BatchMap(D, A, N, [](double X) { return std::sqrt(X); });
+                    break;
+                case intr_fabs:
+                    BatchMap(D, A, N, [](double X) { return std::fabs(X); });
+                    break;
+                case intr_floor:
+                    BatchMap(D, A, N, [](double X) { return std::floor(X); });
+                    break;
+                case intr_ceil:
+                    BatchMap(D, A, N, [](double X) { return std::ceil(X); });
+                    break;
+                case intr_fmin:
+                    BatchMap(D, A, B, N,
+                             [](double X, double Y) { return std::fmin(X, Y); });
+                    break;
+                case intr_fmax:
+                    BatchMap(D, A, B, N,
+                             [](double X, double Y) { return std::fmax(X, Y); });
+                    break;
+                default: {
+                    // 其余的交给libm，逐个元素调用
+                    IntrinsicID ID = I.Intr;
+                    for (size_t K = 0; K != N; ++K) {
+                        double Ops[2] = {A[K], B ? B[K] : 0.0};
+                        D[K] = EvalIntrinsic(ID, Ops);
+                    }
+                    break;
+                }
+                }
+                break;
+            }
+        }
+
+        const double *R = Regs[Result];
+        for (size_t K = 0; K != N; ++K) {
+            Out[Row + K] = R[K];
+        }
+    }
+}
+
+double BatchProgram::runOne(const double *Args) {
+    double *F = Frame.data();
+    std::copy(Args, Args + NumArgs, F);
+
+    for (const BatchInst &I : ScalarInsts) {
+        switch (I.Op) {
+        case BatchInst::Const:
+            break;
+        case BatchInst::Add:
+            F[I.Dst] = F[I.A] + F[I.B];
+            break;
+        case BatchInst::Sub:
+            F[I.Dst] = F[I.A] - F[I.B];
+            break;
+        case BatchInst::Mul:
+            F[I.Dst] = F[I.A] * F[I.B];
+            break;
+        case BatchInst::Lt:
+            F[I.Dst] = F[I.A] < F[I.B] ? 1.0 : 0.0;
+            break;
+        case BatchInst::Intrinsic: {
+            double Ops[2] = {F[I.A], I.B >= 0 ? F[I.B] : 0.0};
+            F[I.Dst] = EvalIntrinsic(I.Intr, Ops);
+            break;
+        }
+        }
+    }
+    return F[ScalarResult];
+}
+
+//=========
+// Data-parallel map
+//=========
+
+// 被map的函数编译成批量求值程序，范围中的值按块生成输入列，块内由批量求值程序向量化地执行
+// 打开并行求值时各块分给线程池，每个线程用自己的一份程序，因为程序中的Scratch不能共享
+// 归约先在每块内按顺序进行，再按块的顺序合并；块的划分是固定的，结果和线程数无关
+// 不能编译的函数(调用了extern、指令太多等)由解释器逐个求值，按同样的块归约，结果和编译执行时逐位相同
+
+// 每块的行数，是BatchBlockSize的整数倍
+static const size_t MapChunkRows = 16 * BatchBlockSize;
+// 范围中最多允许的值的个数
+static const uint64_t MaxMapCount = (uint64_t)1 << 36;
+
+// 范围中值的个数，第k个值是Start + k*Step；Step为0、有NaN或者值太多时返回false
+static bool MapCount(double Start, double End, double Step, uint64_t &N) {
+    if (Step == 0.0 || std::isnan(Start) || std::isnan(End) || std::isnan(Step)) {
+        return false;
+    }
+    auto InRange = [&](uint64_t K) {
+        double X = Start + (double)K * Step;
+        return Step > 0 ? X < End : X > End;
+    };
+
+    double Span = std::ceil((End - Start) / Step);
+    if (!(Span > 0)) {
+        N = 0;
+        return true;
+    }
+    if (Span > (double)MaxMapCount) {
+        return false;
+    }
+    // 除法和生成值时的乘法、加法都有舍入，按实际生成的值修正
+    N = (uint64_t)Span;
+    while (N > 0 && !InRange(N - 1)) {
+        --N;
+    }
+    while (N < MaxMapCount && InRange(N)) {
+        ++N;
+    }
+    return true;
+}
+
+// 按顺序归约V中的N个值，每块和各块的结果都用它，保证两种执行方式的结果一样
+static double MapReduce(Reduction R, const double *V, size_t N) {
+    double Acc = R == Reduction::Sum   ? 0.0
+                 : R == Reduction::Min ? INFINITY
+                                       : -INFINITY;
+    for (size_t K = 0; K != N; ++K) {
+        switch (R) {
+        case Reduction::Sum:
+            Acc += V[K];
+            break;
+        case Reduction::Min:
+            Acc = std::fmin(Acc, V[K]);
+            break;
+        case Reduction::Max:
+            Acc = std::fmax(Acc, V[K]);
+            break;
+        }
+    }
+    return Acc;
+}
+
+bool ContextImpl::map(Interpreter &I, FunctionAST &F, double Start, double Step, uint64_t N,
+                      Reduction R, double *Out, double &Result) {
+    if (!resolveDeferred(F)) {
+        I.Failed = true;
+        return false;
+    }
+    Stats.add(cnt_map_rows, N);
+
+    uint64_t NumChunks = (N + MapChunkRows - 1) / MapChunkRows;
+    std::vector<double> Partial(NumChunks);
+    auto Chunk = [&](uint64_t C, double *X) {
+        uint64_t Begin = C * MapChunkRows;
+        size_t Rows = std::min<uint64_t>(MapChunkRows, N - Begin);
+        for (size_t K = 0; K != Rows; ++K) {
+            X[K] = Start + (double)(Begin + K) * Step;
+        }
+        return Rows;
+    };
+
+    // 和分层执行一样，解释执行会超过调用深度的限制时交给解释器，由它报告错误
+    std::shared_ptr<BatchProgram> P = Exec->mapProgram(F);
+    if (!P || I.EvalDepth + P->getEvalDepth() > MaxEvalDepth) {
+        std::vector<double> X(MapChunkRows), Y(MapChunkRows);
+        for (uint64_t C = 0; C != NumChunks; ++C) {
+            size_t Rows = Chunk(C, X.data());
+            double *Dst = Out ? Out + C * MapChunkRows : Y.data();
+            for (size_t K = 0; K != Rows; ++K) {
+                Dst[K] = F.call(I, &X[K]);
+                if (I.Failed) {
+                    return false;
+                }
+            }
+            if (!Out) {
+                Partial[C] = MapReduce(R, Dst, Rows);
+            }
+        }
+        if (!Out) {
+            Result = MapReduce(R, Partial.data(), NumChunks);
+        }
+        return true;
+    }
+
+    PhaseTimer T(Stats, phase_batch_run);
+    Stats.add(cnt_batch_rows, N);
+    // 各线程从Next依次领取下一块，直到所有的块都领完
+    std::atomic<uint64_t> Next{0};
+    auto Work = [&](BatchProgram &Prog) {
+        std::vector<double> X(MapChunkRows), Y(Out ? 0 : MapChunkRows);
+        for (uint64_t C; (C = Next.fetch_add(1)) < NumChunks;) {
+            size_t Rows = Chunk(C, X.data());
+            double *Dst = Out ? Out + C * MapChunkRows : Y.data();
+            const double *Columns[1] = {X.data()};
+            Prog.run(Columns, Rows, Dst);
+            if (!Out) {
+                Partial[C] = MapReduce(R, Dst, Rows);
+            }
+        }
+    };
+
+    std::vector<std::unique_ptr<TaskPool::Task>> Tasks;
+    if (Pool && NumChunks > 1) {
+        uint64_t NumTasks = std::min<uint64_t>(Pool->size(), NumChunks - 1);
+        for (uint64_t K = 0; K < NumTasks; ++K) {
+            Tasks.push_back(std::make_unique<TaskPool::Task>());
+            Tasks.back()->Fn = [&Work, &P] {
+                BatchProgram Copy = *P;
+                Work(Copy);
+            };
+            Pool->spawn(*Tasks.back());
+        }
+    }
+    Work(*P);
+    for (auto &Task : Tasks) {
+        Pool->wait(*Task);
+    }
+
+    if (!Out) {
+        Result = MapReduce(R, Partial.data(), NumChunks);
+    }
+    return true;
+}
+
+bool ContextImpl::map(FunctionAST &F, double Start, double End, double Step, Reduction R,
+                      std::vector<double> *Out, double &Result) {
+    if (F.getProto().getArgs().size() != 1) {
+        error(Diagnostic::EvalError, "Map function must take one argument");
+        return false;
+    }
+    uint64_t N;
+    if (!MapCount(Start, End, Step, N)) {
+        error(Diagnostic::EvalError, "Invalid map range");
+        return false;
+    }
+    if (Out) {
+        Out->resize(N);
+    }
+
+    PhaseTimer T(Stats, phase_eval);
+    if (Pool) {
+        ParallelPlanner P(*this);
+        P.planFunction(F);
+    }
+    Interpreter I(*this);
+    return map(I, F, Start, Step, N, R, Out ? Out->data() : nullptr, Result);
+}
+
+double MapExprAST::eval(Interpreter &I) {
+    double Vals[3];
+    for (int K = 0; K != 3; ++K) {
+        Vals[K] = Range[K]->eval(I);
+        if (I.Failed) {
+            return 0.0;
+        }
+    }
+
+    FunctionAST *F = Target->Def.get();
+    if (!F) {
+        if (I.Ctx.FunctionProtos.count(Callee)) {
+            return I.LogErrorV("Cannot call extern function in the interpreter", Loc);
+        }
+        return I.LogErrorV("Unknown function referenced", Loc);
+    }
+    if (F->getProto().getArgs().size() != 1) {
+        return I.LogErrorV("Map function must take one argument", Loc);
+    }
+
+    uint64_t N;
+    if (!MapCount(Vals[0], Vals[1], Vals[2], N)) {
+        return I.LogErrorV("Invalid map range", Loc);
+    }
+    double Result = 0.0;
+    if (!I.Ctx.map(I, *F, Vals[0], Vals[2], N, Builtin->R, nullptr, Result)) {
+        return 0.0;
+    }
+    return Result;
+}
+
+//=========
+// Compilation cache
+//=========
+
+// 编译结果按函数的哈希缓存，先在内存中查找，再到磁盘上查找
+// 哈希包含函数自身的结构、它(间接)调用的所有函数以及编译选项，
+// 因此任何一个相关的定义发生变化都会得到新的哈希，旧的缓存自然失效
+
+// 缓存文件格式的版本，BatchInst、文件布局、生成的指令或者深度的计算方法改变时需要递增
+static const uint32_t BatchCacheVersion = 4;
+static const char BatchCacheMagic[4] = {'K', 'B', 'C', '\0'};
+
+// FNV-1a哈希
+class ASTHasher {
+public:
+    ContextImpl &Ctx;
+    uint64_t Hash = 14695981039346656037ULL;
+
+    // 正在计算哈希的函数表项，结果不保存时为空
+    FunctionSlot *Owner;
+
+    explicit ASTHasher(ContextImpl &Ctx, FunctionSlot *Owner = nullptr)
+        : Ctx(Ctx), Owner(Owner) {}
+
+    void add(const void *Data, size_t Size) {
+        const unsigned char *P = static_cast<const unsigned char *>(Data);
+        for (size_t I = 0; I != Size; ++I) {
+            Hash ^= P[I];
+            Hash *= 1099511628211ULL;
+        }
+    }
+
+    void add(uint64_t V) { add(&V, sizeof(V)); }
+
+    // 按位哈希，保证0.0和-0.0不同
+    void add(double V) { add(&V, sizeof(V)); }
+
+    void add(const std::string &S) {
+        add((uint64_t)S.size());
+        add(S.data(), S.size());
+    }
+
+    // 加入被调用的函数，没有定义时只加入名字
+    // 同时记下调用关系，被调用的函数重新定义时Owner的哈希随之失效
+    void addCallee(const std::string &Name, FunctionSlot &Callee) {
+        add(Name);
+        add(Ctx.hashSlot(Callee));
+        if (Owner) {
+            Callee.Callers.insert(Owner);
+        }
+    }
+};
+
+void NumberExprAST::hash(ASTHasher &H) const {
+    H.add((uint64_t)'N');
+    H.add(Val);
+}
+
+void VariableExprAST::hash(ASTHasher &H) const {
+    H.add((uint64_t)'V');
+    H.add(Name);
+}
+
+void UnaryExprAST::hash(ASTHasher &H) const {
+    H.add((uint64_t)'U');
+    H.add((uint64_t)(unsigned char)Opcode);
+    H.addCallee("unary", *Target);
+    Operand->hash(H);
+}
+
+void BinaryExprAST::hash(ASTHasher &H) const {
+    H.add((uint64_t)'B');
+    H.add((uint64_t)(unsigned char)Op);
+    if (Op != '=' && Op != '+' && Op != '-' && Op != '*' && Op != '<') {
+        H.addCallee("binary", *Target);
+    }
+    LHS->hash(H);
+    RHS->hash(H);
+}
+
+void CallExprAST::hash(ASTHasher &H) const {
+    H.add((uint64_t)'C');
+    H.add((uint64_t)Args.size());
+    if (Intrinsic) {
+        H.add((uint64_t)Intrinsic->ID);
+    } else {
+        H.addCallee(Callee, *Target);
+    }
+    for (auto &Arg : Args) {
+        Arg->hash(H);
+    }
+}
+
+void MapExprAST::hash(ASTHasher &H) const {
+    H.add((uint64_t)'M');
+    H.add((uint64_t)Builtin->R);
+    H.addCallee(Callee, *Target);
+    for (auto &E : Range) {
+        E->hash(H);
+    }
+}
+
+void VarExprAST::hash(ASTHasher &H) const {
+    H.add((uint64_t)'L');
+    H.add((uint64_t)VarNames.size());
+    for (auto &Var : VarNames) {
+        H.add(Var.first);
+        H.add((uint64_t)(Var.second != nullptr));
+        if (Var.second) {
+            Var.second->hash(H);
+        }
+    }
+    Body->hash(H);
+}
+
+static uint64_t hashBody(ASTHasher &H, const FunctionAST &F) {
+    H.add(F.getName());
+    for (const auto &Arg : F.getProto().getArgs()) {
+        H.add(Arg);
+    }
+    F.getBody().hash(H);
+    return H.Hash;
+}
+
+uint64_t ContextImpl::hashFunction(FunctionAST &F) {
+    // 句柄可能持有已经被重新定义的旧定义，它的哈希不保存
+    auto It = Functions.find(F.getName());
+    if (It != Functions.end() && It->second.Def.get() == &F) {
+        return hashSlot(It->second);
+    }
+    if (!resolveDeferred(F)) {
+        return 0;
+    }
+    ASTHasher H(*this);
+    return hashBody(H, F);
+}
+
+uint64_t ContextImpl::hashSlot(FunctionSlot &S) {
+    if (!S.Def) {
+        return 0;
+    }
+    // 递归调用自身时用0代替，避免无限递归
+    if (S.HashState != FunctionSlot::HashInvalid) {
+        return S.HashState == FunctionSlot::HashValid ? S.Hash : 0;
+    }
+
+    // 哈希中包括了调用的绑定，没有解析的定义先解析，出错时不保存哈希，由编译报告错误
+    if (!resolveDeferred(*S.Def)) {
+        return 0;
+    }
+
+    S.HashState = FunctionSlot::HashInProgress;
+    ASTHasher H(*this, &S);
+    S.Hash = hashBody(H, *S.Def);
+    S.HashState = FunctionSlot::HashValid;
+    return S.Hash;
+}
+
+void ContextImpl::invalidateHash(FunctionSlot &S) {
+    // 编译结果内联了被调用的函数，和哈希一起失效，调用计数重新开始
+    auto Invalidate = [](FunctionSlot &C) {
+        C.HashState = FunctionSlot::HashInvalid;
+        C.Calls = 0;
+        C.TierRequested = false;
+        C.Compiled.reset();
+        ++C.Generation;
+    };
+
+    // 沿着调用关系往上走，哈希已经失效的表项不会有仍然有效的调用者，不需要继续
+    Invalidate(S);
+    std::vector<FunctionSlot *> Work(S.Callers.begin(), S.Callers.end());
+    S.Callers.clear();
+    while (!Work.empty()) {
+        FunctionSlot *C = Work.back();
+        Work.pop_back();
+        if (C->HashState != FunctionSlot::HashValid) {
+            continue;
+        }
+        Stats.add(cnt_cache_invalidated);
+        Invalidate(*C);
+        Work.insert(Work.end(), C->Callers.begin(), C->Callers.end());
+        C->Callers.clear();
+    }
+}
+
+// 写Path之前使用的临时文件名，先写到临时文件再重命名，其他进程不会读到写了一半的文件
+// 除了进程号还加上计数，同一个进程中的多个Context同时写同一个文件也不会互相覆盖
+static std::string TempPathFor(const std::string &Path) {
+    static std::atomic<unsigned> Counter{0};
+    return Path + ".tmp." + std::to_string(getpid()) + "." +
+           std::to_string(Counter.fetch_add(1, std::memory_order_relaxed));
+}
+
+bool BatchProgram::save(const std::string &Path) const {
+    std::string TmpPath = TempPathFor(Path);
+    FILE *F = fopen(TmpPath.c_str(), "wb");
+    if (!F) {
+        return false;
+    }
+
+    uint32_t Header[7] = {BatchCacheVersion,      NumArgs,
+                          (uint32_t)Result,       (uint32_t)NumSlots,
+                          (uint32_t)Insts.size(), (uint32_t)RegSlot.size(),
+                          (uint32_t)EvalDepth};
+    uint32_t NumConstants = Constants.size();
+
+    bool OK = fwrite(BatchCacheMagic, sizeof(BatchCacheMagic), 1, F) == 1 &&
+              fwrite(Header, sizeof(Header), 1, F) == 1 &&
+              fwrite(&NumConstants, sizeof(NumConstants), 1, F) == 1 &&
+              fwrite(Insts.data(), sizeof(BatchInst), Insts.size(), F) == Insts.size() &&
+              fwrite(RegSlot.data(), sizeof(int), RegSlot.size(), F) == RegSlot.size();
+    for (auto &C : Constants) {
+        OK = OK && fwrite(&C.first, sizeof(C.first), 1, F) == 1 &&
+             fwrite(&C.second, sizeof(C.second), 1, F) == 1;
+    }
+
+    if (fclose(F) != 0 || !OK) {
+        remove(TmpPath.c_str());
+        return false;
+    }
+    return rename(TmpPath.c_str(), Path.c_str()) == 0;
+}
+
+// 内置函数的参数个数
+static unsigned IntrinsicNumArgs(IntrinsicID ID) {
+    for (const auto &I : Intrinsics) {
+        if (I.ID == ID) {
+            return I.NumArgs;
+        }
+    }
+    return 0;
+}
+
+std::unique_ptr<BatchProgram> BatchProgram::load(const std::string &Path) {
+    FILE *F = fopen(Path.c_str(), "rb");
+    if (!F) {
+        return nullptr;
+    }
+
+    auto P = std::make_unique<BatchProgram>();
+    char Magic[sizeof(BatchCacheMagic)];
+    uint32_t Header[7];
+    uint32_t NumConstants;
+    struct stat St;
+    bool OK = fstat(fileno(F), &St) == 0 &&
+              fread(Magic, sizeof(Magic), 1, F) == 1 &&
+              memcmp(Magic, BatchCacheMagic, sizeof(Magic)) == 0 &&
+              fread(Header, sizeof(Header), 1, F) == 1 &&
+              Header[0] == BatchCacheVersion &&
+              fread(&NumConstants, sizeof(NumConstants), 1, F) == 1;
+
+    // 分配任何内存之前先用文件的大小检查各个数量，损坏的头部不会导致巨大的分配
+    OK = OK && (uint64_t)St.st_size ==
+                   sizeof(Magic) + sizeof(Header) + sizeof(NumConstants) +
+                       (uint64_t)Header[4] * sizeof(BatchInst) +
+                       (uint64_t)Header[5] * sizeof(int) +
+                       (uint64_t)NumConstants * (sizeof(int) + sizeof(double));
+    // 每个槽位至少属于一个寄存器，参数也都是寄存器
+    OK = OK && Header[1] <= Header[5] && Header[3] <= Header[5] && Header[5] <= INT_MAX;
+
+    if (OK) {
+        P->NumArgs = Header[1];
+        P->Result = Header[2];
+        P->NumSlots = Header[3];
+        P->Insts.resize(Header[4]);
+        P->RegSlot.resize(Header[5]);
+        P->EvalDepth = Header[6];
+        P->Constants.resize(NumConstants);
+        OK = fread(P->Insts.data(), sizeof(BatchInst), P->Insts.size(), F) ==
+                 P->Insts.size() &&
+             fread(P->RegSlot.data(), sizeof(int), P->RegSlot.size(), F) ==
+                 P->RegSlot.size();
+        for (auto &C : P->Constants) {
+            OK = OK && fread(&C.first, sizeof(C.first), 1, F) == 1 &&
+                 fread(&C.second, sizeof(C.second), 1, F) == 1;
+        }
+        // 文件必须正好读完
+        OK = OK && fgetc(F) == EOF;
+    }
+    fclose(F);
+
+    // 防止损坏的文件导致越界访问: 指令和内置函数必须是已知的，
+    // 用到的操作数必须是寄存器，只有不用的操作数可以是-1
+    int NumRegs = P->RegSlot.size();
+    for (size_t I = 0; OK && I != P->Insts.size(); ++I) {
+        const BatchInst &Inst = P->Insts[I];
+        // 枚举先按整数检查范围，不合法的值不能当作枚举读取
+        std::underlying_type_t<BatchInst::Opcode> RawOp;
+        std::underlying_type_t<IntrinsicID> RawIntr;
+        memcpy(&RawOp, &Inst.Op, sizeof(RawOp));
+        memcpy(&RawIntr, &Inst.Intr, sizeof(RawIntr));
+        if ((uint64_t)RawOp > BatchInst::Intrinsic || (uint64_t)RawIntr > intr_fmax) {
+            OK = false;
+            break;
+        }
+        unsigned NumOps = 0;
+        switch (Inst.Op) {
+        case BatchInst::Const:
+            NumOps = 0;
+            break;
+        case BatchInst::Add:
+        case BatchInst::Sub:
+        case BatchInst::Mul:
+        case BatchInst::Lt:
+            NumOps = 2;
+            break;
+        case BatchInst::Intrinsic:
+            NumOps = IntrinsicNumArgs(Inst.Intr);
+            break;
+        }
+        OK = OK && Inst.Dst >= (int)P->NumArgs && Inst.Dst < NumRegs;
+        OK = OK && (NumOps >= 1 ? Inst.A >= 0 : Inst.A >= -1) && Inst.A < NumRegs;
+        OK = OK && (NumOps >= 2 ? Inst.B >= 0 : Inst.B >= -1) && Inst.B < NumRegs;
+    }
+    for (size_t R = 0; OK && R != P->RegSlot.size(); ++R) {
+        OK = P->RegSlot[R] >= -1 && P->RegSlot[R] < P->NumSlots &&
+             (P->RegSlot[R] >= 0 || R < P->NumArgs);
+    }
+    for (auto &C : P->Constants) {
+        OK = OK && C.first >= 0 && C.first < NumRegs && P->RegSlot[C.first] >= 0;
+    }
+    if (!OK || P->Result < 0 || P->Result >= NumRegs || P->EvalDepth < 0) {
+        return nullptr;
+    }
+
+    P->allocateScratch();
+    return P;
+}
+
+uint64_t ContextImpl::batchProgramKey(FunctionAST &F) {
+    // 编译选项也是哈希的一部分
+    ASTHasher H(*this);
+    H.add((uint64_t)BatchCacheVersion);
+    H.add((uint64_t)BatchBlockSize);
+    H.add((uint64_t)sizeof(BatchInst));
+    H.add(hashFunction(F));
+    return H.Hash;
+}
+
+std::shared_ptr<BatchProgram> ContextImpl::getBatchProgram(FunctionAST &F) {
+    if (!resolveDeferred(F)) {
+        return nullptr;
+    }
+    uint64_t Key = batchProgramKey(F);
+
+    auto It = BatchPrograms.find(Key);
+    if (It != BatchPrograms.end()) {
+        Stats.add(cnt_cache_memory_hits);
+        return It->second;
+    }
+
+    std::string Path;
+    std::shared_ptr<BatchProgram> P;
+    if (!CacheDir.empty()) {
+        char Name[32];
+        snprintf(Name, sizeof(Name), "%016llx.kbc", (unsigned long long)Key);
+        Path = CacheDir + "/" + Name;
+
+        PhaseTimer T(Stats, phase_cache_load);
+        P = BatchProgram::load(Path);
+        // 参数个数不对的文件同样当作损坏，重新编译
+        if (P && P->getNumArgs() != F.getProto().getArgs().size()) {
+            P = nullptr;
+        }
+        if (P) {
+            Stats.add(cnt_cache_disk_hits);
+        }
+    }
+
+    if (!P) {
+        Stats.add(cnt_cache_misses);
+        {
+            PhaseTimer T(Stats, phase_batch_compile);
+            P = BatchProgram::compile(nullptr, F, MaxTierInsts);
+        }
+        if (!P) {
+            return nullptr;
+        }
+        // 写缓存失败不影响这次的结果
+        if (!Path.empty()) {
+            PhaseTimer T(Stats, phase_cache_save);
+            P->save(Path);
+        }
+    }
+
+    BatchPrograms[Key] = P;
+    return P;
+}
+
+//=========
+// Tiered execution
+//=========
+
+// 所有函数先由解释器执行，第一次调用没有编译的开销
+// 调用次数达到阈值的函数交给后台线程编译成BatchProgram，编译期间继续解释执行
+// 编译结果由主线程在调用时装上，之后的调用按单行执行编译结果，和解释执行的结果逐位相同(NaN见Backend)
+
+class TierCompiler {
+public:
+    struct Job {
+        FunctionSlot *Slot;
+        // 持有提交时的定义，编译期间主线程替换定义也不会释放它
+        std::shared_ptr<FunctionAST> Def;
+        unsigned Generation;
+        uint64_t Key;
+        // 编译失败时为空
+        std::shared_ptr<BatchProgram> Result;
+    };
+
+    // 有编译完的结果等待装上，主线程每次调用时检查，只是一次原子读
+    std::atomic<bool> HasDone{false};
+
+    TierCompiler() : Thread([this] { run(); }) {}
+
+    ~TierCompiler() {
+        {
+            std::lock_guard<std::mutex> L(Lock);
+            Stopping = true;
+        }
+        CV.notify_one();
+        Thread.join();
+    }
+
+    void submit(Job J) {
+        {
+            std::lock_guard<std::mutex> L(Lock);
+            Pending.push_back(std::move(J));
+        }
+        CV.notify_one();
+    }
+
+    std::vector<Job> takeDone() {
+        std::lock_guard<std::mutex> L(Lock);
+        HasDone.store(false, std::memory_order_relaxed);
+        return std::move(Done);
+    }
+
+private:
+    std::mutex Lock;
+    std::condition_variable CV;
+    std::deque<Job> Pending;
+    std::vector<Job> Done;
+    bool Stopping = false;
+    std::thread Thread;
+
+    void run() {
+        while (true) {
+            Job J;
+            {
+                std::unique_lock<std::mutex> L(Lock);
+                CV.wait(L, [&] { return Stopping || !Pending.empty(); });
+                if (Stopping) {
+                    return;
+                }
+                J = std::move(Pending.front());
+                Pending.pop_front();
+            }
+
+            // 只读AST，不碰Context中的其他状态，出错也不报告
+            J.Result = BatchProgram::compile(nullptr, *J.Def, MaxTierInsts);
+            J.Def.reset();
+
+            {
+                std::lock_guard<std::mutex> L(Lock);
+                Done.push_back(std::move(J));
+            }
+            HasDone.store(true, std::memory_order_release);
+        }
+    }
+};
+
+bool ContextImpl::runCompiled(FunctionSlot &S, int EvalDepth, const double *Args,
+                              double &Result) {
+    if (Compiler && Compiler->HasDone.load(std::memory_order_acquire)) {
+        installCompiled();
+    }
+
+    if (!S.Compiled) {
+        // profile中的热点在第一次调用时就直接编译，其余的达到阈值之后交给后台
+        ++S.Calls;
+        if (!S.TierRequested && !(S.Calls == 1 && compileFromProfile(S)) &&
+            S.Calls >= TierThreshold) {
+            requestCompile(S);
+        }
+        if (!S.Compiled) {
+            return false;
+        }
+    }
+
+    // 解释执行会超过调用深度的限制时仍然交给解释器，由它报告错误
+    if (EvalDepth + S.Compiled->getEvalDepth() > MaxEvalDepth) {
+        return false;
+    }
+    Stats.add(cnt_tier_calls);
+    Result = S.Compiled->runOne(Args);
+    return true;
+}
+
+void ContextImpl::requestCompile(FunctionSlot &S) {
+    S.TierRequested = true;
+
+    // 计算哈希的同时记下了S(间接)调用的函数，它们重新定义时S的编译结果随之失效
+    uint64_t Key = batchProgramKey(*S.Def);
+    auto It = BatchPrograms.find(Key);
+    if (It != BatchPrograms.end()) {
+        Stats.add(cnt_cache_memory_hits);
+        S.Compiled = It->second;
+        return;
+    }
+
+    if (!Compiler) {
+        Compiler = std::make_unique<TierCompiler>();
+    }
+    Compiler->submit({&S, S.Def, S.Generation, Key, nullptr});
+}
+
+bool ContextImpl::compileFromProfile(FunctionSlot &S) {
+    if (Profile.empty()) {
+        return false;
+    }
+    auto It = Profile.find(hashSlot(S));
+    if (It == Profile.end() || It->second < TierThreshold) {
+        return false;
+    }
+
+    // 和后台编译一样不报告错误，失败时后台编译也会同样失败
+    S.TierRequested = true;
+    S.Compiled = getBatchProgram(*S.Def);
+    if (S.Compiled) {
+        Stats.add(cnt_tier_profile_compiles);
+    }
+    return true;
+}
+
+void ContextImpl::installCompiled() {
+    for (TierCompiler::Job &J : Compiler->takeDone()) {
+        // 编译期间S或者它调用的函数被重新定义了，结果已经过时
+        if (!J.Result || J.Generation != J.Slot->Generation) {
+            continue;
+        }
+        Stats.add(cnt_tier_compiles);
+        BatchPrograms.emplace(J.Key, J.Result);
+        J.Slot->Compiled = std::move(J.Result);
+    }
+}
+
+//=========
+// Execution backends
+//=========
+
+// 解释器总是负责遍历语法树，后端决定对函数的调用、批量求值和map是否改为执行编译好的BatchProgram
+// 编译结果和解释执行逐位相同(NaN的符号和payload除外)，超过调用深度限制等会出错的情况都交回解释器，
+// 由它报告错误
+// 所以各后端可以随时切换，也可以在同样的输入上互相对比；接口见ExecutionBackend
+
+class InterpreterBackend : public ExecutionBackend {
+    ContextImpl &Ctx;
+
+public:
+    explicit InterpreterBackend(ContextImpl &Ctx) : Ctx(Ctx) {}
+
+    bool call(FunctionSlot &, int, const double *, double &) override { return false; }
+
+    bool evaluateBatch(FunctionAST &F, const double *const *Columns, size_t Rows,
+                       double *Out) override {
+        return Ctx.interpretBatch(F, Columns, Rows, Out);
+    }
+
+    std::shared_ptr<BatchProgram> mapProgram(FunctionAST &) override { return nullptr; }
+};
+
+class TieredBackend : public ExecutionBackend {
+    ContextImpl &Ctx;
+
+public:
+    explicit TieredBackend(ContextImpl &Ctx) : Ctx(Ctx) {}
+
+    bool call(FunctionSlot &S, int EvalDepth, const double *Args, double &Result) override {
+        return Ctx.TierThreshold && Ctx.runCompiled(S, EvalDepth, Args, Result);
+    }
+
+    bool evaluateBatch(FunctionAST &F, const double *const *Columns, size_t Rows,
+                       double *Out) override {
+        return Ctx.runBatch(F, Columns, Rows, Out);
+    }
+
+    std::shared_ptr<BatchProgram> mapProgram(FunctionAST &F) override {
+        return Ctx.getBatchProgram(F);
+    }
+};
+
+class CompiledBackend : public ExecutionBackend {
+    ContextImpl &Ctx;
+
+public:
+    explicit CompiledBackend(ContextImpl &Ctx) : Ctx(Ctx) {}
+
+    bool call(FunctionSlot &S, int EvalDepth, const double *Args, double &Result) override {
+        // 和分层执行共用表项中的编译结果，重新定义时一起失效；编译失败之后不再尝试
+        // 从Tiered切换过来时可能还有后台编译的结果没有装上
+        if (Ctx.Compiler && Ctx.Compiler->HasDone.load(std::memory_order_acquire)) {
+            Ctx.installCompiled();
+        }
+        if (!S.Compiled && !S.TierRequested) {
+            S.TierRequested = true;
+            S.Compiled = Ctx.getBatchProgram(*S.Def);
+            if (S.Compiled) {
+                Ctx.Stats.add(cnt_tier_compiles);
+            }
+        }
+        if (!S.Compiled || EvalDepth + S.Compiled->getEvalDepth() > MaxEvalDepth) {
+            return false;
+        }
+        Ctx.Stats.add(cnt_tier_calls);
+        Result = S.Compiled->runOne(Args);
+        return true;
+    }
+
+    bool evaluateBatch(FunctionAST &F, const double *const *Columns, size_t Rows,
+                       double *Out) override {
+        return Ctx.runBatch(F, Columns, Rows, Out);
+    }
+
+    std::shared_ptr<BatchProgram> mapProgram(FunctionAST &F) override {
+        return Ctx.getBatchProgram(F);
+    }
+};
+
+std::unique_ptr<ExecutionBackend> ExecutionBackend::create(Backend B, ContextImpl &Ctx) {
+    switch (B) {
+    case Backend::Interpreter:
+        return std::make_unique<InterpreterBackend>(Ctx);
+    case Backend::Tiered:
+        break;
+    case Backend::Compiled:
+        return std::make_unique<CompiledBackend>(Ctx);
+    }
+    return std::make_unique<TieredBackend>(Ctx);
+}
+
+void ContextImpl::setBackend(Backend B) {
+    Kind = B;
+    Exec = ExecutionBackend::create(B, *this);
+}
+
+bool ContextImpl::runBatch(FunctionAST &F, const double *const *Columns, size_t Rows,
+                           double *Out) {
+    // 延迟定义解析出错时只报告一次
+    if (!resolveDeferred(F)) {
+        return false;
+    }
+    // 和单次调用一样，有map、超过调用深度限制等不能编译的函数由解释器执行并报告错误，
+    // 诊断信息和解释器后端相同
+    auto P = getBatchProgram(F);
+    if (!P) {
+        return interpretBatch(F, Columns, Rows, Out);
+    }
+    PhaseTimer T(Stats, phase_batch_run);
+    Stats.add(cnt_batch_rows, Rows);
+    P->run(Columns, Rows, Out);
+    return true;
+}
+
+bool ContextImpl::interpretBatch(FunctionAST &F, const double *const *Columns, size_t Rows,
+                                 double *Out) {
+    std::vector<double> Args(F.getProto().getArgs().size());
+    for (size_t Row = 0; Row != Rows; ++Row) {
+        for (size_t K = 0; K != Args.size(); ++K) {
+            Args[K] = Columns[K][Row];
+        }
+        if (!call(F, Args.data(), Out[Row])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ContextImpl::~ContextImpl() = default;
+
+//=========
+// Execution profile
+//=========
+
+// 记录每个函数被调用的次数，下次运行时热点函数在第一次调用时就编译，不需要先解释执行到阈值
+// 没有条件分支，函数中每个调用点执行的次数都和函数本身相同，所以只按函数计数
+// 按函数的结构哈希索引，函数或者它调用的函数改变之后旧的记录自然不再匹配
+//
+// 文件格式: 魔数、版本、记录数，之后每条记录是哈希和调用次数，都是本机字节序
+
+static const uint32_t ProfileVersion = 1;
+static const char ProfileMagic[4] = {'K', 'P', 'F', '\0'};
+
+bool ContextImpl::saveProfile(const std::string &Path) {
+    // 读入的记录和这次运行的次数合并，多次运行可以累积
+    std::unordered_map<uint64_t, uint64_t> Counts = Profile;
+    for (auto &KV : Functions) {
+        if (KV.second.Def && KV.second.ProfileCalls) {
+            Counts[hashSlot(KV.second)] += KV.second.ProfileCalls;
+        }
+    }
+
+    std::string TmpPath = TempPathFor(Path);
+    FILE *F = fopen(TmpPath.c_str(), "wb");
+    if (!F) {
+        error(Diagnostic::EvalError, "Cannot open profile file for writing");
+        return false;
+    }
+    uint32_t Header[2] = {ProfileVersion, (uint32_t)Counts.size()};
+    bool OK = fwrite(ProfileMagic, sizeof(ProfileMagic), 1, F) == 1 &&
+              fwrite(Header, sizeof(Header), 1, F) == 1;
+    for (auto &KV : Counts) {
+        uint64_t Record[2] = {KV.first, KV.second};
+        OK = OK && fwrite(Record, sizeof(Record), 1, F) == 1;
+    }
+    if (fclose(F) != 0 || !OK || rename(TmpPath.c_str(), Path.c_str()) != 0) {
+        remove(TmpPath.c_str());
+        error(Diagnostic::EvalError, "Cannot write profile file");
+        return false;
+    }
+    return true;
+}
+
+bool ContextImpl::loadProfile(const std::string &Path) {
+    FILE *F = fopen(Path.c_str(), "rb");
+    if (!F) {
+        error(Diagnostic::ParseError, "Cannot open profile file");
+        return false;
+    }
+
+    char Magic[sizeof(ProfileMagic)];
+    uint32_t Header[2];
+    bool OK = fread(Magic, sizeof(Magic), 1, F) == 1 &&
+              memcmp(Magic, ProfileMagic, sizeof(Magic)) == 0 &&
+              fread(Header, sizeof(Header), 1, F) == 1 && Header[0] == ProfileVersion;
+    // 先完整读取，文件损坏时不修改已有的记录
+    std::vector<std::pair<uint64_t, uint64_t>> Records;
+    for (uint32_t I = 0; OK && I != Header[1]; ++I) {
+        uint64_t Record[2];
+        OK = fread(Record, sizeof(Record), 1, F) == 1;
+        Records.push_back({Record[0], Record[1]});
+    }
+    OK = OK && fgetc(F) == EOF;
+    fclose(F);
+
+    if (!OK) {
+        error(Diagnostic::ParseError, "Invalid profile file");
+        return false;
+    }
+    for (auto &R : Records) {
+        Profile[R.first] += R.second;
+    }
+    return true;
+}
+
+//=========
+// Automatic differentiation
+//=========
+
+// 前向模式的自动微分: 直接变换函数的语法树，得到计算它对某个参数的偏导数的新定义
+// 生成的定义和源码中的没有区别，解释执行、批量求值和分层执行都直接适用
+//
+// 每个子表达式变换成一段代码，按原来的顺序执行一遍它的全部副作用(赋值)，
+// 把原值存进一个临时变量，并以切线(对参数的导数)作为值；父节点用子节点的原值和切线套求导法则
+// 临时变量在函数的最外层声明，生成的名字都以'开头，不会和源码中的名字冲突
+// 对自定义函数和运算符的调用按链式法则调用它们对各参数的偏导数函数，名为g'0、g'1等，
+// 和要求的偏导数在同一次differentiate()中一起生成
+//
+// 生成的代码中原值和导数共用同样的中间结果，批量求值时在同一个程序里一起算出来
+
+// 原值或者切线: 变量或者常量
+struct DiffAtom {
+    std::string Var; // 为空时是常量Val
+    double Val = 0.0;
+};
+
+// 求导法则中的一项，E为空时是常量Val，运算时化简掉和常量0、1有关的部分
+struct DiffTerm {
+    std::unique_ptr<ExprAST> E;
+    double Val = 0.0;
+};
+
+struct DiffValue {
+    // 需要按顺序求值一次的代码，为空时什么都不用做
+    std::unique_ptr<ExprAST> Code;
+    // 求值Code之后的原值
+    DiffAtom Primal;
+    // TangentIsCode为true时切线是Code的值，否则就是Tangent，这时Code的值可以丢弃
+    DiffAtom Tangent;
+    bool TangentIsCode = false;
+};
+
+using DiffBindings = std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>>;
+
+class Differentiator {
+    unsigned NextName = 0;
+
+public:
+    ContextImpl &Ctx;
+    // 用到的偏导数函数(函数名, 参数的序号)，按第一次用到的顺序，由differentiate()逐个生成
+    std::set<std::pair<std::string, unsigned>> &Requested;
+    std::vector<std::pair<std::string, unsigned>> &Pending;
+
+    // 为false时假定函数中没有赋值，变量的值不会改变，可以直接引用，不需要先复制到临时变量
+    // 遇到赋值时设置Restart，按有赋值的方式重新生成
+    bool Assign = false;
+    bool Restart = false;
+    bool Failed = false;
+
+    // 当前可见的变量和它们的切线，有赋值时切线都保存在变量'd<变量名>中
+    std::vector<std::pair<std::string, DiffAtom>> Scope;
+    // 在函数最外层声明的临时变量
+    std::vector<std::string> Temps;
+
+    Differentiator(ContextImpl &Ctx, std::set<std::pair<std::string, unsigned>> &Requested,
+                   std::vector<std::pair<std::string, unsigned>> &Pending)
+        : Ctx(Ctx), Requested(Requested), Pending(Pending) {}
+
+    std::string newName(char Kind) { return std::string("'") + Kind + std::to_string(NextName++); }
+    std::string newTemp() {
+        Temps.push_back(newName('t'));
+        return Temps.back();
+    }
+
+    DiffAtom lookup(const std::string &Name) const {
+        for (size_t I = Scope.size(); I > 0; --I) {
+            if (Scope[I - 1].first == Name) {
+                return Scope[I - 1].second;
+            }
+        }
+        // 名字解析已经检查过了
+        return {};
+    }
+
+    static std::unique_ptr<ExprAST> expr(const DiffAtom &A) {
+        if (A.Var.empty()) {
+            return std::make_unique<NumberExprAST>(A.Val);
+        }
+        return std::make_unique<VariableExprAST>(A.Var);
+    }
+    static std::unique_ptr<ExprAST> expr(DiffTerm T) {
+        return T.E ? std::move(T.E) : std::make_unique<NumberExprAST>(T.Val);
+    }
+    static DiffTerm term(const DiffAtom &A) {
+        return A.Var.empty() ? DiffTerm{nullptr, A.Val} : DiffTerm{expr(A)};
+    }
+    static DiffTerm term(double Val) { return {nullptr, Val}; }
+    static bool isConst(const DiffTerm &T, double Val) { return !T.E && T.Val == Val; }
+    static bool isZero(const DiffAtom &A) { return A.Var.empty() && A.Val == 0.0; }
+
+    static std::unique_ptr<ExprAST> assign(const std::string &Var, std::unique_ptr<ExprAST> E) {
+        return std::make_unique<BinaryExprAST>('=', std::make_unique<VariableExprAST>(Var),
+                                               std::move(E));
+    }
+
+    // 内置的二元运算，两边都是常量时直接算出来
+    static DiffTerm binary(char Op, DiffTerm L, DiffTerm R) {
+        if (!L.E && !R.E) {
+            double Ops[2] = {L.Val, R.Val};
+            switch (Op) {
+            case '+':
+                return term(Ops[0] + Ops[1]);
+            case '-':
+                return term(Ops[0] - Ops[1]);
+            case '*':
+                return term(Ops[0] * Ops[1]);
+            default:
+                return term(Ops[0] < Ops[1] ? 1.0 : 0.0);
+            }
+        }
+        if (Op == '+' && isConst(L, 0.0)) {
+            return R;
+        }
+        if ((Op == '+' || Op == '-') && isConst(R, 0.0)) {
+            return L;
+        }
+        if (Op == '*') {
+            // 切线是0的项直接去掉，不管另一个因子的值
+            if (isConst(L, 0.0) || isConst(R, 0.0)) {
+                return term(0.0);
+            }
+            if (isConst(L, 1.0)) {
+                return R;
+            }
+            if (isConst(R, 1.0)) {
+                return L;
+            }
+        }
+        return {std::make_unique<BinaryExprAST>(Op, expr(std::move(L)), expr(std::move(R)))};
+    }
+    static DiffTerm add(DiffTerm L, DiffTerm R) { return binary('+', std::move(L), std::move(R)); }
+    static DiffTerm sub(DiffTerm L, DiffTerm R) { return binary('-', std::move(L), std::move(R)); }
+    static DiffTerm mul(DiffTerm L, DiffTerm R) { return binary('*', std::move(L), std::move(R)); }
+
+    static DiffTerm intrinsic(const char *Name, DiffTerm A, DiffTerm B = {}) {
+        std::vector<std::unique_ptr<ExprAST>> Args;
+        Args.push_back(expr(std::move(A)));
+        const IntrinsicInfo *Info = LookupIntrinsic(Name);
+        if (Info->NumArgs == 2) {
+            Args.push_back(expr(std::move(B)));
+        }
+        return {std::make_unique<CallExprAST>(Name, std::move(Args), Info)};
+    }
+
+    // 子表达式的代码加入Binds，返回它的切线
+    DiffAtom bind(DiffValue &V, DiffBindings &Binds) {
+        if (!V.Code) {
+            return V.Tangent;
+        }
+        if (!V.TangentIsCode) {
+            Binds.emplace_back("'s", std::move(V.Code));
+            return V.Tangent;
+        }
+        std::string Name = newName('a');
+        Binds.emplace_back(Name, std::move(V.Code));
+        return {Name};
+    }
+
+    // 依次求值Binds，把PrimalE的值存进临时变量T，最后以Tangent作为切线
+    DiffValue finish(DiffBindings Binds, const std::string &T, std::unique_ptr<ExprAST> PrimalE,
+                     DiffTerm Tangent) {
+        Binds.emplace_back("'s", assign(T, std::move(PrimalE)));
+        DiffValue V;
+        V.Primal.Var = T;
+        if (Tangent.E) {
+            V.TangentIsCode = true;
+        } else {
+            V.Tangent.Val = Tangent.Val;
+        }
+        V.Code = std::make_unique<VarExprAST>(std::move(Binds), expr(std::move(Tangent)));
+        return V;
+    }
+
+    // Callee对第K个参数的偏导数函数的名字，第一次用到时加入Pending
+    std::string partial(const std::string &Callee, unsigned K, size_t NumArgs,
+                        SourceLocation Loc) {
+        FunctionAST *G = Ctx.findDefinition(Callee);
+        if (!G) {
+            Ctx.error(Diagnostic::SemanticError,
+                      Ctx.FunctionProtos.count(Callee) ? "Cannot differentiate extern function"
+                                                       : "Unknown function referenced",
+                      {Loc, Loc});
+            Failed = true;
+            return "";
+        }
+        if (G->getProto().getArgs().size() != NumArgs) {
+            Ctx.error(Diagnostic::SemanticError, "Incorrect # arguments passed", {Loc, Loc});
+            Failed = true;
+            return "";
+        }
+        if (Requested.insert({Callee, K}).second) {
+            Pending.push_back({Callee, K});
+        }
+        return Callee + "'" + std::to_string(K);
+    }
+
+    // 对自定义函数或运算符Callee的调用，MakePrimal用实参的原值构造原来的调用
+    template <typename Fn>
+    DiffValue call(const std::string &Callee, std::vector<DiffValue> Args, SourceLocation Loc,
+                   Fn MakePrimal) {
+        DiffBindings Binds;
+        std::vector<DiffAtom> Tangents;
+        for (auto &Arg : Args) {
+            Tangents.push_back(bind(Arg, Binds));
+        }
+        auto PrimalArgs = [&] {
+            std::vector<std::unique_ptr<ExprAST>> Ops;
+            for (auto &Arg : Args) {
+                Ops.push_back(expr(Arg.Primal));
+            }
+            return Ops;
+        };
+
+        // 链式法则: 各参数的偏导数乘以实参的切线再相加
+        DiffTerm Sum = term(0.0);
+        for (unsigned K = 0; K != Args.size(); ++K) {
+            if (isZero(Tangents[K])) {
+                continue;
+            }
+            std::string Name = partial(Callee, K, Args.size(), Loc);
+            auto Partial = std::make_unique<CallExprAST>(Name, PrimalArgs());
+            Partial->setLoc(Loc);
+            Sum = add(std::move(Sum), mul({std::move(Partial)}, term(Tangents[K])));
+        }
+
+        std::unique_ptr<ExprAST> Primal = MakePrimal(PrimalArgs());
+        Primal->setLoc(Loc);
+        return finish(std::move(Binds), newTemp(), std::move(Primal), std::move(Sum));
+    }
+
+    // 生成F对第Arg个参数的偏导数的body，出错时返回nullptr
+    std::unique_ptr<ExprAST> run(const FunctionAST &F, unsigned Arg);
+};
+
+DiffValue NumberExprAST::diff(Differentiator &) const {
+    DiffValue V;
+    V.Primal.Val = Val;
+    return V;
+}
+
+DiffValue VariableExprAST::diff(Differentiator &D) const {
+    DiffValue V;
+    if (!D.Assign) {
+        V.Primal.Var = Name;
+        V.Tangent = D.lookup(Name);
+        return V;
+    }
+
+    // 之后的赋值可能改变变量的值，先复制一份
+    DiffBindings Binds;
+    std::string T = D.newTemp();
+    return D.finish(std::move(Binds), T, std::make_unique<VariableExprAST>(Name),
+                    D.term(D.lookup(Name)));
+}
+
+DiffValue UnaryExprAST::diff(Differentiator &D) const {
+    std::vector<DiffValue> Args;
+    Args.push_back(Operand->diff(D));
+    return D.call(std::string("unary") + Opcode, std::move(Args), Loc, [&](auto Ops) {
+        return std::make_unique<UnaryExprAST>(Opcode, std::move(Ops[0]));
+    });
+}
+
+DiffValue BinaryExprAST::diff(Differentiator &D) const {
+    if (Op == '=') {
+        if (!D.Assign) {
+            D.Restart = true;
+            return {};
+        }
+        auto *LHSE = static_cast<VariableExprAST *>(LHS.get());
+        DiffValue R = RHS->diff(D);
+        DiffBindings Binds;
+        DiffAtom Tangent = D.bind(R, Binds);
+        // 变量和它的切线一起更新
+        Binds.emplace_back("'s", D.assign(D.lookup(LHSE->getName()).Var, D.expr(Tangent)));
+        std::string T = D.newTemp();
+        return D.finish(std::move(Binds), T, D.assign(LHSE->getName(), D.expr(R.Primal)),
+                        D.term(Tangent));
+    }
+
+    std::vector<DiffValue> Args;
+    Args.push_back(LHS->diff(D));
+    Args.push_back(RHS->diff(D));
+    if (Op != '+' && Op != '-' && Op != '*' && Op != '<') {
+        return D.call(std::string("binary") + Op, std::move(Args), Loc, [&](auto Ops) {
+            return std::make_unique<BinaryExprAST>(Op, std::move(Ops[0]), std::move(Ops[1]));
+        });
+    }
+
+    DiffBindings Binds;
+    DiffAtom DL = D.bind(Args[0], Binds);
+    DiffAtom DR = D.bind(Args[1], Binds);
+    const DiffAtom &L = Args[0].Primal, &R = Args[1].Primal;
+    DiffTerm Tangent;
+    switch (Op) {
+    case '+':
+        Tangent = D.add(D.term(DL), D.term(DR));
+        break;
+    case '-':
+        Tangent = D.sub(D.term(DL), D.term(DR));
+        break;
+    case '*':
+        Tangent = D.add(D.mul(D.term(DL), D.term(R)), D.mul(D.term(L), D.term(DR)));
+        break;
+    default:
+        // 比较的结果是分段常数，导数是0
+        Tangent = D.term(0.0);
+        break;
+    }
+    auto Primal = std::make_unique<BinaryExprAST>(Op, D.expr(L), D.expr(R));
+    Primal->setLoc(Loc);
+    std::string T = D.newTemp();
+    return D.finish(std::move(Binds), T, std::move(Primal), std::move(Tangent));
+}
+
+DiffValue CallExprAST::diff(Differentiator &D) const {
+    std::vector<DiffValue> ArgVals;
+    for (auto &Arg : Args) {
+        ArgVals.push_back(Arg->diff(D));
+    }
+    if (!Intrinsic) {
+        return D.call(Callee, std::move(ArgVals), Loc, [&](auto Ops) {
+            return std::make_unique<CallExprAST>(Callee, std::move(Ops));
+        });
+    }
+
+    DiffBindings Binds;
+    DiffAtom DU = D.bind(ArgVals[0], Binds);
+    DiffAtom DV = Args.size() > 1 ? D.bind(ArgVals[1], Binds) : DiffAtom{};
+    const DiffAtom &U = ArgVals[0].Primal;
+    const DiffAtom V = Args.size() > 1 ? ArgVals[1].Primal : DiffAtom{};
+    // 结果所在的临时变量，求导法则中可以直接用
+    std::string T = D.newTemp();
+    DiffAtom Result{T};
+    auto Inverse = [&](DiffTerm X) { return D.intrinsic("pow", std::move(X), D.term(-1.0)); };
+
+    DiffTerm Tangent;
+    switch (Intrinsic->ID) {
+    case intr_sin:
+        Tangent = D.mul(D.intrinsic("cos", D.term(U)), D.term(DU));
+        break;
+    case intr_cos:
+        Tangent = D.mul(D.sub(D.term(0.0), D.intrinsic("sin", D.term(U))), D.term(DU));
+        break;
+    case intr_tan:
+        Tangent = D.mul(D.add(D.term(1.0), D.mul(D.term(Result), D.term(Result))), D.term(DU));
+        break;
+    case intr_sqrt:
+        Tangent = D.mul(D.mul(D.term(0.5), Inverse(D.term(Result))), D.term(DU));
+        break;
+    case intr_fabs:
+        // 符号函数，0处取0
+        Tangent = D.mul(D.sub(D.binary('<', D.term(0.0), D.term(U)),
+                              D.binary('<', D.term(U), D.term(0.0))),
+                        D.term(DU));
+        break;
+    case intr_exp:
+        Tangent = D.mul(D.term(Result), D.term(DU));
+        break;
+    case intr_log:
+        Tangent = D.mul(Inverse(D.term(U)), D.term(DU));
+        break;
+    case intr_floor:
+    case intr_ceil:
+        Tangent = D.term(0.0);
+        break;
+    case intr_pow:
+        // 指数的切线是0时没有log(u)这一项，底数是负数时也有意义
+        Tangent = D.mul(D.mul(D.term(V), D.intrinsic("pow", D.term(U),
+                                                      D.sub(D.term(V), D.term(1.0)))),
+                        D.term(DU));
+        if (!D.isZero(DV)) {
+            Tangent = D.add(std::move(Tangent),
+                            D.mul(D.mul(D.term(Result), D.intrinsic("log", D.term(U))),
+                                  D.term(DV)));
+        }
+        break;
+    case intr_atan2:
+        // atan2(y, x)的导数是(x*dy - y*dx) / (x*x + y*y)
+        Tangent = D.mul(D.sub(D.mul(D.term(V), D.term(DU)), D.mul(D.term(U), D.term(DV))),
+                        Inverse(D.add(D.mul(D.term(U), D.term(U)),
+                                      D.mul(D.term(V), D.term(V)))));
+        break;
+    case intr_fmin:
+    case intr_fmax: {
+        // 取到哪个参数就是哪个参数的切线，一个参数是NaN时取到的是另一个
+        // U是NaN时和任何数比较都是0，这时(U < inf) + (-inf < U)是0，否则至少是1
+        DiffTerm UIsNaN = D.sub(
+            D.term(1.0),
+            D.intrinsic("fmin", D.term(1.0),
+                        D.add(D.binary('<', D.term(U), D.term(HUGE_VAL)),
+                              D.binary('<', D.term(-HUGE_VAL), D.term(U)))));
+        DiffTerm PickV = Intrinsic->ID == intr_fmin ? D.binary('<', D.term(V), D.term(U))
+                                                     : D.binary('<', D.term(U), D.term(V));
+        PickV = D.add(std::move(PickV), std::move(UIsNaN));
+        Tangent = D.add(D.term(DU),
+                        D.mul(std::move(PickV), D.sub(D.term(DV), D.term(DU))));
+        break;
+    }
+    }
+
+    std::vector<std::unique_ptr<ExprAST>> Ops;
+    Ops.push_back(D.expr(U));
+    if (Args.size() > 1) {
+        Ops.push_back(D.expr(V));
+    }
+    auto Primal = std::make_unique<CallExprAST>(Callee, std::move(Ops), Intrinsic);
+    Primal->setLoc(Loc);
+    return D.finish(std::move(Binds), T, std::move(Primal), std::move(Tangent));
+}
+
+DiffValue MapExprAST::diff(Differentiator &D) const {
+    DiffBindings Binds;
+    std::vector<std::unique_ptr<ExprAST>> Primals;
+    for (auto &E : Range) {
+        DiffValue V = E->diff(D);
+        // 范围随参数变化时还需要被map的函数的导数，不支持；范围不变时导数是0
+        if (!D.isZero(D.bind(V, Binds))) {
+            D.Ctx.error(Diagnostic::SemanticError, "Cannot differentiate map over a varying range",
+                        {Loc, Loc});
+            D.Failed = true;
+            return {};
+        }
+        Primals.push_back(D.expr(V.Primal));
+    }
+    auto Primal = std::make_unique<MapExprAST>(Builtin, Callee, std::move(Primals[0]),
+                                               std::move(Primals[1]), std::move(Primals[2]));
+    Primal->setLoc(Loc);
+    return D.finish(std::move(Binds), D.newTemp(), std::move(Primal), D.term(0.0));
+}
+
+DiffValue VarExprAST::diff(Differentiator &D) const {
+    size_t OldScope = D.Scope.size();
+    DiffBindings Binds;
+    for (auto &Var : VarNames) {
+        DiffValue Init = Var.second ? Var.second->diff(D) : DiffValue{};
+        DiffAtom Tangent = D.bind(Init, Binds);
+        Binds.emplace_back(Var.first, D.expr(Init.Primal));
+        if (D.Assign) {
+            std::string Shadow = "'d" + Var.first;
+            Binds.emplace_back(Shadow, D.expr(Tangent));
+            D.Scope.push_back({Var.first, {Shadow}});
+        } else {
+            D.Scope.push_back({Var.first, Tangent});
+        }
+    }
+
+    // Body的原值和切线可能引用这里声明的变量，都复制出来
+    DiffValue B = Body->diff(D);
+    D.Scope.resize(OldScope);
+    DiffAtom Tangent = D.bind(B, Binds);
+    std::string T = D.newTemp();
+    return D.finish(std::move(Binds), T, D.expr(B.Primal), D.term(Tangent));
+}
+
+std::unique_ptr<ExprAST> Differentiator::run(const FunctionAST &F, unsigned Arg) {
+    const auto &Params = F.getProto().getArgs();
+    for (bool WithAssign : {false, true}) {
+        Assign = WithAssign;
+        Restart = false;
+        Scope.clear();
+        Temps.clear();
+
+        // 参数的切线: 求导的那个参数是1，其他的是0
+        DiffBindings Binds;
+        for (unsigned I = 0; I != Params.size(); ++I) {
+            DiffAtom Seed{"", I == Arg ? 1.0 : 0.0};
+            if (Assign) {
+                std::string Shadow = "'d" + Params[I];
+                Binds.emplace_back(Shadow, expr(Seed));
+                Scope.push_back({Params[I], {Shadow}});
+            } else {
+                Scope.push_back({Params[I], Seed});
+            }
+        }
+
+        DiffValue Body = F.getBody().diff(*this);
+        if (Failed) {
+            return nullptr;
+        }
+        if (Restart) {
+            continue;
+        }
+        for (const std::string &T : Temps) {
+            Binds.emplace_back(T, nullptr);
+        }
+        DiffAtom Tangent = bind(Body, Binds);
+        if (Binds.empty()) {
+            return expr(Tangent);
+        }
+        return std::make_unique<VarExprAST>(std::move(Binds), expr(Tangent));
+    }
+    return nullptr;
+}
+
+// Name是否是词法分析得到的tok_identifier，不包括关键字
+static bool IsIdentifier(const std::string &Name) {
+    static const char *const Keywords[] = {"def", "extern", "var", "in", "binary", "unary"};
+    if (Name.empty() || !isalpha((unsigned char)Name[0]) ||
+        !std::all_of(Name.begin(), Name.end(), [](char C) { return isalnum((unsigned char)C); })) {
+        return false;
+    }
+    return std::none_of(std::begin(Keywords), std::end(Keywords),
+                        [&](const char *K) { return Name == K; });
+}
+
+bool ContextImpl::differentiate(const std::string &Name, const std::string &Arg,
+                                const std::string &DerivName) {
+    PhaseTimer Timer(Stats, phase_ad);
+    FunctionAST *F = findDefinition(Name);
+    if (!F) {
+        error(Diagnostic::SemanticError, "Unknown function referenced");
+        return false;
+    }
+    const auto &Params = F->getProto().getArgs();
+    auto It = std::find(Params.begin(), Params.end(), Arg);
+    if (It == Params.end()) {
+        error(Diagnostic::SemanticError, "Unknown argument name");
+        return false;
+    }
+    // 和解析定义时一样，名字只能是普通的标识符，不能是运算符，内置函数也不能被重新定义
+    // 生成的偏导数函数名中有'，不会和它重名
+    if (!IsIdentifier(DerivName)) {
+        error(Diagnostic::SemanticError, "Expected function name");
+        return false;
+    }
+    if (LookupIntrinsic(DerivName) || LookupMapBuiltin(DerivName)) {
+        error(Diagnostic::SemanticError, "Cannot redefine intrinsic function");
+        return false;
+    }
+
+    // 要生成的函数: (名字, 原函数, 参数的序号)，生成过程中用到的偏导数函数依次追加在后面
+    std::vector<std::tuple<std::string, std::string, unsigned>> Work;
+    Work.emplace_back(DerivName, Name, It - Params.begin());
+    std::set<std::pair<std::string, unsigned>> Requested;
+    std::vector<std::pair<std::string, unsigned>> Pending;
+    std::vector<std::shared_ptr<FunctionAST>> Generated;
+    std::set<std::string> GeneratedNames;
+    for (size_t I = 0; I != Work.size(); ++I) {
+        // 循环中会向Work追加，先把这一项拷贝出来
+        std::string NewName, Source;
+        unsigned K;
+        std::tie(NewName, Source, K) = Work[I];
+        // 两个生成的函数重名时后一个会覆盖前一个
+        if (!GeneratedNames.insert(NewName).second) {
+            error(Diagnostic::SemanticError, "Derivative name conflicts with a generated function");
+            return false;
+        }
+        FunctionAST *G = findDefinition(Source);
+        if (!resolveDeferred(*G)) {
+            return false;
+        }
+
+        Differentiator D(*this, Requested, Pending);
+        auto Body = D.run(*G, K);
+        if (!Body) {
+            return false;
+        }
+        auto Proto = std::make_unique<PrototypeAST>(NewName, G->getProto().getArgs());
+        Generated.push_back(std::make_shared<FunctionAST>(std::move(Proto), std::move(Body)));
+        for (auto &P : Pending) {
+            Work.emplace_back(P.first + "'" + std::to_string(P.second), P.first, P.second);
+        }
+        Pending.clear();
+    }
+
+    // 全部生成成功之后才加入函数表，出错时函数表不变
+    // 先全部加入再做名字解析，参数个数按新生成的定义检查
+    for (auto &G : Generated) {
+        addDefinition(G);
+    }
+    Stats.add(cnt_ad_derivatives, Generated.size());
+    bool OK = true;
+    for (auto &G : Generated) {
+        OK &= resolve(*G);
+    }
+    return OK;
+}
+
+//=========
+// Binary AST format
+//=========
+
+// 把解析好的AST保存成紧凑的二进制格式，之后直接读取，不需要重新词法分析和语法分析
+//
+// file  ::= "KAST" u32:version u32:nstrings string* u32:nitems item*
+// string::= u32:len byte*
+// item  ::= 'E' proto | 'D' proto expr
+// proto ::= u32:name u8:isoperator u32:precedence u32:nargs u32:argname*
+// expr  ::= 'N' f64 | 'V' u32:name | 'U' u8:op expr | 'B' u8:op expr expr
+//         | 'C' u32:callee u32:nargs expr* | 'L' u32:nvars (u32:name u8:hasinit expr?)* expr
+//         | 'M' u32:builtin u32:callee expr expr expr
+//
+// 名字都存放在字符串表中，用下标引用；所有整数都是小端序
+
+// 格式的版本，AST或者文件布局改变时需要递增
+static const uint32_t ASTFormatVersion = 2;
+static const char ASTMagic[4] = {'K', 'A', 'S', 'T'};
+
+class ASTWriter {
+    std::unordered_map<std::string, uint32_t> StringIDs;
+    std::vector<const std::string *> Strings;
+
+public:
+    // 字符串表之后的内容
+    std::string Items;
+
+    void writeU8(uint8_t V) { Items.push_back((char)V); }
+
+    void writeU32(uint32_t V) {
+        for (int I = 0; I != 4; ++I) {
+            Items.push_back((char)(V >> (8 * I)));
+        }
+    }
+
+    void writeF64(double V) {
+        uint64_t Bits;
+        memcpy(&Bits, &V, sizeof(Bits));
+        for (int I = 0; I != 8; ++I) {
+            Items.push_back((char)(Bits >> (8 * I)));
+        }
+    }
+
+    void writeString(const std::string &S) {
+        auto It = StringIDs.emplace(S, (uint32_t)Strings.size()).first;
+        if (It->second == Strings.size()) {
+            Strings.push_back(&It->first);
+        }
+        writeU32(It->second);
+    }
+
+    void writePrototype(const PrototypeAST &P) {
+        writeString(P.getName());
+        writeU8(P.isOperator());
+        writeU32(P.getBinaryPrecedence());
+        writeU32(P.getArgs().size());
+        for (const auto &Arg : P.getArgs()) {
+            writeString(Arg);
+        }
+    }
+
+    // 返回完整的文件内容
+    std::string finish(uint32_t NumItems) {
+        ASTWriter Header;
+        Header.Items.append(ASTMagic, sizeof(ASTMagic));
+        Header.writeU32(ASTFormatVersion);
+        Header.writeU32(Strings.size());
+        for (const std::string *S : Strings) {
+            Header.writeU32(S->size());
+            Header.Items += *S;
+        }
+        Header.writeU32(NumItems);
+        return Header.Items + Items;
+    }
+};
+
+// 从内存(通常是mmap的文件)中读取二进制AST，任何越界或者格式错误都会让Failed为true
+class ASTReader {
+    const unsigned char *Pos, *End;
+    std::vector<std::string> Strings;
+    // 和解析源码时一样限制表达式树的深度，0表示不限制
+    unsigned MaxDepth;
+    unsigned Depth = 0;
+
+    std::unique_ptr<ExprAST> readNode();
+
+public:
+    bool Failed = false;
+
+    ASTReader(const void *Data, size_t Size, unsigned MaxDepth)
+        : Pos(static_cast<const unsigned char *>(Data)), End(Pos + Size), MaxDepth(MaxDepth) {}
+
+    bool has(size_t N) {
+        if ((size_t)(End - Pos) < N) {
+            Failed = true;
+        }
+        return !Failed;
+    }
+
+    bool atEnd() const { return Pos == End; }
+
+    uint8_t readU8() { return has(1) ? *Pos++ : 0; }
+
+    uint32_t readU32() {
+        if (!has(4)) {
+            return 0;
+        }
+        uint32_t V = Pos[0] | (Pos[1] << 8) | (Pos[2] << 16) | ((uint32_t)Pos[3] << 24);
+        Pos += 4;
+        return V;
+    }
+
+    double readF64() {
+        if (!has(8)) {
+            return 0.0;
+        }
+        uint64_t Bits = 0;
+        for (int I = 7; I >= 0; --I) {
+            Bits = (Bits << 8) | Pos[I];
+        }
+        Pos += 8;
+        double V;
+        memcpy(&V, &Bits, sizeof(V));
+        return V;
+    }
+
+    const std::string &readString() {
+        static const std::string Empty;
+        uint32_t ID = readU32();
+        if (ID >= Strings.size()) {
+            Failed = true;
+            return Empty;
+        }
+        return Strings[ID];
+    }
+
+    // 读取文件头和字符串表，返回顶层项的个数
+    uint32_t readHeader() {
+        if (!has(sizeof(ASTMagic)) || memcmp(Pos, ASTMagic, sizeof(ASTMagic)) != 0) {
+            Failed = true;
+            return 0;
+        }
+        Pos += sizeof(ASTMagic);
+        if (readU32() != ASTFormatVersion) {
+            Failed = true;
+            return 0;
+        }
+
+        uint32_t NumStrings = readU32();
+        for (uint32_t I = 0; I != NumStrings && has(4); ++I) {
+            uint32_t Len = readU32();
+            if (!has(Len)) {
+                return 0;
+            }
+            Strings.emplace_back((const char *)Pos, Len);
+            Pos += Len;
+        }
+        return readU32();
+    }
+
+    std::unique_ptr<PrototypeAST> readPrototype() {
+        std::string Name = readString();
+        bool IsOperator = readU8();
+        unsigned Prec = readU32();
+        uint32_t NumArgs = readU32();
+        std::vector<std::string> Args;
+        for (uint32_t I = 0; I != NumArgs && has(4); ++I) {
+            Args.push_back(readString());
+        }
+        // 和ParsePrototype一样: 运算符的名字是unary或binary加上一个可以自定义的字符，参数个数和种类一致，
+        // 其他的名字是普通的标识符；否则定义会被放进参数个数不同的运算符表项
+        bool OperatorName =
+            (NumArgs == 1 && Name.size() == 6 && Name.compare(0, 5, "unary") == 0) ||
+            (NumArgs == 2 && Name.size() == 7 && Name.compare(0, 6, "binary") == 0);
+        if (Failed ||
+            (IsOperator ? !OperatorName || !IsOperatorChar(NumArgs, Name.back()) : !IsIdentifier(Name))) {
+            Failed = true;
+            return nullptr;
+        }
+        return std::make_unique<PrototypeAST>(Name, std::move(Args), IsOperator, Prec);
+    }
+
+    std::unique_ptr<ExprAST> readExpr();
+};
+
+// 读取是递归的，深度超过限制时在递归下去之前就失败
+std::unique_ptr<ExprAST> ASTReader::readExpr() {
+    if (MaxDepth && Depth >= MaxDepth) {
+        Failed = true;
+        return nullptr;
+    }
+    ++Depth;
+    auto E = readNode();
+    --Depth;
+    return E;
+}
+
+std::unique_ptr<ExprAST> ASTReader::readNode() {
+    switch (readU8()) {
+    case 'N':
+        return std::make_unique<NumberExprAST>(readF64());
+    case 'V':
+        return std::make_unique<VariableExprAST>(readString());
+    case 'U': {
+        char Op = readU8();
+        if (!isascii(Op)) {
+            Failed = true;
+            return nullptr;
+        }
+        auto Operand = readExpr();
+        if (!Operand) {
+            return nullptr;
+        }
+        return std::make_unique<UnaryExprAST>(Op, std::move(Operand));
+    }
+    case 'B': {
+        char Op = readU8();
+        if (!isascii(Op)) {
+            Failed = true;
+            return nullptr;
+        }
+        auto LHS = readExpr();
+        if (!LHS) {
+            return nullptr;
+        }
+        auto RHS = readExpr();
+        if (!RHS) {
+            return nullptr;
+        }
+        // 和解析时一样，赋值的左边必须是变量
+        if (Op == '=' && !dynamic_cast<VariableExprAST *>(LHS.get())) {
+            Failed = true;
+            return nullptr;
+        }
+        return std::make_unique<BinaryExprAST>(Op, std::move(LHS), std::move(RHS));
+    }
+    case 'C': {
+        std::string Callee = readString();
+        uint32_t NumArgs = readU32();
+        std::vector<std::unique_ptr<ExprAST>> Args;
+        for (uint32_t I = 0; I != NumArgs; ++I) {
+            auto Arg = readExpr();
+            if (!Arg) {
+                return nullptr;
+            }
+            Args.push_back(std::move(Arg));
+        }
+
+        // 内置函数按名字重新查找，不依赖IntrinsicID的具体取值；map只能是'M'节点
+        const IntrinsicInfo *Intr = LookupIntrinsic(Callee);
+        if ((Intr && Intr->NumArgs != NumArgs) || LookupMapBuiltin(Callee)) {
+            Failed = true;
+            return nullptr;
+        }
+        return std::make_unique<CallExprAST>(Callee, std::move(Args), Intr);
+    }
+    case 'M': {
+        const MapBuiltinInfo *M = LookupMapBuiltin(readString());
+        std::string Callee = readString();
+        if (!M) {
+            Failed = true;
+            return nullptr;
+        }
+        std::unique_ptr<ExprAST> Range[3];
+        for (auto &E : Range) {
+            E = readExpr();
+            if (!E) {
+                return nullptr;
+            }
+        }
+        return std::make_unique<MapExprAST>(M, Callee, std::move(Range[0]),
+                                            std::move(Range[1]), std::move(Range[2]));
+    }
+    case 'L': {
+        uint32_t NumVars = readU32();
+        std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+        for (uint32_t I = 0; I != NumVars && !Failed; ++I) {
+            std::string Name = readString();
+            std::unique_ptr<ExprAST> Init;
+            if (readU8()) {
+                Init = readExpr();
+                if (!Init) {
+                    return nullptr;
+                }
+            }
+            VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        }
+        auto Body = readExpr();
+        if (!Body) {
+            return nullptr;
+        }
+        return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    }
+    default:
+        Failed = true;
+        return nullptr;
+    }
+}
+
+void NumberExprAST::serialize(ASTWriter &W) const {
+    W.writeU8('N');
+    W.writeF64(Val);
+}
+
+void VariableExprAST::serialize(ASTWriter &W) const {
+    W.writeU8('V');
+    W.writeString(Name);
+}
+
+void UnaryExprAST::serialize(ASTWriter &W) const {
+    W.writeU8('U');
+    W.writeU8(Opcode);
+    Operand->serialize(W);
+}
+
+void BinaryExprAST::serialize(ASTWriter &W) const {
+    W.writeU8('B');
+    W.writeU8(Op);
+    LHS->serialize(W);
+    RHS->serialize(W);
+}
+
+void CallExprAST::serialize(ASTWriter &W) const {
+    W.writeU8('C');
+    W.writeString(Callee);
+    W.writeU32(Args.size());
+    for (auto &Arg : Args) {
+        Arg->serialize(W);
+    }
+}
+
+void MapExprAST::serialize(ASTWriter &W) const {
+    W.writeU8('M');
+    W.writeString(Builtin->Name);
+    W.writeString(Callee);
+    for (auto &E : Range) {
+        E->serialize(W);
+    }
+}
+
+void VarExprAST::serialize(ASTWriter &W) const {
+    W.writeU8('L');
+    W.writeU32(VarNames.size());
+    for (auto &Var : VarNames) {
+        W.writeString(Var.first);
+        W.writeU8(Var.second != nullptr);
+        if (Var.second) {
+            Var.second->serialize(W);
+        }
+    }
+    Body->serialize(W);
+}
+
+bool ContextImpl::saveAST(const std::string &Path) {
+    PhaseTimer T(Stats, phase_ast_save);
+    ASTWriter W;
+    for (auto &KV : FunctionProtos) {
+        W.writeU8('E');
+        W.writePrototype(*KV.second);
+    }
+    size_t NumDefs = 0;
+    for (auto &KV : Functions) {
+        // 只被调用过、还没有定义的函数也有表项
+        if (!KV.second.Def) {
+            continue;
+        }
+        // 还没有解析的定义先解析，有语法错误时不保存
+        if (!parseDeferred(*KV.second.Def)) {
+            return false;
+        }
+        W.writeU8('D');
+        W.writePrototype(KV.second.Def->getProto());
+        KV.second.Def->getBody().serialize(W);
+        ++NumDefs;
+    }
+    std::string Data = W.finish(FunctionProtos.size() + NumDefs);
+
+    std::string TmpPath = TempPathFor(Path);
+    FILE *F = fopen(TmpPath.c_str(), "wb");
+    if (!F) {
+        error(Diagnostic::EvalError, "Cannot open AST file for writing");
+        return false;
+    }
+    bool OK = fwrite(Data.data(), 1, Data.size(), F) == Data.size();
+    if (fclose(F) != 0 || !OK || rename(TmpPath.c_str(), Path.c_str()) != 0) {
+        remove(TmpPath.c_str());
+        error(Diagnostic::EvalError, "Cannot write AST file");
+        return false;
+    }
+    return true;
+}
+
+bool ContextImpl::loadAST(const std::string &Path) {
+    PhaseTimer T(Stats, phase_ast_load);
+    int FD = open(Path.c_str(), O_RDONLY);
+    if (FD < 0) {
+        error(Diagnostic::ParseError, "Cannot open AST file");
+        return false;
+    }
+
+    struct stat St;
+    if (fstat(FD, &St) != 0 || St.st_size == 0) {
+        close(FD);
+        error(Diagnostic::ParseError, "Invalid AST file");
+        return false;
+    }
+
+    // 直接映射整个文件，读取时不需要额外的拷贝
+    size_t Size = St.st_size;
+    void *Data = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, FD, 0);
+    close(FD);
+    if (Data == MAP_FAILED) {
+        error(Diagnostic::ParseError, "Cannot map AST file");
+        return false;
+    }
+
+    // 先完整读取再加入Context，文件损坏时不会留下一半的定义
+    ASTReader R(Data, Size, MaxExprDepth);
+    std::vector<std::unique_ptr<PrototypeAST>> Externs;
+    std::vector<std::shared_ptr<FunctionAST>> Defs;
+    uint32_t NumItems = R.readHeader();
+    for (uint32_t I = 0; I != NumItems && !R.Failed; ++I) {
+        uint8_t Kind = R.readU8();
+        auto Proto = R.readPrototype();
+        if (!Proto) {
+            break;
+        }
+
+        // 和解析源码时同样的检查: 二元运算符的优先级在1..100之间，内置函数不能被定义，
+        // extern内置函数时参数个数必须一致
+        const std::string &Name = Proto->getName();
+        const IntrinsicInfo *Intr = LookupIntrinsic(Name);
+        unsigned Prec = Proto->getBinaryPrecedence();
+        if ((Proto->isBinaryOp() && (Prec < 1 || Prec > 100)) || LookupMapBuiltin(Name) ||
+            (Kind == 'D' && Intr) ||
+            (Kind == 'E' && Intr && Proto->getArgs().size() != Intr->NumArgs)) {
+            R.Failed = true;
+            break;
+        }
+
+        if (Kind == 'E') {
+            Externs.push_back(std::move(Proto));
+        } else if (Kind == 'D') {
+            if (auto Body = R.readExpr()) {
+                Defs.push_back(std::make_shared<FunctionAST>(std::move(Proto),
+                                                             std::move(Body)));
+            }
+        } else {
+            R.Failed = true;
+        }
+    }
+    bool OK = !R.Failed && R.atEnd();
+    munmap(Data, Size);
+
+    if (!OK) {
+        error(Diagnostic::ParseError, "Invalid AST file");
+        return false;
+    }
+
+    for (auto &Proto : Externs) {
+        std::string Name = Proto->getName();
+        FunctionProtos[Name] = std::move(Proto);
+    }
+
+    // 文件中的定义和解析出来的一样要经过名字解析，有错误时整个文件都不加入
+    for (auto &F : Defs) {
+        if (!LazyDefinitions && !resolve(*F)) {
+            return false;
+        }
+    }
+    for (auto &F : Defs) {
+        // 和解析定义时一样注册二元运算符的优先级
+        const PrototypeAST &Proto = F->getProto();
+        if (Proto.isBinaryOp()) {
+            setPrecedence(Proto.getOperatorName(), Proto.getBinaryPrecedence());
+        }
+        addDefinition(std::move(F));
+    }
+    return true;
+}
+
+//=========
+// Top-Level parsing
+//=========
+
+ContextImpl::ContextImpl() {
+    // 1是最低的优先级
+    BinopPrecedence['='] = 2;
+    BinopPrecedence['<'] = 10;
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 30;
+    BinopPrecedence['*'] = 40;
+    setBackend(Backend::Tiered);
+}
+
+void ContextImpl::addDefinition(std::shared_ptr<FunctionAST> F) {
+    // 同名的定义会覆盖之前的，已经绑定到这个表项的调用和运算符会调用新的定义
+    // 不需要重新解析或者编译调用者，只有它们的哈希需要重新计算
+    FunctionSlot &S = getSlot(F->getName());
+    F->setSlot(&S);
+    S.ProfileCalls = 0;
+    ++DefinitionEpoch;
+    // 后台编译的线程可能正在读这个表项
+    std::atomic_store(&S.Def, std::shared_ptr<FunctionAST>(std::move(F)));
+    invalidateHash(S);
+}
+
+bool ContextImpl::parseDeferred(FunctionAST &F) {
+    if (F.isParsed()) {
+        return true;
+    }
+
+    PhaseTimer T(Stats, phase_parse_definition);
+    Stats.add(cnt_parse_deferred);
+    const DeferredBody &D = F.getDeferredBody();
+    bool Consumed = false;
+    auto ReadBody = [&](std::string &Chunk) {
+        if (Consumed) {
+            return false;
+        }
+        Chunk = D.Source;
+        Consumed = true;
+        return true;
+    };
+
+    Lexer Lex(ReadBody, Stats);
+    Lex.setLocation(D.Loc);
+    Parser P(Lex, *this);
+    P.Precedence = D.Precedence.get();
+    P.getNextToken();
+    auto Body = P.ParseDeferredBody();
+    if (!Body) {
+        return false;
+    }
+    F.setBody(std::move(Body));
+    return true;
+}
+
+bool ContextImpl::call(FunctionAST &F, const double *Args, double &Result) {
+    PhaseTimer T(Stats, phase_eval);
+    if (Pool) {
+        ParallelPlanner P(*this);
+        P.planFunction(F);
+    }
+    Interpreter I(*this);
+    Result = F.call(I, Args);
+    return !I.Failed;
+}
+
+TopLevelItem ContextImpl::HandleDefinition(Parser &P) {
+    std::unique_ptr<FunctionAST> FnAST;
+    {
+        PhaseTimer T(Stats, phase_parse_definition);
+        FnAST = P.ParseDefination();
+    }
+
+    if (FnAST) {
+        // 名字解析出错时整个定义被丢弃，token已经读完了，不需要跳过
+        // 延迟解析时错误在第一次调用时才报告
+        if (!LazyDefinitions && !resolve(*FnAST)) {
+            return {TopLevelItem::Error, ""};
+        }
+        Stats.add(cnt_definitions);
+        TopLevelItem Item{TopLevelItem::Definition, FnAST->getName()};
+        addDefinition(std::move(FnAST));
+        return Item;
+    }
+
+    // 跳过这一项剩下的部分
+    P.synchronize();
+    return {TopLevelItem::Error, ""};
+}
+
+TopLevelItem ContextImpl::HandleExtern(Parser &P) {
+    std::unique_ptr<PrototypeAST> ProtoAST;
+    {
+        PhaseTimer T(Stats, phase_parse_extern);
+        ProtoAST = P.ParseExtern();
+    }
+
+    if (ProtoAST) {
+        Stats.add(cnt_externs);
+        TopLevelItem Item{TopLevelItem::Extern, ProtoAST->getName()};
+        FunctionProtos[Item.Name] = std::move(ProtoAST);
+        return Item;
+    }
+
+    // 跳过这一项剩下的部分
+    P.synchronize();
+    return {TopLevelItem::Error, ""};
+}
+
+TopLevelItem ContextImpl::HandleTopLevelExpresison(Parser &P) {
+    std::unique_ptr<FunctionAST> FnAST;
+    {
+        PhaseTimer T(Stats, phase_parse_toplevel);
+        FnAST = P.ParseTopLevelExpr();
+    }
+
+    if (FnAST) {
+        if (!resolve(*FnAST)) {
+            return {TopLevelItem::Error, ""};
+        }
+        Stats.add(cnt_toplevel_exprs);
+        TopLevelItem Item{TopLevelItem::Expression, ""};
+        if (!call(*FnAST, nullptr, Item.Value)) {
+            Item.K = TopLevelItem::Error;
+        }
+        return Item;
+    }
+
+    // 跳过这一项剩下的部分
+    P.synchronize();
+    return {TopLevelItem::Error, ""};
+}
+
+// top ::= definition | external | expresison | ';'
+bool ContextImpl::run(Lexer &Lex, const ItemHandler &OnItem) {
+    Parser P(Lex, *this);
+    P.getNextToken();
+
+    bool Success = true;
+    while (true) {
+        TopLevelItem Item;
+        switch (P.CurTok) {
+        case tok_eof:
+            return Success;
+        case ';':
+            P.getNextToken();
+            continue;
+        case tok_def:
+            Item = HandleDefinition(P);
+            break;
+        case tok_extern:
+            Item = HandleExtern(P);
+            break;
+        default:
+            Item = HandleTopLevelExpresison(P);
+            break;
+        }
+
+        if (Item.K == TopLevelItem::Error) {
+            Success = false;
+        }
+        if (OnItem) {
+            OnItem(Item);
+        }
+    }
+}
+
+// 和run()一样按顶层项解析，但是不记录定义和extern，也不求值
+// 延迟解析的定义马上解析保存的body，同时检查跳过body和真正解析body这两条路径
+bool ContextImpl::parse(Lexer &Lex) {
+    Parser P(Lex, *this);
+    P.getNextToken();
+
+    bool Success = true;
+    while (true) {
+        switch (P.CurTok) {
+        case tok_eof:
+            return Success;
+        case ';':
+            P.getNextToken();
+            continue;
+        case tok_def: {
+            std::unique_ptr<FunctionAST> FnAST;
+            {
+                PhaseTimer T(Stats, phase_parse_definition);
+                FnAST = P.ParseDefination();
+            }
+            if (!FnAST) {
+                P.synchronize();
+                Success = false;
+            } else if (!parseDeferred(*FnAST)) {
+                // body的token已经读完了，不需要跳过
+                Success = false;
+            }
+            break;
+        }
+        case tok_extern: {
+            PhaseTimer T(Stats, phase_parse_extern);
+            if (!P.ParseExtern()) {
+                P.synchronize();
+                Success = false;
+            }
+            break;
+        }
+        default: {
+            PhaseTimer T(Stats, phase_parse_toplevel);
+            if (!P.ParseTopLevelExpr()) {
+                P.synchronize();
+                Success = false;
+            }
+            break;
+        }
+        }
+    }
+}
+
+//=========
+// Library interface
+//=========
+
+size_t countTokens(const std::string &Source) {
+    bool Consumed = false;
+    auto ReadAll = [&](std::string &Chunk) {
+        if (Consumed) {
+            return false;
+        }
+        Consumed = true;
+        Chunk += Source;
+        return true;
+    };
+
+    Statistics Stats;
+    Lexer Lex(ReadAll, Stats);
+    size_t N = 0;
+    while (Lex.gettok() != tok_eof) {
+        ++N;
+    }
+    return N;
+}
+
+static const char *const BackendNames[] = {"interp", "tiered", "compiled"};
+
+const char *getBackendName(Backend B) { return BackendNames[(int)B]; }
+
+bool parseBackend(const std::string &Name, Backend &B) {
+    for (int K = 0; K != 3; ++K) {
+        if (Name == BackendNames[K]) {
+            B = (Backend)K;
+            return true;
+        }
+    }
+    return false;
+}
+
+const std::string &Function::getName() const { return Fn->getName(); }
+
+size_t Function::getNumArgs() const { return Fn->getProto().getArgs().size(); }
+
+bool Function::call(const std::vector<double> &Args, double &Result) const {
+    if (Args.size() != getNumArgs()) {
+        Impl->error(Diagnostic::EvalError, "Incorrect # arguments passed");
+        return false;
+    }
+    return Impl->call(*Fn, Args.data(), Result);
+}
+
+bool Function::evaluateBatch(const double *const *Columns, size_t Rows,
+                             double *Out) const {
+    return Impl->Exec->evaluateBatch(*Fn, Columns, Rows, Out);
+}
+
+bool Function::map(double Start, double End, double Step, std::vector<double> &Out) const {
+    double Unused;
+    return Impl->map(*Fn, Start, End, Step, Reduction::Sum, &Out, Unused);
+}
+
+bool Function::reduce(Reduction R, double Start, double End, double Step,
+                      double &Result) const {
+    return Impl->map(*Fn, Start, End, Step, R, nullptr, Result);
+}
+
+Context::Context() : Impl(std::make_unique<ContextImpl>()) {}
+
+Context::~Context() = default;
+
+bool Context::eval(const std::string &Source, std::vector<double> *Results) {
+    // 整段源码一次性交给Lexer
+    bool Consumed = false;
+    auto ReadAll = [&](std::string &Chunk) {
+        if (Consumed) {
+            return false;
+        }
+        Consumed = true;
+        Chunk += Source;
+        return true;
+    };
+    Lexer Lex(ReadAll, Impl->Stats);
+
+    return Impl->run(Lex, [&](const TopLevelItem &Item) {
+        if (Results && Item.K == TopLevelItem::Expression) {
+            Results->push_back(Item.Value);
+        }
+    });
+}
+
+bool Context::eval(const SourceReader &Reader, const ItemHandler &OnItem) {
+    Lexer Lex(Reader, Impl->Stats);
+    return Impl->run(Lex, OnItem);
+}
+
+bool Context::parse(const std::string &Source) {
+    bool Consumed = false;
+    auto ReadAll = [&](std::string &Chunk) {
+        if (Consumed) {
+            return false;
+        }
+        Consumed = true;
+        Chunk += Source;
+        return true;
+    };
+    Lexer Lex(ReadAll, Impl->Stats);
+    return Impl->parse(Lex);
+}
+
+bool Context::parse(const SourceReader &Reader) {
+    Lexer Lex(Reader, Impl->Stats);
+    return Impl->parse(Lex);
+}
+
+Function Context::getFunction(const std::string &Name) const {
+    auto It = Impl->Functions.find(Name);
+    if (It == Impl->Functions.end() || !It->second.Def) {
+        return Function();
+    }
+    return Function(Impl.get(), It->second.Def);
+}
+
+const std::vector<Diagnostic> &Context::getDiagnostics() const {
+    return Impl->Diags;
+}
+
+void Context::clearDiagnostics() { Impl->Diags.clear(); }
+
+void Context::setCacheDirectory(const std::string &Dir) { Impl->CacheDir = Dir; }
+
+void Context::setMaxExpressionDepth(unsigned Depth) { Impl->MaxExprDepth = Depth; }
+
+void Context::setTierThreshold(unsigned Calls) { Impl->TierThreshold = Calls; }
+
+void Context::setLazyDefinitions(bool Lazy) { Impl->LazyDefinitions = Lazy; }
+
+void Context::setBackend(Backend B) { Impl->setBackend(B); }
+
+Backend Context::getBackend() const { return Impl->Kind; }
+
+void Context::setParallelEvaluation(unsigned Threads) {
+    Impl->Pool = Threads > 1 ? std::make_unique<TaskPool>(Threads - 1) : nullptr;
+}
+
+bool Context::saveProfile(const std::string &Path) { return Impl->saveProfile(Path); }
+
+bool Context::loadProfile(const std::string &Path) { return Impl->loadProfile(Path); }
+
+bool Context::differentiate(const std::string &Name, const std::string &Arg,
+                            const std::string &DerivName) {
+    return Impl->differentiate(Name, Arg, DerivName);
+}
+
+bool Context::saveAST(const std::string &Path) { return Impl->saveAST(Path); }
+
+bool Context::loadAST(const std::string &Path) { return Impl->loadAST(Path); }
+
+void Context::enableStatistics(bool Enable) { Impl->Stats.Enabled = Enable; }
+
+void Context::resetStatistics() { Impl->Stats.reset(); }
+
+std::string Context::getStatisticsReport(bool Timers, bool Counters) const {
+    return Impl->Stats.report(Timers, Counters);
+}
+
+std::string Context::getStatisticsJSON() const { return Impl->Stats.json(); }
+
+} // end namespace kaleidoscope
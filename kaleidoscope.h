@@ -0,0 +1,216 @@
+#ifndef KALEIDOSCOPE_H
+#define KALEIDOSCOPE_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Kaleidoscope的库接口，可以直接嵌入到其他程序中使用
+//
+//   kaleidoscope::Context Ctx;
+//   Ctx.eval("def f(x y) x*x + y;");
+//   double Result;
+//   if (Ctx.getFunction("f").call({3, 4}, Result)) { ... }
+//
+// 一个Context在同一时刻只能被一个线程使用，不同的Context之间互不影响
+
+namespace kaleidoscope {
+
+class ContextImpl;
+class FunctionAST;
+
+// 源码中的位置，行和列都从1开始
+// Line为0表示没有位置信息，例如从二进制AST文件读入的表达式
+struct SourceLocation {
+    unsigned Line = 0;
+    unsigned Col = 0;
+};
+
+// 源码中的一段，End是最后一个字符之后的位置
+struct SourceRange {
+    SourceLocation Begin;
+    SourceLocation End;
+};
+
+// 诊断信息，代替直接往stderr打印
+struct Diagnostic {
+    enum Kind {
+        ParseError,    // 语法错误，对应的顶层项被跳过，直到下一个def、extern或';'
+        SemanticError, // 未定义的变量或者参数个数不对，对应的顶层项被丢弃
+        EvalError      // 执行时的错误，对应的求值没有结果
+    };
+
+    Kind K;
+    std::string Message;
+    // 语法错误是出错的token，名字解析的错误是出错的名字
+    // 执行时的错误是出错的表达式的位置(Begin和End相同)
+    SourceRange Range;
+};
+
+// 一个顶层项(定义、extern或者表达式)处理完之后的结果
+struct TopLevelItem {
+    enum Kind { Definition, Extern, Expression, Error };
+
+    Kind K;
+    std::string Name;   // 定义和extern的函数名
+    double Value = 0.0; // 表达式的值
+};
+
+// 按需读取更多的源码，追加到Chunk后面，没有更多输入时返回false
+using SourceReader = std::function<bool(std::string &Chunk)>;
+// 每处理完一个顶层项调用一次
+using ItemHandler = std::function<void(const TopLevelItem &Item)>;
+
+// 数据并行的map把各个结果归约成一个值的方式
+// Min和Max和内置的fmin、fmax一样忽略NaN，没有任何结果时分别是0、+inf和-inf
+enum class Reduction { Sum, Min, Max };
+
+// 执行函数调用的后端，可以随时切换，各后端的结果和诊断信息都逐位相同
+// 唯一的例外是NaN: 结果同样是NaN，但符号和payload可能不同(比如向量化的批量求值)
+//   Interpreter: 只用解释器，批量求值和map也逐行解释执行
+//   Tiered:      默认，先解释执行，调用次数达到setTierThreshold()的阈值之后在后台编译
+//   Compiled:    每个函数第一次被调用时就在当前线程编译，之后都执行编译结果，不能编译的函数解释执行
+enum class Backend { Interpreter, Tiered, Compiled };
+
+// 后端的名字"interp"、"tiered"和"compiled"，用于命令行选项等
+const char *getBackendName(Backend B);
+// 按名字查找后端，名字不对时返回false
+bool parseBackend(const std::string &Name, Backend &B);
+
+// 已定义函数的句柄
+// 句柄持有取得它时的那个定义，之后的重新定义不会影响已经取得的句柄
+class Function {
+    ContextImpl *Impl = nullptr;
+    std::shared_ptr<FunctionAST> Fn;
+
+    friend class Context;
+    Function(ContextImpl *Impl, std::shared_ptr<FunctionAST> Fn)
+        : Impl(Impl), Fn(std::move(Fn)) {}
+
+public:
+    Function() = default;
+
+    // 函数不存在时句柄为空
+    explicit operator bool() const { return Fn != nullptr; }
+
+    const std::string &getName() const;
+    size_t getNumArgs() const;
+
+    // 以Args为实参调用函数，成功时结果写入Result
+    // 参数个数不对或执行出错时返回false，错误记录在Context的诊断信息中
+    bool call(const std::vector<double> &Args, double &Result) const;
+
+    // 对Rows行输入批量求值，Columns[i]是第i个参数的输入列，结果写入Out
+    bool evaluateBatch(const double *const *Columns, size_t Rows,
+                       double *Out) const;
+
+    // 数据并行的map，函数只能有一个参数
+    // 对Start + k*Step (k = 0, 1, ...)中Step为正时小于End、为负时大于End的每个值求值，结果按顺序写入Out
+    // 和源码中的mapsum(f, start, end, step)等一样编译成批量求值程序，按块执行，
+    // 用setParallelEvaluation()打开并行求值时各块分给线程池；不能编译时逐个解释执行
+    // Step为0、范围中有NaN或者值太多时返回false
+    bool map(double Start, double End, double Step, std::vector<double> &Out) const;
+    // 同样的范围，结果按R归约成一个值；Sum按固定的分块和顺序相加，结果和线程数无关
+    bool reduce(Reduction R, double Start, double End, double Step, double &Result) const;
+};
+
+class Context {
+    std::unique_ptr<ContextImpl> Impl;
+
+public:
+    Context();
+    ~Context();
+
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+
+    // 处理一段完整的源码，定义和extern被记录下来，顶层表达式被求值
+    // 每个顶层表达式的值按顺序追加到Results中，出错的表达式没有值
+    // 过程中出现任何错误都返回false
+    bool eval(const std::string &Source, std::vector<double> *Results = nullptr);
+
+    // 和上面一样，但是源码由Reader按需提供，适合交互式的输入
+    bool eval(const SourceReader &Reader, const ItemHandler &OnItem);
+
+    // 只做语法分析: 定义和extern不被记录，表达式不求值，语法错误记录在诊断信息中
+    // 定义的自定义二元运算符的优先级照常注册，影响之后的源码；有语法错误时返回false
+    // 用于检查源码和对前端做fuzz测试，见bench/fuzz.cpp
+    bool parse(const std::string &Source);
+    bool parse(const SourceReader &Reader);
+
+    // 按名字取得已定义的函数，没有定义时返回空句柄
+    Function getFunction(const std::string &Name) const;
+
+    const std::vector<Diagnostic> &getDiagnostics() const;
+    void clearDiagnostics();
+
+    // 设置编译结果的磁盘缓存目录，目录需要已经存在
+    // 缓存按函数的结构哈希，不同进程之间可以共享，为空时不使用磁盘缓存
+    void setCacheDirectory(const std::string &Dir);
+
+    // 表达式树允许的最大深度，超过时报告语法错误，0表示不限制，默认是10000
+    // 执行时函数体的深度和调用层数合起来另有限制，超过时报告"Maximum call depth exceeded"
+    void setMaxExpressionDepth(unsigned Depth);
+
+    // 函数被调用多少次之后在后台线程中编译，之后的调用直接执行编译结果，默认是100
+    // 0表示只用解释器执行；结果和解释执行逐位相同(NaN见Backend)；只对Tiered后端有效
+    void setTierThreshold(unsigned Calls);
+
+    // 选择执行后端，默认是Tiered；切换时已经编译好的结果保留，Tiered和Compiled之间可以直接沿用
+    void setBackend(Backend B);
+    Backend getBackend() const;
+
+    // 为true时定义只解析原型，body只找到结束位置并保存源码，默认关闭
+    // body的语法分析和名字解析都推迟到第一次调用或者编译时，语法分析按定义时的运算符优先级进行，
+    // 之后重新定义运算符的优先级不影响已有的定义，结果和不延迟时一样
+    // 加载很大、但只用到其中少数函数的库时可以减少启动时间
+    // 这时body中的大部分错误不在定义时报告，而是在每次调用它时报告
+    // loadAST()读入的定义已经是语法树，只推迟名字解析
+    void setLazyDefinitions(bool Lazy);
+
+    // 解释执行时用Threads个线程(包括调用者的线程)并行求值，0和1表示关闭，默认关闭
+    // 调用的各个参数、二元运算的两个操作数之间没有依赖，按估计的开销都很大时交给线程池同时求值
+    // map也用同一个线程池
+    // 只有不给外层变量赋值的操作数才会并行，结果和诊断信息都和顺序求值时一样
+    // 交给其他线程的部分总是解释执行，不参与分层执行，也不计入saveProfile()的调用次数
+    void setParallelEvaluation(unsigned Threads);
+
+    // 把各函数被解释器调用的次数写入文件，之前用loadProfile()读入的次数合并在一起写入
+    // 出错时返回false并记录诊断信息
+    bool saveProfile(const std::string &Path);
+    // 读入saveProfile()写的文件，其中调用次数达到分层执行阈值的函数第一次被调用时
+    // 就在当前线程编译，不再先解释执行；函数或者它调用的函数修改之后旧的记录不再起作用
+    bool loadProfile(const std::string &Path);
+
+    // 自动微分: 定义一个新函数DerivName，计算函数Name对参数Arg的偏导数，参数和Name相同
+    // 直接变换语法树得到，和其他定义一样解释执行、批量求值或者编译
+    // 比较运算、floor和ceil的导数是0，fabs、fmin、fmax在不可导的点上取其中一侧的导数
+    // Name调用的函数和自定义运算符的偏导数函数一起生成，名字是原名加上'和参数的序号，
+    // 如g'0；它们都按照当前的定义生成，之后重新定义了其中的函数时需要重新调用
+    // DerivName必须是普通的标识符，不能是运算符或者内置函数
+    // 名字不对、调用了extern或者未定义的函数时返回false并记录诊断信息，这时不会定义任何函数
+    bool differentiate(const std::string &Name, const std::string &Arg,
+                       const std::string &DerivName);
+
+    // 把当前所有的定义和extern保存成二进制的AST文件
+    // 之后用loadAST()直接读取，不需要重新解析源码；出错时返回false并记录诊断信息
+    bool saveAST(const std::string &Path);
+    bool loadAST(const std::string &Path);
+
+    // 打开或关闭各阶段的计时和计数器，默认关闭
+    void enableStatistics(bool Enable = true);
+    void resetStatistics();
+    // 可读的报告，Timers对应各阶段的耗时，Counters对应计数器
+    std::string getStatisticsReport(bool Timers, bool Counters) const;
+    // 同样的内容，以JSON格式导出
+    std::string getStatisticsJSON() const;
+};
+
+// 只做词法分析，返回Source中token的个数，用于测试词法分析的性能
+size_t countTokens(const std::string &Source);
+
+} // end namespace kaleidoscope
+
+#endif
@@ -1,474 +1,605 @@
+// 交互式的Kaleidoscope解释器，从标准输入读取源码
+// 编译: g++ -O2 -std=c++17 -pthread toy.cpp kaleidoscope.cpp -o toy
+//
+// 选项:
+//   -time-passes        退出时打印各阶段的耗时
+//   -stats              退出时打印计数器
+//   -stats-json=<file>  退出时把计时和计数器以JSON格式写入文件
+//   -max-expr-depth=<N> 表达式树允许的最大深度，0表示不限制
+//   -tier-threshold=<N> 函数调用多少次之后在后台编译，0表示只解释执行，默认是100
+//   -backend=<name>     执行后端: interp(只解释执行)、tiered(默认，分层执行)或compiled(第一次调用时就编译)
+//   -lazy-defs          定义的body推迟到第一次调用时才解析，其中的错误也在调用时才报告
+//   -profile-in=<file>  读入之前保存的各函数调用次数，其中的热点函数第一次调用时就编译
+//   -profile-out=<file> 退出时把各函数的调用次数(包括-profile-in读入的)写入文件，服务模式下不写
+//   -parallel=<N>       用N个线程并行求值开销很大的调用参数、运算的操作数和mapsum等的各块，默认只用一个线程
+//   -server=<path>      不读标准输入，而是在Unix域套接字<path>上提供求值服务，收到SIGINT或SIGTERM时退出
+//   -workers=<N>        服务模式下处理请求的线程数，默认是CPU的核数
+
+#include "kaleidoscope.h"
+
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <utility>
+#include <thread>
 #include <vector>
 
-//=========
-// Lexer
-//=========
-
-// 如果是未知的字符Lexer返回在[0, 255]内的token，否则是已知的
-enum Token {
-    tok_eof = -1,
-
-    tok_def = -2,
-    tok_extern = -3,
-
-    tok_identifier = -4, // 标识符
-    tok_number = -5
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace kaleidoscope;
+
+struct Options {
+    bool TimePasses = false;
+    bool PrintStats = false;
+    const char *StatsJSON = nullptr;
+    long MaxExprDepth = -1;
+    long TierThreshold = -1;
+    Backend ExecBackend = Backend::Tiered;
+    bool LazyDefinitions = false;
+    const char *ProfileIn = nullptr;
+    const char *ProfileOut = nullptr;
+    unsigned ParallelThreads = 0;
+    const char *ServerPath = nullptr;
+    unsigned Workers = 0;
 };
 
-static std::string IdentifierStr;
-static double NumVal;
-
-// 从标准输入中返回下一个token
-static int gettok() {
-    static int LastChar = ' ';
-
-    // 跳过空格
-    while (isspace(LastChar)) {
-        LastChar = getchar();
+static void configure(Context &Ctx, const Options &Opts) {
+    Ctx.enableStatistics(Opts.TimePasses || Opts.PrintStats || Opts.StatsJSON);
+    if (Opts.MaxExprDepth >= 0) {
+        Ctx.setMaxExpressionDepth((unsigned)Opts.MaxExprDepth);
     }
-
-    // 不能以数字开头，但是后续的可以出现数字，因此只有最开始判断isalpha
-    // 实际中不允许以数字开头生命变量，可能也是这个原因，和第二部分的判断冲突
-    if (isalpha(LastChar)) {
-        IdentifierStr = LastChar;
-
-        // 拿到一个完整的字母数字组合
-        while (isalnum((LastChar = getchar()))) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-            IdentifierStr += LastChar;
-        }
-
-        if (IdentifierStr == "def") {
-            return tok_def;
-        }
-
-        if (IdentifierStr == "extern") {
-            return tok_extern;
-        }
-
-        return tok_identifier;
-    }
-
-    // 数组
-    if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-        std::string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
-
-        // 从数组开始的指针到空指针，即整个数组
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return tok_number;
+    if (Opts.TierThreshold >= 0) {
+        Ctx.setTierThreshold((unsigned)Opts.TierThreshold);
     }
-
-    // 注释
-    if (LastChar == '#') {
-        do {
-            LastChar = getchar();
-        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-        // 在编译阶段，注释会被编译器忽视，因此这个函数在读完注释这一行后，什么都不做
-        // 若还没有到文件末尾，则返回下一个token
-        if (LastChar != EOF) {
-            return gettok();
-        }
+    Ctx.setBackend(Opts.ExecBackend);
+    Ctx.setLazyDefinitions(Opts.LazyDefinitions);
+    Ctx.setParallelEvaluation(Opts.ParallelThreads);
+    if (Opts.ProfileIn && !Ctx.loadProfile(Opts.ProfileIn)) {
+        fprintf(stderr, "Cannot load profile %s\n", Opts.ProfileIn);
+        Ctx.clearDiagnostics();
     }
+}
 
-    if (LastChar == EOF) {
-        return tok_eof;
+static bool writeFile(const char *Path, const std::string &Data) {
+    FILE *F = fopen(Path, "w");
+    if (!F) {
+        fprintf(stderr, "Cannot open %s\n", Path);
+        return false;
     }
-
-    // 否则，返回字符的ascii码
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
+    fputs(Data.c_str(), F);
+    fclose(F);
+    return true;
 }
 
 //=========
-// Abstract Syntax Tree
+// Server mode
 //=========
 
-namespace {
-// 基类，派生出各种ExprAST，让后续步骤知道在处理什么
-class ExprAST {
-public:
-    virtual ~ExprAST() = default;
+// 服务模式的协议，一个连接上可以依次发送任意多个请求
+//   请求: "<namespace> <length>\n"，后面是length字节的源码
+//   响应: "<length>\n"，后面是length字节的结果，每个顶层项一行
+//     def <name>                    定义
+//     extern <name>                 extern声明
+//     value <v>                     顶层表达式的值
+//     error <line>:<col>: <message> 诊断信息，在出错的顶层项的位置，没有位置信息时是0:0
+// 每个namespace有自己的Context，定义在请求之间一直保留，编译好的批量求值程序也一直有效
+// 不同namespace的请求可以同时执行，同一个namespace的请求按到达的顺序依次执行
+
+static const size_t MaxRequestSize = 64 << 20;
+static const size_t MaxNamespaceLength = 64;
+// 服务进程中所有线程的栈大小，见Server::run()
+static const size_t ThreadStackSize = 16 << 20;
+
+// 一个namespace，Context同一时刻只能被一个线程使用
+struct Namespace {
+    std::mutex Lock;
+    Context Ctx;
 };
 
-class NumberExprAST : public ExprAST {
-    double Val;
-
-public:
-    NumberExprAST(double Val) : Val(Val) {}
+// 客户端的连接，In中是已经读到但还没有处理的数据
+struct Connection {
+    int Fd;
+    std::string In;
 };
 
-class VariableExprAST : public ExprAST {
-    std::string Name;
-public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
-};
+// 信号处理函数只能做很少的事情，这里只是记下来并唤醒主线程
+static volatile sig_atomic_t StopRequested = 0;
+static int SignalWakeFd = -1;
 
-class BinaryExprAST : public ExprAST {
-    char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
-public:
-    // std::move()将对象的值直接移动过去，而不是复制，避免额外的内存空间开销
-    BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
-                  std::unique_ptr<ExprAST> RHS)
-        : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-};
+static void onStopSignal(int) {
+    StopRequested = 1;
+    ssize_t Ignored = write(SignalWakeFd, "s", 1);
+    (void)Ignored;
+}
 
-class CallExprAST : public ExprAST {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
-public:
-    CallExprAST(const std::string &Callee,
-                std::vector<std::unique_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args)) {}
-};
+// 主线程用poll等待新连接和空闲连接上的数据，有数据的连接交给工作线程
+// 工作线程处理完其中完整的请求后把连接交还给主线程，因此一个连接同一时刻只在一个线程中
+class Server {
+    const Options &Opts;
+    int ListenFd = -1;
+    // 工作线程通过这个管道通知主线程有连接交还回来
+    int WakeFds[2] = {-1, -1};
 
-// 表示函数原型的一些信息
-class PrototypeAST {
-    std::string Name;
-    std::vector<std::string> Args;
+    std::mutex NamespacesLock;
+    std::map<std::string, std::unique_ptr<Namespace>> Namespaces;
 
-public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-        : Name(Name), Args(std::move(Args)) {}
-    
-    const std::string &getName() const { return Name; }
-};
+    // 有数据可读、等待工作线程处理的连接
+    std::mutex ReadyLock;
+    std::condition_variable ReadyCV;
+    std::deque<Connection *> Ready;
+    bool Stopping = false;
 
-class FunctionAST {
-    std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    // 工作线程处理完的连接，由主线程继续等待数据
+    std::mutex ReturnedLock;
+    std::vector<Connection *> Returned;
 
-public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                std::unique_ptr<ExprAST> Body)
-        : Proto(std::move(Proto)), Body(std::move(Body)) {}
-};
-}; // end anonymous namespace
+    Namespace &getNamespace(const std::string &Name);
+    std::string evaluate(const std::string &Name, const std::string &Source);
+    bool serve(Connection &C);
+    void work();
 
-// =========
-// Parser
-// =========
-
-// 提供一个简单的token缓冲区
-// CurTok表示当前paser正在处理的token，即当前需要paser的token
-// getNextToken()更新CurTok
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
+public:
+    explicit Server(const Options &Opts) : Opts(Opts) {}
+    ~Server();
 
-// 运算符的优先级
-static std::map<char, int> BinopPrecedence;
+    bool listen(const char *Path);
+    void run(unsigned NumWorkers);
+    void printStatistics();
+};
 
-// 获取运算符的优先级
-static int GetTokPrecedence() {
-    if (!isascii(CurTok)) { // 如果当前的token不是ascii码
-        return -1;
+Server::~Server() {
+    for (int Fd : {ListenFd, WakeFds[0], WakeFds[1]}) {
+        if (Fd >= 0) {
+            close(Fd);
+        }
     }
-
-    // 保证token是一个声明了的binop
-    int TokPrec = BinopPrecedence[CurTok];
-    // 如果不在map中
-    // 对于不是binop的运算符返回-1
-    if (TokPrec <= 0) {
-        return -1;
+    if (ListenFd >= 0) {
+        unlink(Opts.ServerPath);
     }
-
-    return TokPrec;
 }
 
-// 用于处理错误
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "LogError: %s\n", Str);
-    return nullptr;
-}
-
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-    LogError(Str);
-    return nullptr;
-}
-
-static std::unique_ptr<ExprAST> ParseExpression();
+bool Server::listen(const char *Path) {
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    if (strlen(Path) >= sizeof(Addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", Path);
+        return false;
+    }
+    strcpy(Addr.sun_path, Path);
 
-// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
-    getNextToken(); // 吞掉当前number
-    return std::move(Result);
-}
+    // 上次没有正常退出时会留下套接字文件，其他类型的文件不动
+    struct stat St;
+    if (stat(Path, &St) == 0 && S_ISSOCK(St.st_mode)) {
+        unlink(Path);
+    }
 
-// 括号的情况
-// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-    getNextToken(); // 吞掉'('
-    auto V = ParseExpression();
-    if (!V) {
-        return nullptr;
+    if (pipe2(WakeFds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("pipe");
+        return false;
+    }
+    int Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Fd < 0) {
+        perror("socket");
+        return false;
     }
+    if (bind(Fd, (sockaddr *)&Addr, sizeof(Addr)) != 0 || ::listen(Fd, 128) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", Path, strerror(errno));
+        close(Fd);
+        return false;
+    }
+    ListenFd = Fd;
+    return true;
+}
 
-    if (CurTok != ')') {
-        return LogError("expected ')'");
+Namespace &Server::getNamespace(const std::string &Name) {
+    std::lock_guard<std::mutex> L(NamespacesLock);
+    std::unique_ptr<Namespace> &NS = Namespaces[Name];
+    if (!NS) {
+        NS = std::make_unique<Namespace>();
+        configure(NS->Ctx, Opts);
     }
-    getNextToken(); // 吞掉')'
-    return V;
+    return *NS;
 }
 
-// identifierexpr
-// ::= identifier
-// ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
+std::string Server::evaluate(const std::string &Name, const std::string &Source) {
+    Namespace &NS = getNamespace(Name);
+    std::lock_guard<std::mutex> L(NS.Lock);
 
-    getNextToken(); // 吞掉identifier
+    std::string Out;
+    auto AppendDiagnostics = [&] {
+        for (const Diagnostic &D : NS.Ctx.getDiagnostics()) {
+            Out += "error " + std::to_string(D.Range.Begin.Line) + ":" +
+                   std::to_string(D.Range.Begin.Col) + ": " + D.Message + "\n";
+        }
+        NS.Ctx.clearDiagnostics();
+    };
 
-    // 简单的变量引用
-    if (CurTok != '(') {
-        return std::make_unique<VariableExprAST>(IdName);
-    }
+    bool Consumed = false;
+    auto ReadAll = [&](std::string &Chunk) {
+        if (Consumed) {
+            return false;
+        }
+        Consumed = true;
+        Chunk += Source;
+        return true;
+    };
+
+    auto AppendItem = [&](const TopLevelItem &Item) {
+        AppendDiagnostics();
+        switch (Item.K) {
+        case TopLevelItem::Definition:
+            Out += "def " + Item.Name + "\n";
+            break;
+        case TopLevelItem::Extern:
+            Out += "extern " + Item.Name + "\n";
+            break;
+        case TopLevelItem::Expression: {
+            char Value[32];
+            snprintf(Value, sizeof(Value), "%.17g", Item.Value);
+            Out += "value " + std::string(Value) + "\n";
+            break;
+        }
+        case TopLevelItem::Error:
+            break;
+        }
+    };
 
-    getNextToken(); // 吞掉'('
-    std::vector<std::unique_ptr<ExprAST>> Args;
-    // 排除()中没有表达式的情况
-    if (CurTok != ')') {
-        while (true) {
-            if (auto Arg = ParseExpression()) {
-                Args.push_back(std::move(Arg));
-            } else {
-                return nullptr;
-            }
-            
-            if (CurTok == ')') {
-                break;
-            }
+    NS.Ctx.eval(ReadAll, AppendItem);
+    AppendDiagnostics();
+    return Out;
+}
 
-            if (CurTok != ',') {
-                return LogError("Expected ')' or ',' in argument list");
-            }
-            getNextToken();
+// 写完所有数据，套接字是非阻塞的，写不进去时等待
+static bool writeAll(int Fd, const std::string &Data) {
+    size_t Done = 0;
+    while (Done != Data.size()) {
+        ssize_t N = send(Fd, Data.data() + Done, Data.size() - Done, MSG_NOSIGNAL);
+        if (N > 0) {
+            Done += N;
+        } else if (N < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd P = {Fd, POLLOUT, 0};
+            poll(&P, 1, -1);
+        } else if (N < 0 && errno != EINTR) {
+            return false;
         }
     }
-
-    getNextToken(); // 吞掉')'
-
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    return true;
 }
 
-// primary
-// ::= identifierexpr
-// ::= numberexpr
-// ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimay() {
-    switch (CurTok) {
-    default:
-        return LogError("unknown token when expecting an expression");
-    case tok_identifier:
-        return ParseIdentifierExpr();
-    case tok_number:
-        return ParseNumberExpr();
-    case '(':
-        return ParseParenExpr();
+static bool validNamespace(const std::string &Name) {
+    if (Name.empty() || Name.size() > MaxNamespaceLength) {
+        return false;
     }
+    for (char C : Name) {
+        if (!isalnum((unsigned char)C) && C != '_' && C != '-' && C != '.') {
+            return false;
+        }
+    }
+    return true;
 }
 
-// binoprhs
-// ::= ('+' primary)*
-// LHS是当前已经转换的部分
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, 
-                                              std::unique_ptr<ExprAST> LHS) {
+// 读入现在能读到的数据，处理其中所有完整的请求，不完整的留到下次
+// 返回false表示连接已经关闭或者出错，应该关掉它
+bool Server::serve(Connection &C) {
+    bool Closed = false;
+    char Buf[65536];
     while (true) {
-        int TokPrec = GetTokPrecedence();
+        ssize_t N = read(C.Fd, Buf, sizeof(Buf));
+        if (N > 0) {
+            C.In.append(Buf, N);
+        } else if (N == 0) {
+            Closed = true;
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
 
-        if (TokPrec < ExprPrec) {
-            // 运算符的优先级小于当前的优先级，直接返回LHS
-            return LHS; 
+    size_t Pos = 0;
+    while (true) {
+        size_t HeaderEnd = C.In.find('\n', Pos);
+        if (HeaderEnd == std::string::npos) {
+            // 请求头不会很长，太长说明不是合法的请求
+            if (C.In.size() - Pos > MaxNamespaceLength + 32) {
+                return false;
+            }
+            break;
         }
 
-        // 存储运算符
-        int BinOp = CurTok;
-        getNextToken();
+        std::string Header = C.In.substr(Pos, HeaderEnd - Pos);
+        size_t Space = Header.find(' ');
+        std::string Name = Header.substr(0, Space);
+        char *End = nullptr;
+        unsigned long long Length =
+            Space == std::string::npos ? 0 : strtoull(Header.c_str() + Space + 1, &End, 10);
+        if (!validNamespace(Name) || !End || *End || Length > MaxRequestSize) {
+            std::string Error = "error 0:0: malformed request\n";
+            writeAll(C.Fd, std::to_string(Error.size()) + "\n" + Error);
+            return false;
+        }
+        if (C.In.size() - HeaderEnd - 1 < Length) {
+            break;
+        }
 
-        // 拿到下一个primary，运行后此时的token指向下一个运算符
-        auto RHS = ParsePrimay();
-        if (!RHS) {
-            return nullptr;
+        std::string Result = evaluate(Name, C.In.substr(HeaderEnd + 1, Length));
+        if (!writeAll(C.Fd, std::to_string(Result.size()) + "\n" + Result)) {
+            return false;
         }
+        Pos = HeaderEnd + 1 + Length;
+    }
+    C.In.erase(0, Pos);
+    return !Closed;
+}
 
-        // 现在已经处理完了LHS以及序列中的下一个RHS，接下处理两者如何连接
-        // 一种有两种情况: (a+b) binop unparsed 或 a + (b binop unparsed)
-
-        int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec) {
-            // 情况: a + (b binop unparsed) 
-            // 当前运算符的优先级小于下一个运算符的优先级
-
-            // 要保证后续的RHS都被正确转换，先递归的转换RHS，将转换完成的RHS与LHS挂在一起
-            // 转换后续RHS的时候实际上是优先考虑的后续的运算符，即优先转换后面的部分
-            // 这里传入的RHS实际上是下一次调用的LHS，即已经转换之后的
-            // TokPrec + 1是因为后续的想要继续处理，那么后续运算符的优先级应该高于当前的运算符
-            // 如果不加1，那么后续大于或者等于的都可以继续处理
-            // 加1不会影响后续的函数功能，因为ExprPrec在后续函数没有继续做加1操作
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if (!RHS) {
-                return nullptr;
+void Server::work() {
+    while (true) {
+        Connection *C;
+        {
+            std::unique_lock<std::mutex> L(ReadyLock);
+            ReadyCV.wait(L, [&] { return Stopping || !Ready.empty(); });
+            if (Ready.empty()) {
+                return;
             }
+            C = Ready.front();
+            Ready.pop_front();
         }
 
-        // 情况: (a+b) binop unparsed
-        // 上述if相反的情况，RHS的下一个op的优先级小于当前的op，那么LHS和RHS分别居于op的两侧
-        // 使用下方代码连接
+        if (!serve(*C)) {
+            close(C->Fd);
+            delete C;
+            continue;
+        }
 
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+        {
+            std::lock_guard<std::mutex> L(ReturnedLock);
+            Returned.push_back(C);
+        }
+        // 管道满了说明主线程已经会被唤醒，写失败也没有关系
+        ssize_t Ignored = write(WakeFds[1], "w", 1);
+        (void)Ignored;
     }
 }
 
-// expression
-// ::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression() {
-    // 拿到一个表达式的第一个变量，然后将后续的交给ParseBinOPRHS
-    auto LHS = ParsePrimay();
-    if (!LHS) {
-        return nullptr;
+void Server::run(unsigned NumWorkers) {
+    // 求值在工作线程以及Context的并行求值、后台编译线程中进行，它们的栈默认和ulimit -s一样大
+    // 固定下来，解释器的递归深度限制才总有足够的余量，一个namespace的请求不会让整个进程崩溃
+    pthread_attr_t Attr;
+    pthread_attr_init(&Attr);
+    pthread_attr_setstacksize(&Attr, ThreadStackSize);
+    pthread_setattr_default_np(&Attr);
+    pthread_attr_destroy(&Attr);
+
+    SignalWakeFd = WakeFds[1];
+    struct sigaction SA = {};
+    SA.sa_handler = onStopSignal;
+    sigaction(SIGINT, &SA, nullptr);
+    sigaction(SIGTERM, &SA, nullptr);
+
+    std::vector<std::thread> Workers;
+    for (unsigned I = 0; I != NumWorkers; ++I) {
+        Workers.emplace_back([this] { work(); });
     }
 
-    return ParseBinOpRHS(0, std::move(LHS));
-}
+    // 等待数据的空闲连接，poll的前两项是监听的套接字和唤醒用的管道
+    std::vector<Connection *> Idle;
+    std::vector<pollfd> Fds;
+    while (!StopRequested) {
+        Fds.clear();
+        Fds.push_back({ListenFd, POLLIN, 0});
+        Fds.push_back({WakeFds[0], POLLIN, 0});
+        for (Connection *C : Idle) {
+            Fds.push_back({C->Fd, POLLIN, 0});
+        }
+        if (poll(Fds.data(), Fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
 
-// prototype
-// ParseDefination调用
-// ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    if (CurTok != tok_identifier) {
-        return LogErrorP("Expected function name in prototype");
-    }
+        // 有数据(或者已经关闭)的连接交给工作线程
+        size_t Kept = 0;
+        bool Dispatched = false;
+        for (size_t I = 0; I != Idle.size(); ++I) {
+            if (Fds[I + 2].revents) {
+                std::lock_guard<std::mutex> L(ReadyLock);
+                Ready.push_back(Idle[I]);
+                Dispatched = true;
+            } else {
+                Idle[Kept++] = Idle[I];
+            }
+        }
+        Idle.resize(Kept);
+        if (Dispatched) {
+            ReadyCV.notify_all();
+        }
 
-    std::string FnName = IdentifierStr;
-    getNextToken(); // 吞掉'('
+        if (Fds[1].revents & POLLIN) {
+            char Buf[256];
+            while (read(WakeFds[0], Buf, sizeof(Buf)) > 0) {
+            }
+            std::lock_guard<std::mutex> L(ReturnedLock);
+            Idle.insert(Idle.end(), Returned.begin(), Returned.end());
+            Returned.clear();
+        }
 
-    if (CurTok != '(') {
-        return LogErrorP("Expected '(' in prototype");
+        if (Fds[0].revents & POLLIN) {
+            int Fd = accept4(ListenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (Fd >= 0) {
+                Idle.push_back(new Connection{Fd, {}});
+            }
+        }
     }
 
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier) {
-        ArgNames.push_back(IdentifierStr);
+    // 已经交给工作线程的请求处理完再退出
+    {
+        std::lock_guard<std::mutex> L(ReadyLock);
+        Stopping = true;
     }
-
-    if (CurTok != ')') {
-        return LogErrorP("Expected ')' in prototype");
+    ReadyCV.notify_all();
+    for (std::thread &T : Workers) {
+        T.join();
     }
 
-    getNextToken(); // 吞掉')'
-
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+    Idle.insert(Idle.end(), Returned.begin(), Returned.end());
+    Returned.clear();
+    for (Connection *C : Idle) {
+        close(C->Fd);
+        delete C;
+    }
 }
 
-// defination ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefination() {
-    getNextToken(); // 吞掉def
-    auto Proto = ParsePrototype();
-    if (!Proto) {
-        return nullptr;
+void Server::printStatistics() {
+    if (Opts.TimePasses || Opts.PrintStats) {
+        for (auto &NS : Namespaces) {
+            fprintf(stderr, "namespace %s:\n", NS.first.c_str());
+            fputs(NS.second->Ctx.getStatisticsReport(Opts.TimePasses, Opts.PrintStats).c_str(),
+                  stderr);
+        }
     }
-
-    if (auto E = ParseExpression()) {
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    if (Opts.StatsJSON) {
+        // 按namespace分开，每个的格式和交互模式下一样
+        std::string JSON = "{";
+        for (auto &NS : Namespaces) {
+            std::string One = NS.second->Ctx.getStatisticsJSON();
+            One.pop_back(); // 去掉末尾的换行
+            JSON += (JSON.size() > 1 ? ",\n\"" : "\n\"") + NS.first + "\": " + One;
+        }
+        JSON += "\n}\n";
+        writeFile(Opts.StatsJSON, JSON);
     }
-
-    return nullptr;
 }
 
-// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        // 匿名的proto
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+static int runServer(const Options &Opts) {
+    Server S(Opts);
+    if (!S.listen(Opts.ServerPath)) {
+        return 1;
     }
-    return nullptr;
-}
 
-// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-    getNextToken(); // 吞掉extern
-    return ParsePrototype();
+    unsigned Workers = Opts.Workers;
+    if (!Workers) {
+        Workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    fprintf(stderr, "Listening on %s with %u workers\n", Opts.ServerPath, Workers);
+    S.run(Workers);
+    S.printStatistics();
+    return 0;
 }
 
 //=========
-// Top-Level parsing
+// Main driver code
 //=========
-static void HandleDefinition() {
-    if (ParseDefination()) {
-        fprintf(stderr, "Parsed a function defination.\n");
-    } else {
-        // 忽略错误的token
-        getNextToken();
+int main(int argc, char **argv) {
+    Options Opts;
+    for (int I = 1; I < argc; ++I) {
+        if (strcmp(argv[I], "-time-passes") == 0) {
+            Opts.TimePasses = true;
+        } else if (strcmp(argv[I], "-stats") == 0) {
+            Opts.PrintStats = true;
+        } else if (strncmp(argv[I], "-stats-json=", 12) == 0) {
+            Opts.StatsJSON = argv[I] + 12;
+        } else if (strncmp(argv[I], "-max-expr-depth=", 16) == 0) {
+            Opts.MaxExprDepth = atol(argv[I] + 16);
+        } else if (strncmp(argv[I], "-tier-threshold=", 16) == 0) {
+            Opts.TierThreshold = atol(argv[I] + 16);
+        } else if (strncmp(argv[I], "-backend=", 9) == 0) {
+            if (!parseBackend(argv[I] + 9, Opts.ExecBackend)) {
+                fprintf(stderr, "Unknown backend: %s\n", argv[I] + 9);
+                return 1;
+            }
+        } else if (strcmp(argv[I], "-lazy-defs") == 0) {
+            Opts.LazyDefinitions = true;
+        } else if (strncmp(argv[I], "-profile-in=", 12) == 0) {
+            Opts.ProfileIn = argv[I] + 12;
+        } else if (strncmp(argv[I], "-profile-out=", 13) == 0) {
+            Opts.ProfileOut = argv[I] + 13;
+        } else if (strncmp(argv[I], "-parallel=", 10) == 0) {
+            Opts.ParallelThreads = (unsigned)atoi(argv[I] + 10);
+        } else if (strncmp(argv[I], "-server=", 8) == 0) {
+            Opts.ServerPath = argv[I] + 8;
+        } else if (strncmp(argv[I], "-workers=", 9) == 0) {
+            Opts.Workers = (unsigned)atoi(argv[I] + 9);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[I]);
+            return 1;
+        }
     }
-}
 
-static void HandleExtern() {
-    if (ParseExtern()) {
-        fprintf(stderr, "Parsed an extern\n");
-    } else {
-        // 忽略错误的token
-        getNextToken();
+    if (Opts.ServerPath) {
+        return runServer(Opts);
     }
-}
 
-static void HandleTopLevelExpresison() {
-    if (ParseTopLevelExpr()) {
-        fprintf(stderr, "Parsed a top-level expr\n");
-    } else {
-        // 忽略错误的token
-        getNextToken();
-    }
-}
+    Context Ctx;
+    configure(Ctx, Opts);
 
-// top ::= definition | external | expresison | ';'
-static void MainLoop() {
-    while (true) {
-        fprintf(stderr, "ready>");
-        switch (CurTok) {
-        case tok_eof:
-            return;
-        case ';':
-            getNextToken();
+    // 每次读取一行，这样输入一行就能立即看到结果
+    auto ReadLine = [](std::string &Chunk) {
+        char Line[4096];
+        if (!fgets(Line, sizeof(Line), stdin)) {
+            return false;
+        }
+        Chunk += Line;
+        return true;
+    };
+
+    auto PrintItem = [&](const TopLevelItem &Item) {
+        for (const Diagnostic &D : Ctx.getDiagnostics()) {
+            if (D.Range.Begin.Line) {
+                fprintf(stderr, "LogError: %u:%u: %s\n", D.Range.Begin.Line,
+                        D.Range.Begin.Col, D.Message.c_str());
+            } else {
+                fprintf(stderr, "LogError: %s\n", D.Message.c_str());
+            }
+        }
+        Ctx.clearDiagnostics();
+
+        switch (Item.K) {
+        case TopLevelItem::Definition:
+            fprintf(stderr, "Parsed a function defination.\n");
             break;
-        case tok_def:
-            HandleDefinition();
+        case TopLevelItem::Extern:
+            fprintf(stderr, "Parsed an extern\n");
             break;
-        case tok_extern:
-            HandleExtern();
+        case TopLevelItem::Expression:
+            fprintf(stderr, "Evaluated to %f\n", Item.Value);
             break;
-        default:
-            HandleTopLevelExpresison();
+        case TopLevelItem::Error:
             break;
         }
-    }
-}
-
-//=========
-// Main driver code
-//=========
-int main() {
-    // 1是最低的优先级
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 30;
-    BinopPrecedence['*'] = 40;
+        fprintf(stderr, "ready> ");
+    };
 
     fprintf(stderr, "ready> ");
-    getNextToken();
+    Ctx.eval(ReadLine, PrintItem);
+    fprintf(stderr, "\n");
 
-    MainLoop();
+    if (Opts.TimePasses || Opts.PrintStats) {
+        fputs(Ctx.getStatisticsReport(Opts.TimePasses, Opts.PrintStats).c_str(), stderr);
+    }
+    if (Opts.StatsJSON && !writeFile(Opts.StatsJSON, Ctx.getStatisticsJSON())) {
+        return 1;
+    }
+    if (Opts.ProfileOut && !Ctx.saveProfile(Opts.ProfileOut)) {
+        fprintf(stderr, "Cannot write profile %s\n", Opts.ProfileOut);
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}